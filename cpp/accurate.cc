@@ -126,8 +126,8 @@ void data_source_statistics::report(std::ostream& s)
 		s << endl;
 	}
 
-	for(auto sid=stream_size.begin();sid!=stream_size.end();sid++) {
-		s << "stream[" << sid->first << "]=" << sid->second << endl;
+	for(auto&& ss : stream_size.ordered()) {
+		s << "stream[" << ss.first << "]=" << ss.second << endl;
 	}
 }
 
@@ -142,9 +142,26 @@ local_stream_stats_t dds::local_stream_stats;
 
 
 
+/*
+	If the key range of the data is known and not too large, the
+	histograms keep their counters in a dense array indexed by key.
+  */
+static constexpr size_t max_dense_histogram = 1<<22;
+
+static void bind_key_range(frequency_vector<key_type>& hist)
+{
+	if(! CTX.has_data_feed()) return;
+	const ds_metadata& dsm = CTX.metadata();
+	if(dsm.valid() && dsm.minkey() <= dsm.maxkey() 
+		&& (size_t)((long long)dsm.maxkey() - dsm.minkey()) < max_dense_histogram)
+		hist.set_dense_range(dsm.minkey(), dsm.maxkey());
+}
+
+
 selfjoin_exact_method::selfjoin_exact_method(const string& n, stream_id sid)
 : query_method(n, self_join(sid)) 
 { 
+	bind_key_range(histogram);
 	on(START_STREAM, [&]() { process_warmup(CTX.warmup); });
 	on(START_RECORD, [&](){ process_record(CTX.stream_record()); });
 	on(END_STREAM, [&](){  finish(); });
@@ -184,6 +201,8 @@ void selfjoin_exact_method::finish()
 twoway_join_exact_method::twoway_join_exact_method(const string& n, stream_id s1, stream_id s2)
 : query_method(n, join(s1,s2)) 
 { 
+	bind_key_range(hist1);
+	bind_key_range(hist2);
 	on(START_STREAM, [&]() { process_warmup(CTX.warmup); });
 	on(START_RECORD, [=](){ process_record(CTX.stream_record()); 
 	});
@@ -237,11 +256,13 @@ agms_sketch_updater::agms_sketch_updater(stream_id _sid, agms::projection proj)
 : sid(_sid), isk(proj)
 {
 	on(START_STREAM, [&]() {
-		for(auto&& rec : CTX.warmup) {
-			if(rec.sid==sid) {
-				isk.update(rec.key, rec.upd);
-			}
-		}
+		// build the sketch from the warmup records of the stream
+		agms::parallel_update(isk.view(), CTX.warmup.begin(), CTX.warmup.end(),
+			[&](const dds_record& rec, size_t& key, double& freq) {
+				key = rec.key;
+				freq = rec.upd;
+				return rec.sid==sid;
+			});
 		emit(STREAM_SKETCH_INITIALIZED);
 	});
 
@@ -292,7 +313,7 @@ void selfjoin_agms_method::process_record()
 	using namespace agms;
 
 	if(CTX.stream_record().sid==Q.operand(0)) {
-		curest = dot_est_inc(incstate, isk->delta);
+		curest = dot_est_inc(incstate, isk->delta, isk->proj);
 	}
 }
 
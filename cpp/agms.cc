@@ -1,10 +1,13 @@
 #include <random>
 #include <unordered_map>
+#include <map>
+#include <tuple>
 #include <cstdio>
 
 #include <boost/functional/hash.hpp>
 
 #include "agms.hh"
+#include "agms_fixed.hh"
 
 using namespace std;
 
@@ -17,16 +20,43 @@ using namespace agms;
 
 static mt19937_64 engine;
 
-hash_family::hash_family(depth_type _D) : D(_D)
+hash_family::hash_family(depth_type _D, hash_policy _pol, uint64_t _seed) 
+: D(_D), pol(_pol), sd(_seed), T(nullptr)
 {
 	if(_D==0) throw std::domain_error("0 depth in hash family");
 
 	uniform_int_distribution<int64_t> U;
 
+	// The legacy family uses the shared engine. Otherwise, the depth is
+	// mixed into the seed, so that families of different depths do not
+	// share their leading coefficients.
+	seed_seq seeds { uint32_t(_seed), uint32_t(_seed>>32), uint32_t(_D) };
+	mt19937_64 local_engine(seeds);
+	mt19937_64& eng = (pol==hash_policy::poly31 && _seed==0) ? engine : local_engine;
+
+	F[0] = new int64_t[6*_D];
 	for(size_t i=0; i<6; i++) {
-		F[i] = new int64_t[_D];
+		F[i] = F[0] + i*_D;
 		for(size_t d=0; d<_D; d++)
-			F[i][d] = U(engine);
+			F[i][d] = U(eng);
+	}
+
+	switch(pol) {
+		case hash_policy::multiply_shift:
+			// multipliers must be odd
+			for(size_t d=0; d<_D; d++) {
+				F[0][d] |= 1;
+				F[2][d] |= 1;
+			}
+			break;
+		case hash_policy::tabulation:
+			T = new uint64_t[_D*4*256];
+			// the full 64 bits are used (the top bit is the sign)
+			for(size_t i=0; i<_D*4*256; i++)
+				T[i] = eng();
+			break;
+		default:
+			break;
 	}
 
 #if 0  // printout the random projection seeds
@@ -43,14 +73,14 @@ hash_family::hash_family(depth_type _D) : D(_D)
 
 hash_family::~hash_family()
 {
-	for(size_t i=0; i<6; i++)
-		delete[] F[i];
+	delete[] F[0];
+	delete[] T;
 }
 
 
 // A cache type for hash families, which is cleared at destruction
 struct agms_hf_cache 
-	: unordered_map<depth_type, hash_family*> 
+	: map< tuple<hash_policy, depth_type, uint64_t>, hash_family*> 
 {
 	~agms_hf_cache() {
 		for(auto x : *this) 
@@ -62,13 +92,15 @@ struct agms_hf_cache
 static agms_hf_cache cache;
 
 
-hash_family* hash_family::get_cached(depth_type D)
+hash_family* hash_family::get_cached(depth_type D, hash_policy policy, uint64_t seed)
 {
-    if(cache.find(D)!=cache.end())
-            return cache[D];
+	auto key = make_tuple(policy, D, seed);
+	auto it = cache.find(key);
+    if(it!=cache.end())
+            return it->second;
     else {
-        hash_family* ret = new hash_family(D);
-        cache[D] = ret;
+        hash_family* ret = new hash_family(D, policy, seed);
+        cache[key] = ret;
         return ret;
 	}
 }
@@ -82,16 +114,191 @@ inline int64_t hash31(int64_t a, int64_t b, int64_t x) {
 	return ((result>>31)^result) & 2147483647ll;
 }
 
+
+//
+// The hash functions of the other policies. Each computes a 64-bit 
+// value, whose low 31 bits are the hash and whose top bit is the sign.
+//
+
+// Multiply-add-shift: the top 31 bits of a*x+b
+static inline uint64_t ms_hash(uint64_t a, uint64_t b, uint64_t x) {
+	return (a*x+b) >> 33;
+}
+static inline bool ms_sign(uint64_t a, uint64_t b, uint64_t x) {
+	return (a*x+b) >> 63;
+}
+
+// The splitmix64 finalizer
+static inline uint64_t mix64(uint64_t z) {
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+// Simple tabulation over the bytes of the 32-bit fold of x
+static inline uint64_t tab64(const uint64_t* Td, uint64_t x) {
+	const uint32_t y = x ^ (x>>32);
+	return Td[y & 255] ^ Td[256 + ((y>>8) & 255)] 
+		^ Td[512 + ((y>>16) & 255)] ^ Td[768 + (y>>24)];
+}
+
+
 size_t hash_family::hash(depth_type d, size_t x) const {
 	assert(d<D);
-	return hash31(F[0][d], F[1][d], x);
+	switch(pol) {
+		case hash_policy::tabulation:
+			return tab64(T+d*1024, x) & 2147483647ull;
+		case hash_policy::multiply_shift:
+			return ms_hash(F[0][d], F[1][d], x);
+		case hash_policy::mix64:
+			return mix64(x + F[0][d]) & 2147483647ull;
+		default:
+			return hash31(F[0][d], F[1][d], x);
+	}
 }
 
 /// Return a 4-wise independent bit
 bool hash_family::fourwise(depth_type d, size_t x) const {
-	return 
-		hash31(hash31(hash31(x,F[2][d],F[3][d]), x, F[4][d]),x,F[5][d]) 
-		& (1<<15);
+	switch(pol) {
+		case hash_policy::tabulation:
+			return tab64(T+d*1024, x) >> 63;
+		case hash_policy::multiply_shift:
+			return ms_sign(F[2][d], F[3][d], x);
+		case hash_policy::mix64:
+			return mix64(x + F[0][d]) >> 63;
+		default:
+			return 
+				hash31(hash31(hash31(x,F[2][d],F[3][d]), x, F[4][d]),x,F[5][d]) 
+				& (1<<15);
+	}
+}
+
+bool hash_family::pairwise(depth_type d, size_t x) const {
+	switch(pol) {
+		case hash_policy::poly31:
+			return pairwise31u(x, F[2][d], F[3][d]);
+		case hash_policy::mix64:
+			// fourwise() shares the mixed value of hash(); mix with another seed
+			return mix64(x + F[1][d]) >> 63;
+		default:
+			return fourwise(d, x);
+	}
+}
+
+
+void hash_family::hash_all(size_t x, size_t* h) const 
+{
+	const uint64_t* __restrict a = (const uint64_t*) F[0];
+	const uint64_t* __restrict b = (const uint64_t*) F[1];
+	switch(pol) {
+		case hash_policy::tabulation:
+			for(depth_type d=0; d<D; d++)
+				h[d] = tab64(T+d*1024, x) & 2147483647ull;
+			break;
+		case hash_policy::multiply_shift:
+			for(depth_type d=0; d<D; d++)
+				h[d] = ms_hash(a[d], b[d], x);
+			break;
+		case hash_policy::mix64:
+			for(depth_type d=0; d<D; d++)
+				h[d] = mix64(x + a[d]) & 2147483647ull;
+			break;
+		default:
+			for(depth_type d=0; d<D; d++)
+				h[d] = hash31u(a[d], b[d], x);
+	}
+}
+
+
+void hash_family::fourwise_all(size_t x, bool* s) const 
+{
+	const uint64_t* __restrict f2 = (const uint64_t*) F[2];
+	const uint64_t* __restrict f3 = (const uint64_t*) F[3];
+	const uint64_t* __restrict f4 = (const uint64_t*) F[4];
+	const uint64_t* __restrict f5 = (const uint64_t*) F[5];
+	switch(pol) {
+		case hash_policy::tabulation:
+			for(depth_type d=0; d<D; d++)
+				s[d] = tab64(T+d*1024, x) >> 63;
+			break;
+		case hash_policy::multiply_shift:
+			for(depth_type d=0; d<D; d++)
+				s[d] = ms_sign(f2[d], f3[d], x);
+			break;
+		case hash_policy::mix64:
+			for(depth_type d=0; d<D; d++)
+				s[d] = mix64(x + F[0][d]) >> 63;
+			break;
+		default:
+			for(depth_type d=0; d<D; d++)
+				s[d] = fourwise31u(x, f2[d], f3[d], f4[d], f5[d]);
+	}
+}
+
+
+void hash_family::pairwise_all(size_t x, bool* s) const 
+{
+	if(pol == hash_policy::mix64) {
+		for(depth_type d=0; d<D; d++)
+			s[d] = mix64(x + F[1][d]) >> 63;
+		return;
+	}
+	if(pol != hash_policy::poly31) {
+		fourwise_all(x, s);
+		return;
+	}
+	const uint64_t* __restrict f2 = (const uint64_t*) F[2];
+	const uint64_t* __restrict f3 = (const uint64_t*) F[3];
+	for(depth_type d=0; d<D; d++)
+		s[d] = pairwise31u(x, f2[d], f3[d]);
+}
+
+
+void hash_family::hash_batch(const size_t* x, size_t n, size_t* h, bool* s) const
+{
+	if(pol != hash_policy::poly31) {
+		// The other policies are cheap per key; evaluate key by key
+		for(size_t i=0; i<n; i++)
+			for(depth_type d=0; d<D; d++) {
+				if(h) h[d*n+i] = hash(d, x[i]);
+				if(s) s[d*n+i] = fourwise(d, x[i]);
+			}
+		return;
+	}
+
+	// Depth-major loops: the coefficients are fixed in the inner loop,
+	// which runs over the keys.
+	for(depth_type d=0; d<D; d++) {
+		if(h) {
+			const uint64_t a = F[0][d], b = F[1][d];
+			size_t* __restrict hd = h + d*n;
+			for(size_t i=0; i<n; i++)
+				hd[i] = hash31u(a, b, x[i]);
+		}
+		if(s) {
+			const uint64_t f2 = F[2][d], f3 = F[3][d], f4 = F[4][d], f5 = F[5][d];
+			bool* __restrict sd = s + d*n;
+			for(size_t i=0; i<n; i++)
+				sd[i] = fourwise31u(x[i], f2, f3, f4, f5);
+		}
+	}
+}
+
+
+void hash_family::pairwise_batch(const size_t* x, size_t n, bool* s) const
+{
+	if(pol != hash_policy::poly31) {
+		for(size_t i=0; i<n; i++)
+			for(depth_type d=0; d<D; d++)
+				s[d*n+i] = pairwise(d, x[i]);
+		return;
+	}
+	for(depth_type d=0; d<D; d++) {
+		const uint64_t f2 = F[2][d], f3 = F[3][d];
+		bool* __restrict sd = s + d*n;
+		for(size_t i=0; i<n; i++)
+			sd[i] = pairwise31u(x[i], f2, f3);
+	}
 }
 
 
@@ -99,9 +306,16 @@ bool hash_family::fourwise(depth_type d, size_t x) const {
 void projection::update_index(size_t key, Index& idx) const
 {
 	assert(idx.size()==depth());
+	if(const key_cell_table* kt = key_table(); kt && kt->contains(key)) {
+		const uint32_t* c = kt->cells(key);
+		for(size_t d=0; d<depth(); d++)
+			idx[d] = c[d] & ~key_cell_table::sign_bit;
+		return;
+	}
+	hf->hash_all(key, &idx[0]);
 	size_t stride = 0;
 	for(size_t d=0; d<depth(); d++) {
-		idx[d] = stride + hf->hash(d, key) % L;
+		idx[d] = stride + idx[d] % L;
 		stride += width();
 	}
 }
@@ -109,9 +323,222 @@ void projection::update_index(size_t key, Index& idx) const
 void projection::update_mask(size_t key, Mask& mask) const 
 {
 	assert(mask.size()==depth());
+	if(const key_cell_table* kt = key_table(); kt && kt->contains(key)) {
+		const uint32_t* c = kt->cells(key);
+		for(size_t d=0; d<depth(); d++)
+			mask[d] = c[d] >> 31;
+		return;
+	}
+	switch(fam) {
+		case sketch_family::count_min:
+			mask = true;
+			break;
+		case sketch_family::count_sketch:
+			hf->pairwise_all(key, &mask[0]);
+			break;
+		default:
+			hf->fourwise_all(key, &mask[0]);
+	}
+}
+
+
+bool projection::fourwise(depth_type d, size_t key) const
+{
+	switch(fam) {
+		case sketch_family::count_min:
+			return true;
+		case sketch_family::count_sketch:
+			return hf->pairwise(d,key);
+		default:
+			return hf->fourwise(d,key);
+	}
+}
+
+
+void projection::hash_key(size_t key, size_t* idx, bool* sgn) const
+{
+	hf->hash_all(key, idx);
+	const depth_type D = depth();
+	switch(fam) {
+		case sketch_family::count_min:
+			std::fill(sgn, sgn+D, true);
+			break;
+		case sketch_family::count_sketch:
+			hf->pairwise_all(key, sgn);
+			break;
+		default:
+			hf->fourwise_all(key, sgn);
+	}
+	size_t stride = 0;
+	for(size_t d=0; d<D; d++) {
+		idx[d] = stride + idx[d] % L;
+		stride += L;
+	}
+}
+
+
+void projection::hash_cells(size_t key, size_t* idx, bool* sgn) const
+{
+	if(const key_cell_table* kt = key_table(); kt && kt->contains(key))
+		kt->lookup(key, idx, sgn);
+	else
+		hash_key(key, idx, sgn);
+}
+
+
+void projection::hash_cells(const size_t* keys, size_t n, size_t* idx, bool* sgn) const
+{
+	if(const key_cell_table* kt = key_table()) {
+		const depth_type D = depth();
+		size_t ic[D];
+		bool sc[D];
+		for(size_t i=0; i<n; i++) {
+			if(kt->contains(keys[i])) 
+				kt->lookup(keys[i], ic, sc);
+			else
+				hash_key(keys[i], ic, sc);
+			for(size_t d=0; d<D; d++) {
+				idx[d*n+i] = ic[d];
+				sgn[d*n+i] = sc[d];
+			}
+		}
+		return;
+	}
+
+	// The 4-wise bits are only needed by the agms family
+	hf->hash_batch(keys, n, idx, (fam==sketch_family::agms) ? sgn : nullptr);
+	if(fam==sketch_family::count_min)
+		std::fill(sgn, sgn+depth()*n, true);
+	else if(fam==sketch_family::count_sketch)
+		hf->pairwise_batch(keys, n, sgn);
+
+	size_t stride = 0;
 	for(size_t d=0; d<depth(); d++) {
-		mask[d] = hf->fourwise(d, key);
-	}		
+		size_t* idx_d = idx + d*n;
+		for(size_t i=0; i<n; i++)
+			idx_d[i] = stride + idx_d[i] % L;
+		stride += L;
+	}
+}
+
+
+bool projection::bind_key_range(size_t kmin, size_t kmax, size_t max_bytes)
+{
+	kct.reset();
+	if(hf==nullptr || kmin>kmax || kmax-kmin == SIZE_MAX)
+		return false;
+	// the offsets must fit in 31 bits
+	if(size() >= key_cell_table::sign_bit)
+		return false;
+	if(key_cell_table::byte_size(depth(), kmin, kmax) > max_bytes)
+		return false;
+	kct = key_cell_table::get(*this, kmin, kmax);
+	return true;
+}
+
+
+//---------------------------
+// key_cell_table methods
+//---------------------------
+
+size_t key_cell_table::byte_size(depth_type D, size_t kmin, size_t kmax)
+{
+	size_t nkeys = kmax-kmin+1;
+	if(nkeys > SIZE_MAX/(D*sizeof(uint32_t)))
+		return SIZE_MAX;
+	return nkeys*D*sizeof(uint32_t);
+}
+
+
+key_cell_table::key_cell_table(const projection& proj, size_t _kmin, size_t _kmax)
+: hf(proj.hashf()), L(proj.width()), fam(proj.family()), D(proj.depth()), 
+  kmin(_kmin), kmax(_kmax)
+{
+	assert(kmin<=kmax);
+	assert(D*L < sign_bit);
+
+	const size_t nkeys = kmax-kmin+1;
+	tab.resize(nkeys*D);
+
+	// Small tables are filled directly; else, split the range among threads
+	constexpr size_t min_keys_per_thread = 1<<16;
+	par::for_shards(nkeys, par::num_threads(nkeys, min_keys_per_thread),
+		[&](size_t, size_t from, size_t to) { fill(from, to); });
+}
+
+
+void key_cell_table::fill(size_t from, size_t to)
+{
+	// an unbound projection, which hashes the keys
+	projection proj(hf, L, fam);
+
+	size_t keys[batch_chunk];
+	size_t h[D*batch_chunk];
+	bool s[D*batch_chunk];
+
+	for(size_t b=from; b<to; b+=batch_chunk) {
+		const size_t m = std::min(batch_chunk, to-b);
+		for(size_t i=0; i<m; i++)
+			keys[i] = kmin+b+i;
+		proj.hash_cells(keys, m, h, s);
+		for(size_t i=0; i<m; i++) {
+			uint32_t* c = &tab[(b+i)*D];
+			for(depth_type d=0; d<D; d++)
+				c[d] = h[d*m+i] | (s[d*m+i] ? sign_bit : 0);
+		}
+	}
+}
+
+
+typedef std::map<std::tuple<const hash_family*, size_t, sketch_family, size_t, size_t>, 
+	std::weak_ptr<const key_cell_table> > key_cell_table_cache;
+
+// The key table cache variable
+static key_cell_table_cache kct_cache;
+
+
+std::shared_ptr<const key_cell_table> 
+key_cell_table::get(const projection& proj, size_t kmin, size_t kmax)
+{
+	auto key = make_tuple(proj.hashf(), proj.width(), proj.family(), kmin, kmax);
+	auto ret = kct_cache[key].lock();
+	if(! ret) {
+		// drop the entries of released tables, so the cache does not grow
+		for(auto it = kct_cache.begin(); it != kct_cache.end(); )
+			if(it->second.expired()) 
+				it = kct_cache.erase(it);
+			else
+				++it;
+		ret = std::make_shared<const key_cell_table>(proj, kmin, kmax);
+		kct_cache[key] = ret;
+	}
+	return ret;
+}
+
+
+size_t key_cell_table::cached()
+{
+	return kct_cache.size();
+}
+
+
+const fixed_shape_kernel* agms::find_fixed_shape(depth_type D, size_t L)
+{
+	// The precompiled shapes
+	static const fixed_shape_kernel* shapes[] = {
+		&fixed_shape<5,250>::kernel, &fixed_shape<5,500>::kernel,
+		&fixed_shape<5,1000>::kernel, &fixed_shape<5,1024>::kernel,
+		&fixed_shape<7,250>::kernel, &fixed_shape<7,500>::kernel,
+		&fixed_shape<7,1000>::kernel, &fixed_shape<7,1024>::kernel,
+		&fixed_shape<9,250>::kernel, &fixed_shape<9,500>::kernel,
+		&fixed_shape<9,1000>::kernel, &fixed_shape<9,1024>::kernel,
+		&fixed_shape<11,250>::kernel, &fixed_shape<11,500>::kernel,
+		&fixed_shape<11,1000>::kernel, &fixed_shape<11,1024>::kernel
+	};
+
+	for(auto k : shapes)
+		if(k->depth==D && k->width==L) return k;
+	return nullptr;
 }
 
 
@@ -123,6 +550,7 @@ size_t std::hash<projection>::operator()( const projection& p) const
 	size_t seed = 0;
 	hash_combine(seed, hash_value(p.hashf()));
 	hash_combine(seed, hash_value(p.width()));
+	hash_combine(seed, hash_value((int) p.family()));
 	return seed;
 }
 
@@ -147,24 +575,24 @@ inc_sketch_updater::inc_sketch_updater(sketch& _sk)
 
 void inc_sketch_updater::update(size_t key, double freq)
 {
-	sk.proj.update_index(key, delta.index);
-	sk.proj.update_mask(key, mask);
+	sk.proj.hash_cells(key, &delta.index[0], &mask[0]);
 	
-	delta.xold = sk[delta.index];
 	for(size_t d=0; d<mask.size(); d++) {
+		double& c = sk[delta.index[d]];
+		delta.xold[d] = c;
 		if(mask[d])
 			delta.xnew[d] = delta.xold[d] + freq;
 		else
 			delta.xnew[d] = delta.xold[d] - freq;
+		c = delta.xnew[d];
 	}
-	
-	sk[delta.index] = delta.xnew;
 }
 
 
 
-isketch::isketch(const projection& _proj)
-	: 	sketch(_proj), 
+template <typename Counter>
+basic_isketch<Counter>::basic_isketch(const projection& _proj)
+	: 	sketch_type(_proj), 
 		delta(proj.depth()),
 		mask(proj.depth())
 	{ 	}
@@ -172,18 +600,47 @@ isketch::isketch(const projection& _proj)
 
 
 
-void isketch::update(size_t key, double freq)
+template <typename Counter>
+void basic_isketch<Counter>::update(size_t key, double freq)
 {
-	proj.update_index(key, delta.index);
-	proj.update_mask(key, mask);
-	
-	delta.xold = (*this)[delta.index];
+	proj.hash_cells(key, &delta.index[0], &mask[0]);
+
+	// compute all new values before changing any counter, so that an 
+	// overflow leaves the sketch unchanged
+	Counter* S = std::begin(*this);
 	for(size_t d=0; d<mask.size(); d++) {
-		if(mask[d])
-			delta.xnew[d] = delta.xold[d] + freq;
-		else
-			delta.xnew[d] = delta.xold[d] - freq;
+		Counter c = S[delta.index[d]];
+		delta.xold[d] = c;
+		counter_add(c, mask[d] ? freq : -freq);
+		delta.xnew[d] = c;
 	}
-	
-	(*this)[delta.index] = delta.xnew;
+	for(size_t d=0; d<mask.size(); d++)
+		S[delta.index[d]] = delta.xnew[d];
 }
+
+
+template <typename Counter>
+void basic_isketch<Counter>::update_batch(const size_t* keys, const double* freqs, size_t n)
+{
+	if(n==0) return;
+	this->view().update_batch(keys, freqs, n-1);
+
+	// The last update records its delta
+	update(keys[n-1], freqs[n-1]);
+}
+
+
+template <typename Counter>
+void basic_isketch<Counter>::update_batch(std::vector<delta_vector>& deltas, 
+	const size_t* keys, const double* freqs, size_t n)
+{
+	if(n==0) return;
+	this->view().update_batch(deltas, keys, freqs, n);
+	delta = deltas[n-1];
+}
+
+
+template struct agms::basic_isketch<double>;
+template struct agms::basic_isketch<float>;
+template struct agms::basic_isketch<int32_t>;
+template struct agms::basic_isketch<int16_t>;
@@ -4,8 +4,14 @@
 #include <cassert>
 #include <algorithm>
 #include <type_traits>
+#include <vector>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+#include <memory>
 
 #include "hdv.hh"
+#include "parallel.hh"
 
 namespace agms {
 
@@ -23,6 +29,54 @@ using hdv::Index;
 using hdv::Mask;
 
 
+/**
+	The hashing scheme of a hash family.
+
+	- \c poly31 is the original scheme: \c hash is a 2-wise independent
+	  31-bit polynomial hash and \c fourwise is a degree-3 polynomial,
+	  as in the AGMS paper.
+	- \c tabulation is simple tabulation hashing over the 4 bytes of 
+	  (the 32-bit fold of) the key; it is 3-wise independent and uses a 
+	  table of 8 kbytes per depth.
+	- \c multiply_shift is the multiply-add-shift scheme of Dietzfelbinger,
+	  which is 2-wise independent (for both hash and sign).
+	- \c mix64 is a fast non-cryptographic mixer (the splitmix64 finalizer)
+	  applied to the seeded key. It gives no independence guarantee.
+
+	The weaker schemes do not satisfy the 4-wise independence assumed 
+	by the AGMS error bounds, but are much faster.
+  */
+enum class hash_policy {
+	poly31,
+	tabulation,
+	multiply_shift,
+	mix64
+};
+
+
+/**
+	The family of a sketch, which determines the sign of each update
+	and the estimator over the rows.
+
+	- \c agms is the Fast-AGMS sketch: the sign of a key in each row is
+	  a 4-wise independent bit, and estimates are the median over the rows.
+	- \c count_min is the Count-Min sketch: all signs are positive, and 
+	  estimates are the minimum over the rows. For streams with non-negative 
+	  frequencies, each row overestimates, so that fewer rows are needed 
+	  than for the median.
+	- \c count_sketch is the Count-Sketch, where the sign of a key in a row
+	  is a 2-wise independent bit (see \c hash_family::pairwise), drawn 
+	  independently of the bucket; estimates are the median over the rows.
+
+	All families share the same sketch layout of \f$ D\times L\f$ counters.
+  */
+enum class sketch_family {
+	agms,
+	count_min,
+	count_sketch
+};
+
+
 /**
 	@brief A hash family for AGMS sketches.
 
@@ -35,39 +89,284 @@ using hdv::Mask;
 	Using the hash family, one can use functions \c hash31 and
 	\c fourwise to map a key \f$ x \f$ of type \c size_t to 
 	an index \f$ z \f$ of type \c size_t.
+
+	The coefficients are stored in a single block, as six 
+	contiguous arrays of length \f$ D \f$ (one per coefficient).
+	This layout allows the batched methods \c hash_all,
+	\c fourwise_all and \c hash_batch to evaluate all depths
+	(and many keys) in tight loops, which the compiler can 
+	vectorize. The batched methods return exactly the same values
+	as the per-depth methods.
   */
 class hash_family
 {
 public:
-	/// Construct a hash family of the given depth
-	hash_family(depth_type D);
+	/**
+		Construct a hash family of the given depth, policy and seed.
+
+		For the \c poly31 policy and a zero seed, the coefficients are
+		drawn from a shared random engine, as in earlier versions. Otherwise,
+		the coefficients are drawn from an engine seeded by \c seed and
+		the depth, so that families of different depths are independent.
+	  */
+	hash_family(depth_type D, hash_policy policy = hash_policy::poly31, 
+		uint64_t seed = 0);
 
 	~hash_family();
 
+	hash_family(const hash_family&) = delete;
+	hash_family& operator=(const hash_family&) = delete;
+
 	/// Return the hash for a key
 	size_t hash(depth_type d, size_t x) const;
 
 	/// Return a 4-wise independent 
 	bool fourwise(depth_type d, size_t x) const;
 
+	/// Compute \c hash(d,x) for all depths into \c h[0..D)
+	void hash_all(size_t x, size_t* h) const;
+
+	/// Compute \c fourwise(d,x) for all depths into \c s[0..D)
+	void fourwise_all(size_t x, bool* s) const;
+
+	/**
+		Return a 2-wise independent bit, which is independent of
+		\c hash(d,x). It is cheaper than \c fourwise for the \c poly31
+		policy. The \c tabulation and \c multiply_shift policies return 
+		\c fourwise(d,x), which is already independent of the hash.
+	  */
+	bool pairwise(depth_type d, size_t x) const;
+
+	/// Compute \c pairwise(d,x) for all depths into \c s[0..D)
+	void pairwise_all(size_t x, bool* s) const;
+
+	/**
+		Compute hashes and 4-wise bits for \c n keys.
+
+		The outputs are in depth-major order, that is, 
+		\c h[d*n+i] is \c hash(d,x[i]) and \c s[d*n+i] is
+		\c fourwise(d,x[i]). Either output may be null.
+	  */
+	void hash_batch(const size_t* x, size_t n, size_t* h, bool* s) const;
+
+	/// As \c hash_batch, computing \c pairwise(d,x[i]) into \c s[d*n+i]
+	void pairwise_batch(const size_t* x, size_t n, bool* s) const;
+
 	/// Depth of the hash family
 	inline depth_type depth() const { return D; }
 
+	/// The hashing scheme
+	inline hash_policy policy() const { return pol; }
+
+	/// The seed of the hash family
+	inline uint64_t seed() const { return sd; }
+
+	/// The array of the i-th coefficient over all depths (0<=i<6)
+	inline const int64_t* coefficients(size_t i) const { return F[i]; }
+
 protected:
 
 	depth_type D;
-	int64_t * F[6];
+	hash_policy pol;
+	uint64_t sd;
+	int64_t * F[6];   // F[i] points into a single block of 6*D coefficients
+	uint64_t * T;	  // tabulation tables, 4*256 per depth (or null)
 
 public:
-	static hash_family* get_cached(depth_type D);
+	/// Return a shared hash family, for the given depth, policy and seed
+	static hash_family* get_cached(depth_type D, 
+		hash_policy policy = hash_policy::poly31, uint64_t seed = 0);
+
+};
+
+
+/**
+	The 31-bit hash used by hash families.
 
+	This is computed in unsigned arithmetic, which is well-defined on
+	overflow and vectorizes well. Since only the low 31 bits 
+	of \f$ (r\gg 31)\oplus r \f$ are returned, the result does not depend
+	on the shift being arithmetic or logical.
+  */
+inline uint64_t hash31u(uint64_t a, uint64_t b, uint64_t x) {
+	uint64_t result = (a * x)+b;
+	return ((result>>31)^result) & 2147483647ull;
+}
+
+/**
+	The 4-wise independent bit of a hash family, given its 
+	coefficients \c F[2..5] for some depth.
+  */
+inline bool fourwise31u(uint64_t x, uint64_t f2, uint64_t f3, 
+		uint64_t f4, uint64_t f5)
+{
+	return hash31u(hash31u(hash31u(x,f2,f3), x, f4), x, f5) & (1<<15);
+}
+
+/**
+	The 2-wise independent bit of a hash family, given its 
+	coefficients \c F[2..3] for some depth.
+  */
+inline bool pairwise31u(uint64_t x, uint64_t f2, uint64_t f3)
+{
+	return hash31u(f2, f3, x) >> 30;
+}
+
+
+/**
+	Operations specialized for a fixed sketch shape on \c double counters.
+
+	Instances are provided by \c fixed_shape<D,L> (see agms_fixed.hh). A 
+	projection bound to a kernel (see \c projection::bind_fixed_shape) 
+	uses it for sketch views over \c Vec.
+  */
+struct fixed_shape_kernel
+{
+	depth_type depth;
+	size_t width;
+
+	void (*update)(const hash_family*, double* S, size_t key, double freq);
+	void (*update_delta)(const hash_family*, double* S, delta_vector& delta, 
+		size_t key, double freq);
+	void (*dot_estvec)(const double* S1, const double* S2, double* out);
 };
 
 
+/**
+	Return the kernel for a fixed sketch shape, or null if
+	the shape is not one of the precompiled shapes.
+  */
+const fixed_shape_kernel* find_fixed_shape(depth_type D, size_t L);
+
+
+/**
+	Add a value to a sketch counter.
+
+	For integral counter types, and for floating-point types narrower than
+	\c double, an overflow throws \c std::overflow_error; the counter is 
+	then left unchanged. For \c double counters this is a plain addition.
+  */
+template <typename Counter, typename T>
+inline void counter_add(Counter& c, T f)
+{
+	if constexpr (std::is_integral<Counter>::value) {
+		Counter r;
+		if(__builtin_add_overflow(c, (long long) f, &r))
+			throw std::overflow_error("sketch counter overflow");
+		c = r;
+	} else if constexpr (std::is_floating_point<Counter>::value 
+			&& sizeof(Counter)<sizeof(double)) {
+		Counter r = c + f;
+		if(! std::isfinite(r))
+			throw std::overflow_error("sketch counter overflow");
+		c = r;
+	} else {
+		c += f;
+	}
+}
+
+
 template <typename IterType>
 struct sketch_view;
 
 
+/**
+	The number of keys hashed together by the batch update methods.
+
+	Batches are processed in chunks of this size, so that the hashed
+	cells of a chunk (for all depths) fit in a small stack buffer.
+  */
+constexpr size_t batch_chunk = 128;
+
+
+class projection;
+
+
+/**
+	A precomputed table of the cells of a bounded range of keys.
+
+	For each key \f$ x\in [k_{min}, k_{max}] \f$ and each depth \f$ d \f$,
+	the table holds a 32-bit entry, whose low 31 bits are the offset
+	\c d*L+hash(d,x)%L of the cell of \f$ x \f$ in row \f$ d \f$ of a sketch
+	of width \f$ L \f$, and whose high bit is \c fourwise(d,x). The entries
+	of a key are contiguous, so that looking up all cells of a key is a 
+	single sequential read.
+
+	A table belongs to a hash family, a width and a sketch family. 
+	Tables are shared, 
+	through \c key_cell_table::get, among all projections that
+	bind the same key range.
+  */
+class key_cell_table
+{
+public:
+	/**
+		Construct the table for the hash family, width and sketch family
+		of a projection, over a key range.
+
+		For large key ranges, the table is filled by several threads.
+	  */
+	key_cell_table(const projection& proj, size_t kmin, size_t kmax);
+
+	/// The high bit of an entry, which holds the sign
+	static constexpr uint32_t sign_bit = 1u<<31;
+
+	/// The hash family of the table
+	inline const hash_family* hashf() const { return hf; }
+
+	/// The width of the table
+	inline size_t width() const { return L; }
+
+	/// The sketch family of the table
+	inline sketch_family family() const { return fam; }
+
+	inline size_t min_key() const { return kmin; }
+	inline size_t max_key() const { return kmax; }
+
+	/// True if \c key is in the key range of the table
+	inline bool contains(size_t key) const { return key-kmin <= kmax-kmin; }
+
+	/// The \c depth() entries of a key in the range
+	inline const uint32_t* cells(size_t key) const { 
+		return &tab[(key-kmin)*D]; 
+	}
+
+	/// Unpack the cells of a key in the range, as in \c projection::hash_cells
+	inline void lookup(size_t key, size_t* idx, bool* sgn) const {
+		const uint32_t* c = cells(key);
+		for(depth_type d=0; d<D; d++) {
+			idx[d] = c[d] & ~sign_bit;
+			sgn[d] = c[d] >> 31;
+		}
+	}
+
+	/// The memory used by a table of depth \c D over \f$ [k_{min}, k_{max}] \f$
+	static size_t byte_size(depth_type D, size_t kmin, size_t kmax);
+
+	/**
+		Return a shared table for the given projection and key range.
+
+		A table is constructed when needed, and released when the last
+		projection that uses it is destroyed.
+	  */
+	static std::shared_ptr<const key_cell_table> get(const projection& proj,
+		size_t kmin, size_t kmax);
+
+	/// The number of tables held by the cache of \c get (including released ones)
+	static size_t cached();
+
+private:
+	hash_family* hf;
+	size_t L;
+	sketch_family fam;
+	depth_type D;
+	size_t kmin, kmax;
+	std::vector<uint32_t> tab;
+
+	void fill(size_t from, size_t to);
+};
+
+
 /**
 	An AGMS projection defines a projection 
 	of a high-dimensional vector space on a
@@ -82,8 +381,14 @@ class projection
 	hash_family* hf;
 	size_t L;
 	double eps;
+	sketch_family fam = sketch_family::agms;
+	const fixed_shape_kernel* fsk = nullptr;
+	std::shared_ptr<const key_cell_table> kct;
 public:
 
+	/// The default memory limit for the key table of a projection (256 Mbytes)
+	static constexpr size_t default_key_table_limit = size_t(256)<<20;
+
 	inline hash_family* hashf() const { return hf; }
 	inline depth_type depth() const { return hf->depth(); }
 	inline size_t width() const { return L; }
@@ -91,30 +396,131 @@ public:
 
 	inline projection() : hf(0), L(0) {}
 
-	inline projection(hash_family* _hf, size_t _L)
-	: hf(_hf), L(_L), eps(ams_epsilon())
+	inline projection(hash_family* _hf, size_t _L, 
+			sketch_family _fam = sketch_family::agms)
+	: hf(_hf), L(_L), eps(ams_epsilon()), fam(_fam)
 	{ }
 
-	inline projection(depth_type _D, size_t _L)
-	: projection(hash_family::get_cached(_D),_L)
+	inline projection(depth_type _D, size_t _L, 
+			sketch_family _fam = sketch_family::agms)
+	: projection(hash_family::get_cached(_D),_L, _fam)
 	{ }
 
+	/// The sketch family of this projection
+	inline sketch_family family() const { return fam; }
 
 	inline size_t hash(depth_type d, size_t key) const {
 		return hf->hash(d,key) % L;
 	}
 
-	inline bool fourwise(depth_type d, size_t key) const {
-		return hf->fourwise(d,key);
-	}
+	/// The sign of a key in row \c d (true for +1)
+	bool fourwise(depth_type d, size_t key) const;
 
 	void update_index(size_t key, Index& idx) const;
 
 	void update_mask(size_t key, Mask& mask) const; 
 
+	/**
+		Compute the cells of a key over all depths.
+
+		On return, \c idx[d] is the offset of the counter for \c key
+		in row \c d (that is, \c d*width()+hash(d,key)) and
+		\c sgn[d] is \c fourwise(d,key). Both arrays must 
+		have size at least \c depth().
+	  */
+	void hash_cells(size_t key, size_t* idx, bool* sgn) const;
+
+	/**
+		Compute the cells of \c n keys over all depths.
+
+		The outputs are in depth-major order: \c idx[d*n+i] and
+		\c sgn[d*n+i] refer to key \c keys[i] in row \c d. Both arrays must 
+		have size at least \c n*depth().
+	  */
+	void hash_cells(const size_t* keys, size_t n, size_t* idx, bool* sgn) const;
+
+private:
+	// hash_cells for one key, bypassing the key table
+	void hash_key(size_t key, size_t* idx, bool* sgn) const;
+public:
+
+
+	/**
+		Bind this projection to the precompiled kernel for its shape, if
+		one exists. The kernels only support the \c poly31 hash policy
+		and the \c agms sketch family.
+
+		Sketch views over \c Vec, for a bound projection, use the kernel 
+		for updates and dot products, with identical results.
+		Returns true if a kernel was found.
+	  */
+	inline bool bind_fixed_shape() {
+		fsk = (hf && hf->policy()==hash_policy::poly31 && fam==sketch_family::agms) ? 
+			find_fixed_shape(depth(), width()) : nullptr;
+		return fsk != nullptr;
+	}
+
+	/// The fixed-shape kernel of this projection, or null
+	inline const fixed_shape_kernel* fixed_shape() const { return fsk; }
+
+	/**
+		Bind this projection to a table of the cells of the keys in 
+		\f$ [k_{min}, k_{max}] \f$ (see \c key_cell_table).
+
+		Afterwards, \c hash_cells, \c update_index and \c update_mask look up
+		the keys in the range, instead of hashing them; the results are
+		identical. Other keys are still hashed.
+
+		If the table would need more than \c max_bytes of memory, the
+		projection is left unbound and false is returned.
+	  */
+	bool bind_key_range(size_t kmin, size_t kmax, 
+		size_t max_bytes = default_key_table_limit);
+
+	/// Drop the key table of this projection
+	inline void unbind_key_range() { kct.reset(); }
+
+	/// The key table of this projection, or null
+	inline const key_cell_table* key_table() const { 
+		return (kct && kct->hashf()==hf && kct->width()==L && kct->family()==fam) ? 
+			kct.get() : nullptr;
+	}
+
+	/**
+		The estimate from a vector of per-row estimates (e.g., the result
+		of \c dot_estvec) for the sketch family: the minimum for \c count_min
+		and the median otherwise.
+	  */
+	inline double estimate(const Vec& rows) const {
+		return estimate(&rows[0], rows.size());
+	}
+
+	/// The estimate from the \c n per-row estimates in \c rows[0..n)
+	inline double estimate(const double* rows, size_t n) const {
+		return (fam==sketch_family::count_min) ? 
+			*std::min_element(rows, rows+n) : hdv::median(rows, n);
+	}
+
+	/**
+		The number of rows whose estimates must be at most \f$ T \f$, 
+		for the estimate to be at most \f$ T \f$. This is the quorum of 
+		the safe zones for upper bounds on the estimate.
+	  */
+	inline size_t upper_quorum() const {
+		return (fam==sketch_family::count_min) ? 1 : (depth()+1)/2;
+	}
+
+	/**
+		The number of rows whose estimates must be at least \f$ T \f$, 
+		for the estimate to be at least \f$ T \f$. This is the quorum of 
+		the safe zones for lower bounds on the estimate.
+	  */
+	inline size_t lower_quorum() const {
+		return (fam==sketch_family::count_min) ? depth() : (depth()+1)/2;
+	}
 
 	inline bool operator==(const projection& p) const {
-		return hf==p.hf && width()==p.width();
+		return hf==p.hf && width()==p.width() && fam==p.fam;
 	}
 
 	inline bool operator!=(const projection& p) const {
@@ -219,29 +625,136 @@ struct sketch_view
 	inline counter_type operator[](size_t i) const { return __begin[i]; }
 	inline counter_type& operator[](size_t i) { return __begin[i]; }
 
+	/// True if this view may use a fixed-shape kernel
+	static constexpr bool fixed_shape_capable = 
+		std::is_same<iterator, double*>::value 
+		|| std::is_same<iterator, const double*>::value;
+
+	/// The fixed-shape kernel usable by this view, or null
+	inline const fixed_shape_kernel* fixed_shape() const {
+		return fixed_shape_capable ? proj.fixed_shape() : nullptr;
+	}
+
+	/**
+		True if adding to a counter may throw (see \c counter_add).
+
+		The update methods are then atomic: when an update overflows, 
+		its counters are left unchanged. A batch update applies the updates
+		before the one that overflows, as a sequence of \c update() calls would.
+	  */
+	static constexpr bool checked_counters = 
+		! std::is_same<counter_type, double>::value;
+
 	/// Update the counters for key and freq
 	void update(size_t key, counter_type freq = 1) const
 	{
-		hash_family* const h = proj.hashf();
-		size_t off = 0;
-		for(size_t d=0; d<depth(); d++) {
-			size_t off2 = h->hash(d, key) % width();
-			if(h->fourwise(d, key))
-				__begin[off+off2] += freq;
-			else
-				__begin[off+off2] -= freq;
-			off += width();
-		}		
+		if constexpr (std::is_same<iterator, double*>::value) {
+			if(proj.fixed_shape() && !proj.key_table()) {
+				proj.fixed_shape()->update(proj.hashf(), __begin, key, freq);
+				return;
+			}
+		}
+
+		const depth_type D = depth();
+		size_t idx[D];
+		bool sgn[D];
+		proj.hash_cells(key, idx, sgn);
+		add_cells(idx, sgn, 1, D, freq);
 	}
 
 	/// Update the counters for key and freq and set delta vector
 	void update(delta_vector& delta, size_t key, counter_type freq = 1) const
 	{
-		proj.update_index(key, delta.index);
-		for(size_t d=0; d<depth(); d++) {
+		if constexpr (std::is_same<iterator, double*>::value) {
+			if(proj.fixed_shape() && !proj.key_table()) {
+				proj.fixed_shape()->update_delta(proj.hashf(), __begin, delta, key, freq);
+				return;
+			}
+		}
+
+		const depth_type D = depth();
+		bool sgn[D];
+		proj.hash_cells(key, &delta.index[0], sgn);
+		for(size_t d=0; d<D; d++)
 			delta.xold[d] = __begin[delta.index[d]];
-			__begin[delta.index[d]] += proj.fourwise(d, key) ? freq : -freq;
+		add_cells(&delta.index[0], sgn, 1, D, freq);
+		for(size_t d=0; d<D; d++)
 			delta.xnew[d] = __begin[delta.index[d]];
+	}
+
+	/**
+		Update the counters for a batch of \c n keys and frequencies.
+
+		The keys of each chunk of the batch are hashed together, and
+		then the counters are updated row by row, so that each row
+		stays in cache. The result is exactly the same as calling 
+		\c update(keys[i],freqs[i]) for each i in order.
+	  */
+	void update_batch(const size_t* keys, const double* freqs, size_t n) const
+	{
+		const depth_type D = depth();
+		size_t idx[D*batch_chunk];
+		bool sgn[D*batch_chunk];
+
+		for(size_t b=0; b<n; b+=batch_chunk) {
+			const size_t m = std::min(batch_chunk, n-b);
+			proj.hash_cells(keys+b, m, idx, sgn);
+			if constexpr (checked_counters) {
+				update_chunk_checked(idx, sgn, m, freqs+b, nullptr);
+				continue;
+			}
+			for(size_t d=0; d<D; d++) {
+				const size_t* idx_d = idx+d*m;
+				const bool* sgn_d = sgn+d*m;
+				for(size_t i=0; i<m; i++) {
+					if(sgn_d[i])
+						counter_add(__begin[idx_d[i]], freqs[b+i]);
+					else
+						counter_add(__begin[idx_d[i]], -freqs[b+i]);
+				}
+			}
+		}
+	}
+
+	/**
+		Update the counters for a batch of keys and frequencies
+		and return a delta vector for each update.
+
+		On return, \c deltas has size \c n and \c deltas[i] is the
+		delta vector that \c update(delta,keys[i],freqs[i]) would have
+		produced, if the updates were applied one by one. 
+		The elements of \c deltas are reused when they already 
+		have the right size, so callers should keep the list between calls.
+	  */
+	void update_batch(std::vector<delta_vector>& deltas, 
+		const size_t* keys, const double* freqs, size_t n) const
+	{
+		const depth_type D = depth();
+		size_t idx[D*batch_chunk];
+		bool sgn[D*batch_chunk];
+
+		deltas.resize(n);
+		for(auto& delta : deltas) delta.resize(D);
+
+		for(size_t b=0; b<n; b+=batch_chunk) {
+			const size_t m = std::min(batch_chunk, n-b);
+			proj.hash_cells(keys+b, m, idx, sgn);
+			if constexpr (checked_counters) {
+				update_chunk_checked(idx, sgn, m, freqs+b, &deltas[b]);
+				continue;
+			}
+			for(size_t d=0; d<D; d++) {
+				const size_t* idx_d = idx+d*m;
+				const bool* sgn_d = sgn+d*m;
+				for(size_t i=0; i<m; i++) {
+					delta_vector& delta = deltas[b+i];
+					const size_t j = idx_d[i];
+					delta.index[d] = j;
+					delta.xold[d] = __begin[j];
+					counter_add(__begin[j], sgn_d[i] ? freqs[b+i] : -freqs[b+i]);
+					delta.xnew[d] = __begin[j];
+				}
+			}
 		}
 	}
 
@@ -249,16 +762,104 @@ struct sketch_view
 	void apply_update(const Index& idx, const Mask& m, counter_type freq=1)  const
 	{
 		assert(idx.size() == m.size());
+		if constexpr (checked_counters) {
+			// check all counters before changing any
+			for(size_t i=0;i<idx.size();i++) {
+				counter_type c = __begin[idx[i]];
+				counter_add(c, m[i]? freq : -freq);
+			}
+		}
 		for(size_t i=0;i<idx.size();i++) {
-			__begin[idx[i]] += m[i]? freq : -freq;
+			counter_add(__begin[idx[i]], m[i]? freq : -freq);
 		}
 	}
 
 	/// update the counters from delta vector
 	void apply_update(const delta_vector& delta) const
 	{
+		if constexpr (checked_counters) {
+			// check all counters before changing any
+			for(size_t i=0; i<delta.index.size(); i++) {
+				counter_type c = __begin[delta.index[i]];
+				counter_add(c, delta.xnew[i]-delta.xold[i]);
+			}
+		}
 		for(size_t i=0; i<delta.index.size(); i++) {
-			__begin[delta.index[i]] += delta.xnew[i]-delta.xold[i]; 
+			counter_add(__begin[delta.index[i]], delta.xnew[i]-delta.xold[i]); 
+		}
+	}
+
+private:
+
+	/*
+		Add +-freq to the D cells of a key, given with a stride in idx and sgn 
+		(as returned by hash_cells for a batch of keys). The cells are in 
+		different rows. For checked counters, the new values are computed 
+		before any cell is changed.
+	  */
+	template <typename T>
+	void add_cells(const size_t* idx, const bool* sgn, size_t stride, depth_type D, T freq) const
+	{
+		if constexpr (checked_counters) {
+			counter_type val[D];
+			for(size_t d=0; d<D; d++) {
+				val[d] = __begin[idx[d*stride]];
+				counter_add(val[d], sgn[d*stride] ? freq : -freq);
+			}
+			for(size_t d=0; d<D; d++)
+				__begin[idx[d*stride]] = val[d];
+		} else {
+			for(size_t d=0; d<D; d++)
+				counter_add(__begin[idx[d*stride]], sgn[d*stride] ? freq : -freq);
+		}
+	}
+
+	/*
+		Apply a hashed chunk of m updates to checked counters, row by row, 
+		and fill the deltas if not null. If an update overflows, the chunk 
+		is undone and then replayed one update at a time, so that the updates
+		before the overflowing one are applied when the exception propagates.
+	  */
+	void update_chunk_checked(const size_t* idx, const bool* sgn, size_t m, 
+		const double* freqs, delta_vector* deltas) const
+	{
+		const depth_type D = depth();
+		counter_type old[D*m];
+		size_t done = 0;
+		try {
+			for(size_t d=0; d<D; d++) {
+				const size_t* idx_d = idx+d*m;
+				const bool* sgn_d = sgn+d*m;
+				for(size_t i=0; i<m; i++, done++) {
+					const size_t j = idx_d[i];
+					old[done] = __begin[j];
+					counter_add(__begin[j], sgn_d[i] ? freqs[i] : -freqs[i]);
+					if(deltas) {
+						deltas[i].index[d] = j;
+						deltas[i].xold[d] = old[done];
+						deltas[i].xnew[d] = __begin[j];
+					}
+				}
+			}
+		} catch(std::overflow_error&) {
+			// restore in reverse order, since keys may share counters
+			while(done-- > 0)
+				__begin[idx[done]] = old[done];
+
+			// Each counter sees the same sequence of additions as before,
+			// so the replay throws at the same update
+			for(size_t i=0; i<m; i++) {
+				if(deltas)
+					for(size_t d=0; d<D; d++) {
+						deltas[i].index[d] = idx[d*m+i];
+						deltas[i].xold[d] = __begin[idx[d*m+i]];
+					}
+				add_cells(idx+i, sgn+i, m, D, freqs[i]);
+				if(deltas)
+					for(size_t d=0; d<D; d++)
+						deltas[i].xnew[d] = __begin[idx[d*m+i]];
+			}
+			throw;
 		}
 	}
 
@@ -308,72 +909,85 @@ auto projection::operator()(Container& c) const
 	An AGMS row will be a vector of size L. 
 
 	An agms sketch supports all basic vector operations.
+
+	The counter type is a template parameter; \c sketch is the
+	usual sketch with \c double counters. Narrower counters 
+	(e.g., \c float, \c int32_t or \c int16_t) reduce the memory 
+	footprint; updates that overflow them throw \c std::overflow_error 
+	(see \c counter_add). Estimates and delta vectors are always computed
+	in \c double.
  */
-class sketch : public Vec
+template <typename Counter>
+class basic_sketch : public valarray<Counter>
 {
 public:
+	typedef valarray<Counter> container_type;
+	typedef Counter counter_type;
+	typedef sketch_view<Counter*> view_type;
+	typedef sketch_view<const Counter*> const_view_type;
+
 	/// the projection of the sketch
 	agms::projection proj;
 
 	/// Initialize to a null sketch
-	inline sketch() { }
+	inline basic_sketch() { }
 
 	/// Initialize by a given projection
-	inline sketch(const projection& _proj)
-	: Vec(0.0,_proj.size()), proj(_proj)
+	inline basic_sketch(const projection& _proj)
+	: container_type(Counter(0),_proj.size()), proj(_proj)
 	{ }
 
 	/// Initialize to a zero sketch
-	inline sketch(hash_family* _hf, size_t _L)
-	: sketch(projection(_hf,_L))
+	inline basic_sketch(hash_family* _hf, size_t _L)
+	: basic_sketch(projection(_hf,_L))
 	{ }
 
 	/// Initialize to a zero sketch
-	inline sketch(depth_type _D, size_t _L) 
-	: sketch(projection(_D,_L))
+	inline basic_sketch(depth_type _D, size_t _L) 
+	: basic_sketch(projection(_D,_L))
 	{ }
 
 	template <typename Iter>
-	inline sketch(const sketch_view<Iter>& skv)
-	: Vec(skv.size()), proj(skv.proj) 
+	inline basic_sketch(const sketch_view<Iter>& skv)
+	: container_type(skv.size()), proj(skv.proj) 
 	{
-		std::copy(skv.begin(), skv.end(), begin(*this));
+		std::copy(skv.begin(), skv.end(), std::begin(*this));
 	}
 
 
-	sketch(const sketch&) = default;
-	sketch(sketch&&) = default;
+	basic_sketch(const basic_sketch&) = default;
+	basic_sketch(basic_sketch&&) = default;
 
 	//using Vec::operator=;
-	inline sketch& operator=(const sketch& sk) = default;
-	inline sketch& operator=(sketch&& sk) = default;
-	inline sketch& operator=(const Vec& v) {
-		if(v.size()!=size()) throw length_error("wrong vector size for sketch");
-		this->Vec::operator=(v);
+	inline basic_sketch& operator=(const basic_sketch& sk) = default;
+	inline basic_sketch& operator=(basic_sketch&& sk) = default;
+	inline basic_sketch& operator=(const container_type& v) {
+		if(v.size()!=this->size()) throw length_error("wrong vector size for sketch");
+		this->container_type::operator=(v);
 		return *this;
 	}
-	inline sketch& operator=(double v) { 
-		this->Vec::operator=(v); return *this; 
+	inline basic_sketch& operator=(Counter v) { 
+		this->container_type::operator=(v); return *this; 
 	}
-	inline sketch& operator=(const std::slice_array<double>& other) {
-		this->Vec::operator=(other); return *this;
+	inline basic_sketch& operator=(const std::slice_array<Counter>& other) {
+		this->container_type::operator=(other); return *this;
 	}
-	inline sketch& operator=(const std::gslice_array<double>& other) {
-		this->Vec::operator=(other); return *this;
+	inline basic_sketch& operator=(const std::gslice_array<Counter>& other) {
+		this->container_type::operator=(other); return *this;
 	}
-	inline sketch& operator=(const std::mask_array<double>& other) {
-		this->Vec::operator=(other); return *this;
+	inline basic_sketch& operator=(const std::mask_array<Counter>& other) {
+		this->container_type::operator=(other); return *this;
 	}
-	inline sketch& operator=(const std::indirect_array<double>& other) {
-		this->Vec::operator=(other); return *this;
+	inline basic_sketch& operator=(const std::indirect_array<Counter>& other) {
+		this->container_type::operator=(other); return *this;
 	}
 
 	template <typename Iter>
-	inline sketch& operator=(const sketch_view<Iter>& skv) {
+	inline basic_sketch& operator=(const sketch_view<Iter>& skv) {
 		if(proj == skv.proj) 
 			std::copy(skv.begin(), skv.end(), std::begin(*this));
 		else
-			*this = sketch(skv);
+			*this = basic_sketch(skv);
 		return *this;
 	}
 
@@ -387,65 +1001,193 @@ public:
 	inline depth_type depth() const { return proj.depth(); }
 
 	inline auto view() { 
-		return Vec_sketch_view(proj, begin(*this), end(*this)); 
+		return view_type(proj, std::begin(*this), std::end(*this)); 
 	}
 	inline auto view() const { 
-		return const_Vec_sketch_view(proj, begin(*this), end(*this)); 
+		return const_view_type(proj, std::begin(*this), std::end(*this)); 
 	}
 
-	inline operator Vec_sketch_view() { return view(); }
+	inline operator view_type() { return view(); }
 
 	/// Update the sketch.
-	inline void update(size_t key, double freq = 1.0) { view().update(key, freq); }
-
-	inline void update(delta_vector& delta, size_t key, double freq = 1.0)
+	inline void update(size_t key, Counter freq = 1) { view().update(key, freq); }
+	inline void update(delta_vector& delta, size_t key, Counter freq = 1)
 	{ view().update(delta, key, freq); }
 
+	/// Update the sketch for a batch of keys and frequencies.
+	inline void update_batch(const size_t* keys, const double* freqs, size_t n)
+	{ view().update_batch(keys, freqs, n); }
+
+	/// Update the sketch for a batch and return the delta of each update.
+	inline void update_batch(std::vector<delta_vector>& deltas, 
+		const size_t* keys, const double* freqs, size_t n)
+	{ view().update_batch(deltas, keys, freqs, n); }
+
 	/// Insert a key into the sketch
-	inline void insert(size_t key) { update(key, 1.0); }
+	inline void insert(size_t key) { update(key, 1); }
 
 	/// Erase a key from the sketch
-	inline void erase(size_t key) { update(key, -1.0); }
+	inline void erase(size_t key) { update(key, -1); }
 
 	/// Return true if this sketch is compatible to sk
-	inline bool compatible(const sketch& sk) const {
+	inline bool compatible(const basic_sketch& sk) const {
 		return proj == sk.proj;
 	}
 
 	inline auto row_begin(size_t row) const {
-		return begin(*this)+row*width();
+		return std::begin(*this)+row*width();
 	}
 
 	inline auto row_end(size_t row) const {
-		return begin(*this)+(row+1)*width();
+		return std::begin(*this)+(row+1)*width();
 	}
 
 	inline double norm2_squared() const {
-		return hdv::dot(*this, *this);
+		if constexpr (std::is_same<Counter, double>::value)
+			return hdv::dot(*this, *this);
+		else
+			return std::inner_product(std::begin(*this), std::end(*this), 
+				std::begin(*this), 0.0);
 	}
 
+	/// The size on the wire, where counters are sent as floats or narrower
 	inline size_t byte_size() const {
-		return sizeof(float)*size();
+		return std::min(sizeof(Counter), sizeof(float))*this->size();
 	}
 };
 
 
+/// The AGMS sketch with \c double counters
+typedef basic_sketch<double> sketch;
+
+
 
 /**
-	Return a vector of the dot products of 
-	parallel rows of two sketches.
-  */
+	Compute the dot products of parallel rows of two sketches
+	into \c out[0..D), without allocating memory.
 
-template <typename Iter>
-Vec dot_estvec(const sketch_view<Iter>& s1, const sketch_view<Iter>& s2)
+	When both sketches are over contiguous counters, each row is a loop 
+	over two arrays with a single accumulator, which the compiler 
+	vectorizes when reassociation is allowed (as with \c -Ofast). 
+	The summation order is the same as \c std::inner_product.
+  */
+template <typename Iter1, typename Iter2>
+void dot_estvec(const sketch_view<Iter1>& s1, const sketch_view<Iter2>& s2, double* out)
 {
 	assert(s1.compatible(s2));
 	const depth_type D = s1.depth();
-	Vec ret(D);
 
-	for(size_t d=0;d<D;d++)
-		ret[d] = std::inner_product(s1.row_begin(d), s1.row_end(d),
-			s2.row_begin(d), 0.0);
+	if constexpr (sketch_view<Iter1>::fixed_shape_capable 
+			&& sketch_view<Iter2>::fixed_shape_capable) {
+		if(s1.fixed_shape()) {
+			s1.fixed_shape()->dot_estvec(&*s1.begin(), &*s2.begin(), out);
+			return;
+		}
+	}
+
+	if constexpr (std::is_pointer<Iter1>::value && std::is_pointer<Iter2>::value) {
+		const size_t L = s1.width();
+		for(size_t d=0;d<D;d++) {
+			const auto* __restrict r1 = s1.begin() + d*L;
+			const auto* __restrict r2 = s2.begin() + d*L;
+			double acc = 0.0;
+			for(size_t l=0; l<L; l++)
+				acc += (double)r1[l] * r2[l];
+			out[d] = acc;
+		}
+	} else {
+		for(size_t d=0;d<D;d++)
+			out[d] = std::inner_product(s1.row_begin(d), s1.row_end(d),
+				s2.row_begin(d), 0.0);
+	}
+}
+
+
+/**
+	Update a sketch from a range of records, in parallel.
+
+	For each record \c rec in \f$ [from, to) \f$, \c select(rec,key,freq) 
+	returns false to skip the record, or sets the key and the frequency 
+	of an update and returns true. 
+
+	The range is split into contiguous shards of \c shard_records records.
+	The shards are updated into local sketches, in batches, by up to
+	\c par::num_threads threads (at most \c maxthreads, if it is nonzero),
+	and the local sketches are added to \c sk in shard order. 
+	The shards depend only on the length of the range, so the result does 
+	not depend on the number of threads, even for non-integral frequencies.
+	Since sketches are linear, the result equals the sequential update, 
+	except for the rounding of non-integral frequencies. A range of one
+	shard updates \c sk directly. The record iterators must be random-access.
+
+	With narrow counters, an overflow while adding a shard leaves \c sk
+	with the shards before it added.
+  */
+template <typename Iter, typename RecIter, typename Select>
+void parallel_update(const sketch_view<Iter>& sk, RecIter from, RecIter to, 
+	Select select, size_t maxthreads = 0)
+{
+	constexpr size_t shard_records = 1<<16;
+	const size_t n = std::distance(from, to);
+	const size_t nshards = (n + shard_records - 1) / shard_records;
+
+	// update a view from the records in [a,b)
+	auto update_range = [&](const auto& view, size_t a, size_t b) {
+		size_t keys[batch_chunk];
+		double freqs[batch_chunk];
+		size_t m = 0;
+		for(RecIter r = from+a; r != from+b; ++r) {
+			if(select(*r, keys[m], freqs[m]) && ++m == batch_chunk) {
+				view.update_batch(keys, freqs, m);
+				m = 0;
+			}
+		}
+		view.update_batch(keys, freqs, m);
+	};
+
+	if(nshards <= 1) {
+		update_range(sk, 0, n);
+		return;
+	}
+
+	// The shards are processed in waves of one shard per thread
+	const size_t nthreads = std::min(nshards, par::num_threads(n, shard_records, maxthreads));
+	std::vector<Vec> local(nthreads);
+	for(size_t w=0; w<nshards; w+=nthreads) {
+		const size_t m = std::min(nthreads, nshards-w);
+		par::for_shards(m, m, [&](size_t t, size_t, size_t) {
+			const size_t s = w+t;
+			if(local[t].size() != sk.size())
+				local[t].resize(sk.size(), 0.0);
+			else
+				local[t] = 0.0;
+			update_range(sk.proj(local[t]), s*shard_records, std::min(n, (s+1)*shard_records));
+		});
+
+		for(size_t t=0; t<m; t++) {
+			if constexpr (sketch_view<Iter>::checked_counters) {
+				// check the whole shard before adding it
+				for(size_t i=0; i<sk.size(); i++) {
+					auto c = sk.begin()[i];
+					counter_add(c, local[t][i]);
+				}
+			}
+			for(size_t i=0; i<sk.size(); i++)
+				counter_add(sk.begin()[i], local[t][i]);
+		}
+	}
+}
+
+
+/**
+	Return a vector of the dot products of 
+	parallel rows of two sketches.
+  */
+template <typename Iter1, typename Iter2>
+Vec dot_estvec(const sketch_view<Iter1>& s1, const sketch_view<Iter2>& s2)
+{
+	Vec ret(s1.depth());
+	dot_estvec(s1, s2, &ret[0]);
 	return ret;
 }
 
@@ -462,7 +1204,8 @@ Vec dot_estvec(const sketch_view<Iter>& s1, const sketch_view<Iter>& s2)
 template <typename Iter>
 inline Vec& dot_estvec_inc(Vec& oldvalue, const delta_vector& ds1, const sketch_view<Iter>& s2)
 {
-	for(size_t i=0; i<ds1.index.size(); i++)
+	const size_t D = ds1.index.size();
+	for(size_t i=0; i<D; i++)
 		oldvalue[i] += (ds1.xnew[i] - ds1.xold[i])*s2[ds1.index[i]];
 	return oldvalue;
 }
@@ -494,6 +1237,57 @@ inline Vec dot_estvec(const sketch_view<Iter>& s)
 }
 
 
+/**
+	Compute the dot products of parallel rows of two sketches into 
+	\c out[0..D), splitting the rows among threads.
+
+	Each row is computed by one thread, with the same loop for any number
+	of threads, so the result does not depend on it. This is meant for 
+	large sketches outside the update paths, e.g., when a safe zone is
+	constructed. The number of threads is given by \c par::num_threads, 
+	with at most \c maxthreads threads if it is nonzero.
+  */
+template <typename Iter1, typename Iter2>
+void parallel_dot_estvec(const sketch_view<Iter1>& s1, const sketch_view<Iter2>& s2, 
+	double* out, size_t maxthreads = 0)
+{
+	assert(s1.compatible(s2));
+	constexpr size_t min_counters_per_thread = 1<<15;
+	const size_t D = s1.depth();
+	const size_t nthreads = par::num_threads(s1.size(), min_counters_per_thread, maxthreads);
+
+	par::for_shards(D, nthreads, [&](size_t, size_t a, size_t b) {
+		for(size_t d=a; d<b; d++)
+			out[d] = std::inner_product(s1.row_begin(d), s1.row_end(d),
+				s2.row_begin(d), 0.0);
+	});
+}
+
+/**
+	A shorthand for parallel_dot_estvec(s,s), returning a vector.
+  */
+template <typename Iter>
+inline Vec parallel_dot_estvec(const sketch_view<Iter>& s, size_t maxthreads = 0)
+{
+	Vec ret(s.depth());
+	parallel_dot_estvec(s, s, &ret[0], maxthreads);
+	return ret;
+}
+
+/**
+	Return a vector of the dot products of parallel rows of two sketches,
+	splitting the rows among threads.
+  */
+template <typename Iter1, typename Iter2>
+inline Vec parallel_dot_estvec(const sketch_view<Iter1>& s1, const sketch_view<Iter2>& s2, 
+	size_t maxthreads = 0)
+{
+	Vec ret(s1.depth());
+	parallel_dot_estvec(s1, s2, &ret[0], maxthreads);
+	return ret;
+}
+
+
 /**
 	Incremental version for dot_estvec(s).
 
@@ -501,19 +1295,26 @@ inline Vec dot_estvec(const sketch_view<Iter>& s)
   */
 inline Vec& dot_estvec_inc(Vec& oldvalue, const delta_vector& ds)
 {
-	oldvalue += ds.xnew*ds.xnew - ds.xold*ds.xold;
+	const size_t D = ds.index.size();
+	for(size_t i=0; i<D; i++)
+		oldvalue[i] += ds.xnew[i]*ds.xnew[i] - ds.xold[i]*ds.xold[i];
 	return oldvalue;
 }
 
 
 /**
 	Return the (robust) estimate of the inner product
-	of two agms sketches
+	of two agms sketches.
+
+	The row products are kept on the stack, so that no memory is allocated.
   */
-template <typename Iter>
-inline double dot_est(const sketch_view<Iter>& s1, const sketch_view<Iter>& s2)
+template <typename Iter1, typename Iter2>
+inline double dot_est(const sketch_view<Iter1>& s1, const sketch_view<Iter2>& s2)
 {
-	return hdv::median(dot_estvec(s1,s2));
+	const depth_type D = s1.depth();
+	double rows[D];
+	dot_estvec(s1, s2, rows);
+	return s1.proj.estimate(rows, D);
 }
 
 /**
@@ -523,7 +1324,7 @@ inline double dot_est(const sketch_view<Iter>& s1, const sketch_view<Iter>& s2)
 template <typename Iter>
 inline double dot_est(const sketch_view<Iter>& sk)
 {
-	return hdv::median(dot_estvec(sk));
+	return dot_est(sk, sk);
 }
 
 
@@ -531,25 +1332,26 @@ inline double dot_est(const sketch_view<Iter>& sk)
 	Return the (robust) estimate of the inner product
 	of two agms sketches and the incremental state (which is overwritten)
   */
-template <typename Iter>
-inline double dot_est_with_inc(Vec& incstate, const sketch_view<Iter>& s1, const sketch_view<Iter>& s2)
+template <typename Iter1, typename Iter2>
+inline double dot_est_with_inc(Vec& incstate, const sketch_view<Iter1>& s1, const sketch_view<Iter2>& s2)
 {
-	incstate.resize(s1.depth());
-	incstate = dot_estvec(s1,s2);
-	return hdv::median(incstate);
+	if(incstate.size()!=s1.depth())
+		incstate.resize(s1.depth());
+	dot_estvec(s1, s2, &incstate[0]);
+	return s1.proj.estimate(incstate);
 }
 
 
 template <typename Iter>
 inline double dot_est_inc(Vec& incstate, const delta_vector& ds1, const sketch_view<Iter>& s2)
 {
-	return hdv::median(dot_estvec_inc(incstate, ds1,s2));
+	return s2.proj.estimate(dot_estvec_inc(incstate, ds1,s2));
 }
 
 template <typename Iter>
 inline double dot_est_inc(Vec& incstate, const sketch_view<Iter>& s1, const delta_vector& ds2)
 {
-	return hdv::median(dot_estvec_inc(incstate, s1, ds2));
+	return s1.proj.estimate(dot_estvec_inc(incstate, s1, ds2));
 }
 
 
@@ -561,35 +1363,59 @@ inline double dot_est_inc(Vec& incstate, const sketch_view<Iter>& s1, const delt
 template <typename Iter>
 inline double dot_est_with_inc(Vec& incstate, const sketch_view<Iter>& sk)
 {
-	incstate.resize(sk.depth());
-	incstate = dot_estvec(sk);
-	return hdv::median(incstate);
+	return dot_est_with_inc(incstate, sk, sk);
 }
 
 
+/**
+	Return the (robust) incremental estimate of the self product
+	of an agms sketch, from its delta vector.
+
+	Since the delta vector does not carry the projection, this is
+	the median estimate; for other sketch families, use the overload 
+	that takes the projection.
+  */
 inline double dot_est_inc(Vec& incstate, const delta_vector& dsk)
 {
 	return hdv::median(dot_estvec_inc(incstate, dsk));
 }
 
+/**
+	Return the incremental estimate of the self product
+	of a sketch of the given projection, from its delta vector.
+  */
+inline double dot_est_inc(Vec& incstate, const delta_vector& dsk, const projection& proj)
+{
+	return proj.estimate(dot_estvec_inc(incstate, dsk));
+}
+
 
 //
 // Inner product
 //
 
-inline Vec dot_estvec(const sketch& s1, const sketch& s2) { return dot_estvec(s1.view(), s2.view()); }
-inline Vec& dot_estvec_inc(Vec& inc, const delta_vector& ds1, const sketch& s2) { 
+template <typename C>
+inline Vec dot_estvec(const basic_sketch<C>& s1, const basic_sketch<C>& s2) { 
+	return dot_estvec(s1.view(), s2.view()); }
+template <typename C>
+inline Vec& dot_estvec_inc(Vec& inc, const delta_vector& ds1, const basic_sketch<C>& s2) { 
 	return dot_estvec_inc(inc,ds1,s2.view()); }
-inline Vec& dot_estvec_inc(Vec& inc, const sketch& s2, const delta_vector& ds1) { 
+template <typename C>
+inline Vec& dot_estvec_inc(Vec& inc, const basic_sketch<C>& s2, const delta_vector& ds1) { 
 	return dot_estvec_inc(inc,ds1,s2.view()); }
 
 
-inline double dot_est(const sketch& s1, const sketch& s2) { return dot_est(s1.view(), s2.view()); }
-inline double dot_est_with_inc(Vec& incstate, const sketch& s1, const sketch& s2) {
+template <typename C>
+inline double dot_est(const basic_sketch<C>& s1, const basic_sketch<C>& s2) { 
+	return dot_est(s1.view(), s2.view()); }
+template <typename C>
+inline double dot_est_with_inc(Vec& incstate, const basic_sketch<C>& s1, const basic_sketch<C>& s2) {
  	return dot_est_with_inc(incstate, s1.view(), s2.view()); }
-inline double dot_est_inc(Vec& incstate, const delta_vector& s1, const sketch& s2) {
+template <typename C>
+inline double dot_est_inc(Vec& incstate, const delta_vector& s1, const basic_sketch<C>& s2) {
  	return dot_est_inc(incstate, s1, s2.view()); }
-inline double dot_est_inc(Vec& incstate, const sketch& s1, const delta_vector& s2) {
+template <typename C>
+inline double dot_est_inc(Vec& incstate, const basic_sketch<C>& s1, const delta_vector& s2) {
  	return dot_est_inc(incstate, s1.view(), s2); }
 
 
@@ -597,10 +1423,13 @@ inline double dot_est_inc(Vec& incstate, const sketch& s1, const delta_vector& s
 // Self-product
 //
 
-inline Vec dot_estvec(const sketch& s) { return dot_estvec(s.view()); }
+template <typename C>
+inline Vec dot_estvec(const basic_sketch<C>& s) { return dot_estvec(s.view()); }
 
-inline double dot_est(const sketch& s) { return dot_est(s.view()); }
-inline double dot_est_with_inc(Vec& incstate, const sketch& s) {
+template <typename C>
+inline double dot_est(const basic_sketch<C>& s) { return dot_est(s.view()); }
+template <typename C>
+inline double dot_est_with_inc(Vec& incstate, const basic_sketch<C>& s) {
  	return dot_est_with_inc(incstate, s.view()); }
 
 
@@ -610,35 +1439,40 @@ inline double dot_est_with_inc(Vec& incstate, const sketch& s) {
 /**
 	Addition of two AGMS sketches.
   */
-inline sketch operator+(const sketch& s1, const sketch& s2)
+template <typename C>
+inline basic_sketch<C> operator+(const basic_sketch<C>& s1, const basic_sketch<C>& s2)
 {
 	assert(s1.compatible(s2));
-	sketch result = s1;
+	basic_sketch<C> result = s1;
 	result += s2;
 	return result;
 }
-inline sketch operator-(const sketch& s1, const sketch& s2)
+template <typename C>
+inline basic_sketch<C> operator-(const basic_sketch<C>& s1, const basic_sketch<C>& s2)
 {
 	assert(s1.compatible(s2));
-	sketch result = s1;
+	basic_sketch<C> result = s1;
 	result -= s2;
 	return result;
 }
-inline sketch operator*(double a, const sketch& s)
+template <typename C>
+inline basic_sketch<C> operator*(C a, const basic_sketch<C>& s)
 {
-	sketch result = s;
+	basic_sketch<C> result = s;
 	result *= a;
 	return result;
 }
-inline sketch operator*(const sketch& s, double a)
+template <typename C>
+inline basic_sketch<C> operator*(const basic_sketch<C>& s, C a)
 {
-	sketch result = s;
+	basic_sketch<C> result = s;
 	result *= a;
 	return result;
 }
-inline sketch operator/(const sketch& s, double a)
+template <typename C>
+inline basic_sketch<C> operator/(const basic_sketch<C>& s, C a)
 {
-	sketch result = s;
+	basic_sketch<C> result = s;
 	result /= a;
 	return result;
 }
@@ -672,22 +1506,55 @@ public:
 
 	A container for a single sketch and a delta_vector. 
 	The update method also updates the delta.
+
+	The delta vector holds the old and new counter values
+	as doubles, for any counter type. Instances are compiled
+	for \c double, \c float, \c int32_t and \c int16_t counters.
   */
-struct isketch : sketch
+template <typename Counter>
+struct basic_isketch : basic_sketch<Counter>
 {
+	typedef basic_sketch<Counter> sketch_type;
+	using sketch_type::proj;
+
 	delta_vector delta;
 private:
 	// temporary, used to avoid allocation
 	Mask mask;
 public:
 
-	isketch(const projection& proj);
+	basic_isketch(const projection& proj);
 
 	void update(size_t key, double freq=1.0);
 	inline void insert(size_t key) { update(key,1.0); }
 	inline void erase(size_t key) { update(key,-1.0); }
+
+	/**
+		Update the sketch for a batch of keys and frequencies.
+
+		On return, \c delta describes the last update of the batch,
+		as if the updates had been applied one by one.
+	  */
+	void update_batch(const size_t* keys, const double* freqs, size_t n);
+
+	/**
+		Update the sketch for a batch of keys and frequencies,
+		returning the delta vector of each update in \c deltas.
+
+		On return, \c delta describes the last update of the batch.
+	  */
+	void update_batch(std::vector<delta_vector>& deltas, 
+		const size_t* keys, const double* freqs, size_t n);
 };
 
+/// The incrementally updatable sketch with \c double counters
+typedef basic_isketch<double> isketch;
+
+extern template struct basic_isketch<double>;
+extern template struct basic_isketch<float>;
+extern template struct basic_isketch<int32_t>;
+extern template struct basic_isketch<int16_t>;
+
 
 
 
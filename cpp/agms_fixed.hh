@@ -0,0 +1,282 @@
+#ifndef __AGMS_FIXED_HH__
+#define __AGMS_FIXED_HH__
+
+#include <array>
+#include <stdexcept>
+
+#include "agms.hh"
+
+/**
+	\file Compile-time fixed-shape AGMS sketches.
+
+	The generic sketch code takes the depth and width of a sketch
+	from its projection at runtime. For the common shapes, the code
+	in this file uses constexpr loop bounds and width, so that the
+	compiler can unroll the loops over the depth and replace the
+	modulo by the width with a multiplication (or a mask, for
+	widths that are powers of 2).
+  */
+
+namespace agms {
+
+
+/**
+	Sketch operations for a fixed shape \f$ D\times L \f$.
+
+	The operations are static functions over arrays of counters.
+	They compute exactly the same values as the generic code.
+  */
+template <depth_type D, size_t L>
+struct fixed_shape
+{
+	static_assert(D>0 && L>0, "A fixed shape must be non-empty");
+
+	static constexpr depth_type depth = D;
+	static constexpr size_t width = L;
+	static constexpr size_t size = D*L;
+
+	/// True if the width is a power of 2
+	static constexpr bool pow2_width = (L & (L-1)) == 0;
+
+	/// Map a hash value to a column of a row
+	static constexpr size_t column(uint64_t h) {
+		return pow2_width ? (h & (L-1)) : (h % L);
+	}
+
+	/**
+		True if the hash family and sketch family of \c proj are supported,
+		that is, the \c poly31 policy and the \c agms family. 
+	  */
+	static inline bool supports(const projection& proj) {
+		return proj.hashf()->policy()==hash_policy::poly31 
+			&& proj.family()==sketch_family::agms;
+	}
+
+	/**
+		Update the counters for key and freq.
+
+		The counters are updated by \c counter_add, so that an overflow 
+		of a narrow counter type throws \c std::overflow_error. In this 
+		case, the counters are left unchanged.
+	  */
+	template <typename Counter>
+	static inline void update(const hash_family* hf, Counter* S,
+		size_t key, Counter freq)
+	{
+		const int64_t * const F0 = hf->coefficients(0);
+		const int64_t * const F1 = hf->coefficients(1);
+		const int64_t * const F2 = hf->coefficients(2);
+		const int64_t * const F3 = hf->coefficients(3);
+		const int64_t * const F4 = hf->coefficients(4);
+		const int64_t * const F5 = hf->coefficients(5);
+
+		size_t idx[D];
+		Counter val[D];
+		for(depth_type d=0; d<D; d++) {
+			idx[d] = d*L + column(hash31u(F0[d], F1[d], key));
+			val[d] = S[idx[d]];
+			counter_add(val[d], fourwise31u(key, F2[d], F3[d], F4[d], F5[d]) ? freq : -freq);
+		}
+		for(depth_type d=0; d<D; d++)
+			S[idx[d]] = val[d];
+	}
+
+	/// Update the counters for key and freq and set delta vector
+	template <typename Counter>
+	static inline void update(const hash_family* hf, Counter* S,
+		delta_vector& delta, size_t key, Counter freq)
+	{
+		assert(delta.index.size()==D);
+		const int64_t * const F0 = hf->coefficients(0);
+		const int64_t * const F1 = hf->coefficients(1);
+		const int64_t * const F2 = hf->coefficients(2);
+		const int64_t * const F3 = hf->coefficients(3);
+		const int64_t * const F4 = hf->coefficients(4);
+		const int64_t * const F5 = hf->coefficients(5);
+
+		Counter val[D];
+		for(depth_type d=0; d<D; d++) {
+			const size_t j = d*L + column(hash31u(F0[d], F1[d], key));
+			delta.index[d] = j;
+			val[d] = S[j];
+			counter_add(val[d], fourwise31u(key, F2[d], F3[d], F4[d], F5[d]) ? freq : -freq);
+		}
+		for(depth_type d=0; d<D; d++) {
+			const size_t j = delta.index[d];
+			delta.xold[d] = S[j];
+			S[j] = val[d];
+			delta.xnew[d] = S[j];
+		}
+	}
+
+	/// Compute the dot products of parallel rows into out[0..D)
+	template <typename Counter>
+	static inline void dot_estvec(const Counter* S1, const Counter* S2, double* out)
+	{
+		for(depth_type d=0; d<D; d++) {
+			const Counter* r1 = S1 + d*L;
+			const Counter* r2 = S2 + d*L;
+			double acc = 0.0;
+			for(size_t l=0; l<L; l++)
+				acc += (double)r1[l] * r2[l];
+			out[d] = acc;
+		}
+	}
+
+	static void kernel_update(const hash_family* hf, double* S, size_t key, double freq) {
+		update<double>(hf, S, key, freq);
+	}
+	static void kernel_update_delta(const hash_family* hf, double* S,
+		delta_vector& delta, size_t key, double freq) {
+		update<double>(hf, S, delta, key, freq);
+	}
+	static void kernel_dot_estvec(const double* S1, const double* S2, double* out) {
+		dot_estvec<double>(S1, S2, out);
+	}
+
+	/// The kernel of this shape, for binding to a projection
+	static inline const fixed_shape_kernel kernel = {
+		D, L, &kernel_update, &kernel_update_delta, &kernel_dot_estvec
+	};
+};
+
+
+
+/**
+	An AGMS sketch with a compile-time shape.
+
+	The counters are stored in a \c std::array of size \f$ D\cdot L\f$.
+	The sketch carries a projection, which must match its shape, so that
+	it interoperates with the rest of the AGMS code; in particular,
+	\c view() returns a \c sketch_view over the counters.
+  */
+template <depth_type D, size_t L, typename Counter = double>
+class fixed_sketch
+{
+public:
+	typedef fixed_shape<D,L> shape;
+	typedef Counter counter_type;
+	typedef std::array<Counter, D*L> array_type;
+
+	/// the projection of the sketch
+	agms::projection proj;
+
+	/// the counters
+	array_type counters;
+
+	/// Initialize to a zero sketch with the cached hash family of depth D
+	fixed_sketch() : fixed_sketch(projection(D,L)) { }
+
+	/**
+		Initialize to a zero sketch of the given projection.
+
+		Throws \c std::length_error if the shape of the projection is not
+		\f$ D\times L\f$, and \c std::invalid_argument if its hash policy 
+		or sketch family is not supported (see \c fixed_shape::supports).
+	  */
+	explicit fixed_sketch(const projection& _proj)
+	: proj(_proj)
+	{
+		if(proj.depth()!=D || proj.width()!=L)
+			throw std::length_error("projection does not match the fixed sketch shape");
+		if(! shape::supports(proj))
+			throw std::invalid_argument("fixed sketches support only the poly31 hash policy and the agms family");
+		proj.bind_fixed_shape();
+		counters.fill(0);
+	}
+
+	/// The hash family
+	inline hash_family* hashf() const { return proj.hashf(); }
+
+	static constexpr depth_type depth() { return D; }
+	static constexpr size_t width() { return L; }
+	static constexpr size_t size() { return D*L; }
+
+	inline Counter* begin() { return counters.data(); }
+	inline Counter* end() { return counters.data()+size(); }
+	inline const Counter* begin() const { return counters.data(); }
+	inline const Counter* end() const { return counters.data()+size(); }
+
+	inline Counter operator[](size_t i) const { return counters[i]; }
+	inline Counter& operator[](size_t i) { return counters[i]; }
+
+	inline auto view() {
+		return sketch_view<Counter*>(proj, begin(), end());
+	}
+	inline auto view() const {
+		return sketch_view<const Counter*>(proj, begin(), end());
+	}
+
+	/// Update the sketch
+	inline void update(size_t key, Counter freq = 1) {
+		shape::update(hashf(), begin(), key, freq);
+	}
+
+	/// Update the sketch and set the delta vector
+	inline void update(delta_vector& delta, size_t key, Counter freq = 1) {
+		shape::update(hashf(), begin(), delta, key, freq);
+	}
+
+	/// Insert a key into the sketch
+	inline void insert(size_t key) { update(key, 1); }
+
+	/// Erase a key from the sketch
+	inline void erase(size_t key) { update(key, -1); }
+
+	/// Return true if this sketch is compatible to sk
+	inline bool compatible(const fixed_sketch& sk) const {
+		return proj == sk.proj;
+	}
+
+	inline size_t byte_size() const {
+		return sizeof(Counter)*size();
+	}
+};
+
+
+/**
+	Return a vector of the dot products of
+	parallel rows of two fixed sketches.
+  */
+template <depth_type D, size_t L, typename Counter>
+inline Vec dot_estvec(const fixed_sketch<D,L,Counter>& s1, const fixed_sketch<D,L,Counter>& s2)
+{
+	assert(s1.compatible(s2));
+	Vec ret(D);
+	fixed_shape<D,L>::dot_estvec(s1.begin(), s2.begin(), &ret[0]);
+	return ret;
+}
+
+/**
+	A shorthand for dot_estvec(s,s)
+  */
+template <depth_type D, size_t L, typename Counter>
+inline Vec dot_estvec(const fixed_sketch<D,L,Counter>& s)
+{
+	return dot_estvec(s,s);
+}
+
+/**
+	Return the (robust) estimate of the inner product
+	of two fixed sketches
+  */
+template <depth_type D, size_t L, typename Counter>
+inline double dot_est(const fixed_sketch<D,L,Counter>& s1, const fixed_sketch<D,L,Counter>& s2)
+{
+	return s1.proj.estimate(dot_estvec(s1,s2));
+}
+
+/**
+	Return the (robust) estimate of the self product
+	of a fixed sketch
+  */
+template <depth_type D, size_t L, typename Counter>
+inline double dot_est(const fixed_sketch<D,L,Counter>& s)
+{
+	return s.proj.estimate(dot_estvec(s));
+}
+
+
+} // end namespace agms
+
+#endif
@@ -4,6 +4,7 @@
 #include <cstdio>
 
 #include "agms.hh"
+#include "agms_fixed.hh"
 
 using std::all_of;
 using std::begin;
@@ -46,6 +47,281 @@ public:
     }
 
 
+    void testHashBatch()
+    {
+    	hash_family HF(7);
+    	const size_t n = 100;
+    	size_t keys[n];
+    	for(size_t i=0;i<n;i++) keys[i] = 17*i+131 + (i%3)*1000000007ull;
+
+    	size_t h[7*n];
+    	bool s[7*n];
+    	HF.hash_batch(keys, n, h, s);
+
+    	for(size_t i=0;i<n;i++) {
+    		size_t ha[7];
+    		bool sa[7];
+    		HF.hash_all(keys[i], ha);
+    		HF.fourwise_all(keys[i], sa);
+    		for(depth_type d=0; d<7; d++) {
+    			TS_ASSERT_EQUALS(ha[d], HF.hash(d, keys[i]));
+    			TS_ASSERT_EQUALS(sa[d], HF.fourwise(d, keys[i]));
+    			TS_ASSERT_EQUALS(h[d*n+i], HF.hash(d, keys[i]));
+    			TS_ASSERT_EQUALS(s[d*n+i], HF.fourwise(d, keys[i]));
+    		}
+    	}
+
+    	projection proj(&HF, 503);
+    	size_t idx[7*n];
+    	proj.hash_cells(keys, n, idx, s);
+    	for(size_t i=0;i<n;i++) {
+    		size_t ic[7];
+    		bool sc[7];
+    		proj.hash_cells(keys[i], ic, sc);
+    		for(depth_type d=0; d<7; d++) {
+    			TS_ASSERT_EQUALS(ic[d], d*503 + proj.hash(d, keys[i]));
+    			TS_ASSERT_EQUALS(sc[d], proj.fourwise(d, keys[i]));
+    			TS_ASSERT_EQUALS(idx[d*n+i], ic[d]);
+    			TS_ASSERT_EQUALS(s[d*n+i], sc[d]);
+    		}
+    	}
+    }
+
+
+    void test_key_table() {
+    	projection proj(7, 500);
+    	projection tproj = proj;
+
+    	// too large for the memory limit
+    	TS_ASSERT(! tproj.bind_key_range(0, 1000000, 1000));
+    	TS_ASSERT(tproj.key_table() == nullptr);
+
+    	TS_ASSERT(tproj.bind_key_range(100, 200000));
+    	TS_ASSERT(tproj.key_table() != nullptr);
+    	TS_ASSERT_EQUALS(tproj.key_table()->hashf(), proj.hashf());
+    	TS_ASSERT(tproj == proj);
+
+    	// shared among projections
+    	projection tproj2 = proj;
+    	tproj2.bind_key_range(100, 200000);
+    	TS_ASSERT_EQUALS(tproj.key_table(), tproj2.key_table());
+
+    	// keys in and out of the range give the same cells
+    	const size_t n = 300;
+    	size_t keys[n];
+    	for(size_t i=0; i<n; i++) keys[i] = (i*7919) % 200500;
+    	size_t idx[7*n], tidx[7*n];
+    	bool sgn[7*n], tsgn[7*n];
+    	proj.hash_cells(keys, n, idx, sgn);
+    	tproj.hash_cells(keys, n, tidx, tsgn);
+    	for(size_t i=0; i<7*n; i++) {
+    		TS_ASSERT_EQUALS(idx[i], tidx[i]);
+    		TS_ASSERT_EQUALS(sgn[i], tsgn[i]);
+    	}
+
+    	Index ix(7), tix(7);
+    	Mask m(7), tm(7);
+    	for(size_t i=0; i<n; i++) {
+    		proj.update_index(keys[i], ix);
+    		tproj.update_index(keys[i], tix);
+    		proj.update_mask(keys[i], m);
+    		tproj.update_mask(keys[i], tm);
+    		for(size_t d=0; d<7; d++) {
+    			TS_ASSERT_EQUALS(ix[d], tix[d]);
+    			TS_ASSERT_EQUALS(m[d], tm[d]);
+    		}
+    	}
+
+    	// sketches are identical, also with a fixed-shape kernel
+    	tproj.bind_fixed_shape();
+    	sketch sk(proj), tsk(tproj);
+    	for(size_t i=0; i<n; i++) {
+    		sk.update(keys[i], 1.0+i);
+    		tsk.update(keys[i], 1.0+i);
+    	}
+    	for(size_t i=0; i<sk.size(); i++)
+    		TS_ASSERT_EQUALS(sk[i], tsk[i]);
+
+    	// released tables do not accumulate in the cache
+    	const size_t cached = key_cell_table::cached();
+    	for(size_t k=0; k<10; k++) {
+    		projection p = proj;
+    		TS_ASSERT(p.bind_key_range(k, k+100));
+    	}
+    	TS_ASSERT_LESS_THAN_EQUALS(key_cell_table::cached(), cached+1);
+    }
+
+
+    void test_dot_est_fused() {
+    	projection proj(7, 301);
+    	sketch s1(proj), s2(proj);
+    	s1 = hdv::uniform_random_vector(proj.size(), -5, 5);
+    	s2 = hdv::uniform_random_vector(proj.size(), -5, 5);
+
+    	Vec v = dot_estvec(s1, s2);
+    	for(size_t d=0; d<7; d++)
+    		TS_ASSERT_EQUALS(v[d], std::inner_product(s1.row_begin(d), s1.row_end(d), 
+    			s2.row_begin(d), 0.0));
+    	TS_ASSERT_EQUALS(dot_est(s1, s2), hdv::median(v));
+    	TS_ASSERT_EQUALS(dot_est(s1), hdv::median(dot_estvec(s1)));
+
+    	// over non-contiguous iterators
+    	std::vector<double> c1(begin(s1), end(s1));
+    	TS_ASSERT_EQUALS(dot_est(proj(c1), s2.view()), dot_est(s1, s2));
+
+    	// the incremental state is reused
+    	Vec inc(7);
+    	const double* buf = &inc[0];
+    	TS_ASSERT_EQUALS(dot_est_with_inc(inc, s1, s2), dot_est(s1, s2));
+    	TS_ASSERT_EQUALS(&inc[0], buf);
+    }
+
+    void test_parallel_update() {
+    	projection proj(7, 500);
+    	std::vector<std::pair<size_t,double>> recs;
+    	for(size_t i=0; i<300000; i++)
+    		recs.emplace_back((i*7919)%100003, (i%3==0) ? -1.0 : 2.0);
+    	auto select = [](const std::pair<size_t,double>& r, size_t& key, double& freq) {
+    		key = r.first;
+    		freq = r.second;
+    		return key % 5 != 0;
+    	};
+
+    	sketch seq(proj);
+    	for(auto& r : recs)
+    		if(r.first % 5 != 0) seq.update(r.first, r.second);
+
+    	for(size_t nthreads : {1, 2, 4}) {
+    		sketch sk(proj);
+    		parallel_update(sk.view(), recs.begin(), recs.end(), select, nthreads);
+    		TS_ASSERT( (sk == seq).min() );
+    	}
+
+    	// non-integral frequencies give the same result for any number of threads
+    	for(size_t i=0; i<recs.size(); i++)
+    		recs[i].second = 0.1*(i%11) - 0.33;
+    	sketch one(proj);
+    	parallel_update(one.view(), recs.begin(), recs.end(), select, 1);
+    	for(size_t nthreads : {2, 3, 4}) {
+    		sketch sk(proj);
+    		parallel_update(sk.view(), recs.begin(), recs.end(), select, nthreads);
+    		TS_ASSERT( (sk == one).min() );
+    	}
+    	for(size_t i=0; i<recs.size(); i++)
+    		recs[i].second = (i%3==0) ? -1.0 : 2.0;
+
+    	// narrow counters
+    	basic_sketch<int32_t> sk32(proj);
+    	parallel_update(sk32.view(), recs.begin(), recs.end(), select, 4);
+    	for(size_t i=0; i<proj.size(); i++)
+    		TS_ASSERT_EQUALS(sk32[i], seq[i]);
+
+    	// exceptions are propagated
+    	TS_ASSERT_THROWS(par::for_shards(10, 3, [](size_t t, size_t, size_t) {
+    		if(t==2) throw std::runtime_error("shard failed");
+    	}), std::runtime_error);
+    }
+
+    void test_parallel_dot_estvec() {
+    	projection proj(7, 20000);
+    	sketch s1(proj), s2(proj);
+    	for(size_t i=0; i<5000; i++) {
+    		s1.update((i*7919)%100003, 1.5);
+    		s2.update((i*104729)%100003, (i%3==0) ? -1.0 : 2.0);
+    	}
+
+    	Vec seq = dot_estvec(s1.view(), s2.view());
+    	Vec par1 = parallel_dot_estvec(s1.view(), s2.view(), 1);
+    	for(size_t nthreads : {2, 3, 8}) {
+    		Vec par = parallel_dot_estvec(s1.view(), s2.view(), nthreads);
+    		TS_ASSERT( (par == par1).min() );
+    	}
+    	for(size_t d=0; d<proj.depth(); d++)
+    		TS_ASSERT_DELTA(par1[d], seq[d], 1E-9*fabs(seq[d]));
+
+    	Vec self = parallel_dot_estvec(s1.view(), 4);
+    	Vec selfseq = dot_estvec(s1.view());
+    	for(size_t d=0; d<proj.depth(); d++)
+    		TS_ASSERT_DELTA(self[d], selfseq[d], 1E-9*fabs(selfseq[d]));
+    }
+
+    void test_sketch_families() {
+    	hash_family* hf = hash_family::get_cached(7);
+    	projection pa(hf, 500), pcm(hf, 500, sketch_family::count_min), 
+    		pcs(hf, 500, sketch_family::count_sketch);
+    	TS_ASSERT(pa != pcm);
+    	TS_ASSERT(pcm != pcs);
+    	TS_ASSERT(! pcm.bind_fixed_shape());
+
+    	const size_t n = 200;
+    	size_t keys[n];
+    	for(size_t i=0; i<n; i++) keys[i] = 17*i+3;
+
+    	for(projection* p : {&pa, &pcm, &pcs}) {
+    		size_t idx[7*n];
+    		bool sgn[7*n];
+    		p->hash_cells(keys, n, idx, sgn);
+
+    		// the same cells in all families
+    		for(size_t i=0; i<n; i++)
+    			for(depth_type d=0; d<7; d++) {
+    				TS_ASSERT_EQUALS(idx[d*n+i], d*500+pa.hash(d, keys[i]));
+    				TS_ASSERT_EQUALS(sgn[d*n+i], p->fourwise(d, keys[i]));
+    				switch(p->family()) {
+    				case sketch_family::count_min:
+    					TS_ASSERT(sgn[d*n+i]); break;
+    				case sketch_family::count_sketch:
+    					TS_ASSERT_EQUALS(sgn[d*n+i], hf->pairwise(d, keys[i]));
+    					break;
+    				default:
+    					TS_ASSERT_EQUALS(sgn[d*n+i], hf->fourwise(d, keys[i]));
+    				}
+    			}
+
+    		// the key table agrees
+    		projection tp = *p;
+    		TS_ASSERT(tp.bind_key_range(0, 17*n));
+    		size_t tidx[7*n];
+    		bool tsgn[7*n];
+    		tp.hash_cells(keys, n, tidx, tsgn);
+    		for(size_t i=0; i<7*n; i++) {
+    			TS_ASSERT_EQUALS(idx[i], tidx[i]);
+    			TS_ASSERT_EQUALS(sgn[i], tsgn[i]);
+    		}
+    	}
+
+    	// the count_sketch sign does not follow the bits of the bucket hash
+    	size_t agree = 0;
+    	for(size_t i=0; i<n; i++)
+    		for(depth_type d=0; d<7; d++)
+    			agree += pcs.fourwise(d, keys[i]) == bool((hf->hash(d, keys[i])>>30) & 1);
+    	TS_ASSERT_DELTA(agree, 7*n/2, 7*n/10);
+
+    	// Count-Min overestimates the self-join of non-negative streams
+    	sketch cm(pcm), cs(pcs);
+    	isketch icm(pcm);
+    	Vec inc;
+    	for(size_t i=0; i<1000; i++) {
+    		size_t key = i % 100;
+    		cm.update(key);
+    		cs.update(key);
+    		icm.update(key);
+    	}
+    	const double sj = 100*10.0*10.0;
+    	TS_ASSERT_LESS_THAN_EQUALS(sj, dot_est(cm));
+    	TS_ASSERT_EQUALS(dot_est(cm), dot_estvec(cm).min());
+    	TS_ASSERT_EQUALS(dot_est(cs), hdv::median(dot_estvec(cs)));
+    	TS_ASSERT_DELTA(dot_est(cs), sj, 4.0/sqrt(500)*sj);
+
+    	// incremental estimates
+    	double est = dot_est_with_inc(inc, icm);
+    	TS_ASSERT_EQUALS(est, dot_est(cm));
+    	icm.update(1000);
+    	cm.update(1000);
+    	TS_ASSERT_DELTA(dot_est_inc(inc, icm.delta, icm.proj), dot_est(cm), 1e-9);
+    }
+
+
     void testCache() {
     	hash_family* hf = hash_family::get_cached(5);
     	TS_ASSERT_EQUALS(hf->depth(), 5);
@@ -206,4 +482,266 @@ public:
 	}
 
 
+
+	void test_update_batch()
+	{
+		projection proj(5, 101);
+
+		// a batch longer than a chunk, with repeated keys
+		const size_t n = 3*batch_chunk+17;
+		vector<size_t> keys(n);
+		vector<double> freqs(n);
+		for(size_t i=0; i<n; i++) {
+			keys[i] = (i*i + 13*i) % 173;
+			freqs[i] = (i%3==0) ? -1.0 : 2.0;
+		}
+
+		isketch isk1(proj), isk2(proj), isk3(proj);
+		vector<delta_vector> seq;
+		for(size_t i=0; i<n; i++) {
+			isk1.update(keys[i], freqs[i]);
+			seq.push_back(isk1.delta);
+		}
+
+		isk2.update_batch(keys.data(), freqs.data(), n);
+		TS_ASSERT( (isk1 == isk2).min() );
+		TS_ASSERT( (isk1.delta.index == isk2.delta.index).min() );
+		TS_ASSERT( (isk1.delta.xold == isk2.delta.xold).min() );
+		TS_ASSERT( (isk1.delta.xnew == isk2.delta.xnew).min() );
+
+		vector<delta_vector> deltas;
+		isk3.update_batch(deltas, keys.data(), freqs.data(), n);
+		TS_ASSERT( (isk1 == isk3).min() );
+		TS_ASSERT_EQUALS(deltas.size(), n);
+		for(size_t i=0; i<n; i++) {
+			TS_ASSERT( (seq[i].index == deltas[i].index).min() );
+			TS_ASSERT( (seq[i].xold == deltas[i].xold).min() );
+			TS_ASSERT( (seq[i].xnew == deltas[i].xnew).min() );
+		}
+
+		sketch sk(proj);
+		sk.update_batch(keys.data(), freqs.data(), n);
+		TS_ASSERT( (isk1 == sk).min() );
+
+		// with non-integral frequencies, the last delta is still exact
+		for(size_t i=0; i<n; i++)
+			freqs[i] = 0.1*(i%7) - 0.25;
+		isketch isk4(proj), isk5(proj);
+		for(size_t i=0; i<n; i++)
+			isk4.update(keys[i], freqs[i]);
+		isk5.update_batch(keys.data(), freqs.data(), n);
+		TS_ASSERT( (isk4 == isk5).min() );
+		TS_ASSERT( (isk4.delta.xold == isk5.delta.xold).min() );
+		TS_ASSERT( (isk4.delta.xnew == isk5.delta.xnew).min() );
+	}
+
+
+	void test_fixed_sketch()
+	{
+		fixed_sketch<7,500> fs;
+		fixed_sketch<5,1024> fs2;
+		sketch sk(7,500), sk2(5,1024);
+		TS_ASSERT_EQUALS(fs.proj, sk.proj);
+		TS_ASSERT_THROWS(( fixed_sketch<7,1000>(projection(7,500)) ), std::length_error);
+
+		// a bound projection
+		projection bproj(7,500);
+		TS_ASSERT(bproj.bind_fixed_shape());
+		TS_ASSERT(! projection(7,501).bind_fixed_shape());
+		Vec S(0.0, bproj.size());
+		auto bview = bproj(S);
+
+		delta_vector d1(7), d2(7);
+		for(size_t i=0; i<10000; i++) {
+			size_t key = i*i+13*i+7;
+			double freq = (i%5==0) ? -1.0 : 1.0;
+			fs.update(key, freq);
+			fs2.update(key, freq);
+			sk2.update(key, freq);
+			sk.update(d1, key, freq);
+			bview.update(d2, key, freq);
+			TS_ASSERT( (d1.index==d2.index).min() );
+			TS_ASSERT( (d1.xnew==d2.xnew).min() );
+		}
+
+		TS_ASSERT(std::equal(fs.begin(), fs.end(), begin(sk)));
+		TS_ASSERT(std::equal(fs2.begin(), fs2.end(), begin(sk2)));
+		TS_ASSERT( (S == sk).min() );
+
+		TS_ASSERT_EQUALS(dot_est(fs), dot_est(sk));
+		TS_ASSERT_EQUALS(dot_est(fs2), dot_est(sk2));
+		TS_ASSERT_EQUALS(dot_est(bview), dot_est(sk));
+		TS_ASSERT_EQUALS(dot_est(fs.view()), dot_est(sk));
+
+		// only the poly31 agms projections are supported
+		TS_ASSERT_THROWS(( fixed_sketch<7,500>(projection(7,500,sketch_family::count_min)) ), 
+			std::invalid_argument);
+		TS_ASSERT_THROWS(( fixed_sketch<7,500>(projection(
+			hash_family::get_cached(7, hash_policy::tabulation), 500)) ), std::invalid_argument);
+
+		// narrow counters overflow, leaving the sketch unchanged
+		fixed_sketch<7,500,int16_t> fs16;
+		fs16.update(17, 30000);
+		auto before = fs16.counters;
+		delta_vector d3(7);
+		TS_ASSERT_THROWS(fs16.update(17, 30000), std::overflow_error);
+		TS_ASSERT_THROWS(fs16.update(d3, 17, 30000), std::overflow_error);
+		TS_ASSERT(fs16.counters == before);
+	}
+
+
+	void test_narrow_counters()
+	{
+		projection proj(7, 500);
+		isketch isk(proj);
+		basic_isketch<int32_t> isk32(proj);
+		basic_isketch<float> iskf(proj);
+		basic_sketch<int16_t> sk16(proj);
+
+		Vec inc, inc32;
+		dot_est_with_inc(inc, isk);
+		dot_est_with_inc(inc32, isk32);
+
+		for(size_t i=0; i<20000; i++) {
+			size_t key = (i*i + 13*i) % 4099;
+			double freq = (i%7==0) ? -1.0 : 1.0;
+			isk.update(key, freq);
+			isk32.update(key, freq);
+			iskf.update(key, freq);
+			sk16.update(key, (int16_t) freq);
+			TS_ASSERT( (isk.delta.xnew == isk32.delta.xnew).min() );
+			dot_est_inc(inc, isk.delta);
+			dot_est_inc(inc32, isk32.delta);
+		}
+
+		TS_ASSERT(std::equal(begin(isk), end(isk), begin(isk32)));
+		TS_ASSERT(std::equal(begin(isk), end(isk), begin(iskf)));
+		TS_ASSERT(std::equal(begin(isk), end(isk), begin(sk16)));
+		TS_ASSERT_EQUALS(dot_est(isk), dot_est(isk32));
+		TS_ASSERT_EQUALS(dot_est(isk), dot_est(sk16));
+		TS_ASSERT_EQUALS(dot_est(isk, isk), dot_est(isk32.view(), iskf.view()));
+		TS_ASSERT( (inc == inc32).min() );
+		TS_ASSERT_EQUALS(isk32.byte_size(), isk.byte_size());
+		TS_ASSERT_EQUALS(2*sk16.byte_size(), isk.byte_size());
+
+		// overflow detection
+		basic_sketch<int16_t> small(proj);
+		TS_ASSERT_THROWS( for(size_t i=0; i<32769; i++) small.insert(17), 
+			std::overflow_error);
+		basic_isketch<int16_t> ismall(proj);
+		TS_ASSERT_THROWS(ismall.update(17, 40000.0), std::overflow_error);
+
+		// an overflow in the last row leaves the other rows unchanged
+		const depth_type D = proj.depth();
+		size_t idx[D];
+		bool sgn[D];
+		proj.hash_cells(17, idx, sgn);
+		basic_sketch<int16_t> full(proj);
+		full[idx[D-1]] = sgn[D-1] ? 32767 : -32768;
+		basic_sketch<int16_t> before = full;
+		TS_ASSERT_THROWS(full.update(17, 1), std::overflow_error);
+		TS_ASSERT(std::equal(begin(full), end(full), begin(before)));
+		delta_vector dfull(D);
+		TS_ASSERT_THROWS(full.view().update(dfull, 17, 1), std::overflow_error);
+		TS_ASSERT(std::equal(begin(full), end(full), begin(before)));
+		basic_isketch<int16_t> ifull(proj);
+		ifull[idx[D-1]] = full[idx[D-1]];
+		TS_ASSERT_THROWS(ifull.update(17, 1.0), std::overflow_error);
+		TS_ASSERT(std::equal(begin(ifull), end(ifull), begin(before)));
+
+		// a batch applies the updates before the one that overflows
+		size_t bkeys[] = { 5, 9, 17, 12, 17 };
+		double bfreqs[] = { 2.0, -3.0, 1.0, 4.0, -1.0 };
+		basic_sketch<int16_t> seq = full;
+		for(size_t i=0; i<2; i++) seq.update(bkeys[i], (int16_t) bfreqs[i]);
+		TS_ASSERT_THROWS(full.update_batch(bkeys, bfreqs, 5), std::overflow_error);
+		TS_ASSERT(std::equal(begin(full), end(full), begin(seq)));
+
+		full = before;
+		vector<delta_vector> bdeltas;
+		TS_ASSERT_THROWS(full.update_batch(bdeltas, bkeys, bfreqs, 5), std::overflow_error);
+		TS_ASSERT(std::equal(begin(full), end(full), begin(seq)));
+		basic_sketch<int16_t> replay = before;
+		for(size_t i=0; i<2; i++) {
+			delta_vector dv(D);
+			replay.update(dv, bkeys[i], (int16_t) bfreqs[i]);
+			TS_ASSERT( (dv.index == bdeltas[i].index).min() );
+			TS_ASSERT( (dv.xold == bdeltas[i].xold).min() );
+			TS_ASSERT( (dv.xnew == bdeltas[i].xnew).min() );
+		}
+	}
+
+
+	void test_hash_policies()
+	{
+		// the legacy family is still the default
+		TS_ASSERT_EQUALS(hash_family::get_cached(5), 
+			hash_family::get_cached(5, hash_policy::poly31, 0));
+
+		// a stream with skewed frequencies
+		const size_t N = 2000;
+		double exact = 0.0;
+		vector<size_t> keys;
+		vector<double> freqs;
+		for(size_t k=1; k<=N; k++) {
+			double f = 1 + (N/k) % 50;
+			keys.push_back(k*7919);
+			freqs.push_back(f);
+			exact += f*f;
+		}
+
+		for(auto pol : { hash_policy::poly31, hash_policy::tabulation, 
+				hash_policy::multiply_shift, hash_policy::mix64 }) {
+			hash_family* hf = hash_family::get_cached(7, pol, 42);
+			TS_ASSERT_EQUALS(hf->policy(), pol);
+			TS_ASSERT_EQUALS(hf->seed(), 42);
+			TS_ASSERT_EQUALS(hf, hash_family::get_cached(7, pol, 42));
+			TS_ASSERT_DIFFERS(hf, hash_family::get_cached(7, pol, 43));
+
+			// families of other depths do not share their rows
+			for(uint64_t seed : {0, 42}) {
+				hash_family* h5 = hash_family::get_cached(5, pol, seed);
+				hash_family* h7 = hash_family::get_cached(7, pol, seed);
+				size_t same = 0;
+				for(size_t i=0; i<100; i++)
+					same += h5->hash(0, keys[i]) == h7->hash(0, keys[i]);
+				TS_ASSERT_LESS_THAN(same, 5);
+			}
+
+			// batched and per-depth evaluation agree
+			size_t h[7*N];
+			bool sg[7*N], pw[7*N];
+			hf->hash_batch(keys.data(), N, h, sg);
+			hf->pairwise_batch(keys.data(), N, pw);
+			size_t pos = 0;
+			for(size_t i=0; i<N; i++) {
+				size_t ha[7];
+				bool sa[7], pa[7];
+				hf->hash_all(keys[i], ha);
+				hf->fourwise_all(keys[i], sa);
+				hf->pairwise_all(keys[i], pa);
+				for(depth_type d=0; d<7; d++) {
+					TS_ASSERT_EQUALS(h[d*N+i], hf->hash(d, keys[i]));
+					TS_ASSERT_EQUALS(h[d*N+i], ha[d]);
+					TS_ASSERT_EQUALS(sg[d*N+i], hf->fourwise(d, keys[i]));
+					TS_ASSERT_EQUALS(sg[d*N+i], sa[d]);
+					TS_ASSERT_EQUALS(pw[d*N+i], hf->pairwise(d, keys[i]));
+					TS_ASSERT_EQUALS(pw[d*N+i], pa[d]);
+					TS_ASSERT_LESS_THAN(h[d*N+i], 1ull<<31);
+					if(sg[d*N+i]) pos++;
+				}
+			}
+			// balanced signs
+			TS_ASSERT_LESS_THAN(0.45*7*N, pos);
+			TS_ASSERT_LESS_THAN(pos, 0.55*7*N);
+
+			// accuracy of the self-join estimate, against the AGMS error bound
+			// (relaxed for the policies that are not 4-wise independent)
+			sketch sk(projection(hf, 1000));
+			sk.update_batch(keys.data(), freqs.data(), N);
+			double tol = (pol==hash_policy::poly31) ? 1.0 : 2.0;
+			TS_ASSERT_DELTA(dot_est(sk), exact, tol*sk.proj.epsilon()*exact);
+		}
+	}
+
 };
@@ -26,6 +26,9 @@ using std::initializer_list;
 using Json::Value;
 using agms::projection;
 using agms::depth_type;
+using agms::hash_family;
+using agms::hash_policy;
+using agms::sketch_family;
 
 using binc::print;
 using binc::elements_of;
@@ -129,6 +132,20 @@ void dds::prepare_dataset(Value& cfg, dataset& D)
 //----------------------------------------------
 
 
+enum_repr<hash_policy> dds::hash_policy_repr ({
+	{ hash_policy::poly31, "poly31" },
+	{ hash_policy::tabulation, "tabulation" },
+	{ hash_policy::multiply_shift, "multiply_shift" },
+	{ hash_policy::mix64, "mix64" }
+});
+
+enum_repr<sketch_family> dds::sketch_family_repr ({
+	{ sketch_family::agms, "agms" },
+	{ sketch_family::count_min, "count_min" },
+	{ sketch_family::count_sketch, "count_sketch" }
+});
+
+
 projection dds::get_projection(const Value& js)
 {
 	const Value& jp = js["projection"];
@@ -136,11 +153,29 @@ projection dds::get_projection(const Value& js)
 	depth_type d = jp["depth"].asUInt();
 	size_t w = jp["width"].asUInt();
 	assert(d>0 && w>0);
+
+	hash_policy policy = hash_policy_repr[jp.get("hash", "poly31").asString()];
+	uint64_t seed = jp.get("seed", 0).asUInt64();
+	sketch_family family = sketch_family_repr[jp.get("family", "agms").asString()];
 	
-	projection proj(d,w);
+	projection proj(hash_family::get_cached(d, policy, seed), w, family);
 
 	if(!jp["epsilon"].isNull())
 		proj.set_epsilon(jp["epsilon"].asDouble());
+
+	// use the precompiled kernel for this shape, if there is one
+	if(jp.get("fixed_shape", true).asBool())
+		proj.bind_fixed_shape();
+
+	// precompute the cells of the keys, if the key range of the data is known
+	if(jp.get("key_table", true).asBool() && CTX.has_data_feed()) {
+		const ds_metadata& dsm = CTX.metadata();
+		if(dsm.valid() && 0 <= dsm.minkey() && dsm.minkey() <= dsm.maxkey()) {
+			size_t limit = jp.get("key_table_mb", 
+				(Json::UInt64)(projection::default_key_table_limit >> 20)).asUInt64() << 20;
+			proj.bind_key_range(dsm.minkey(), dsm.maxkey(), limit);
+		}
+	}
 	return proj;
 }
 
@@ -26,12 +26,37 @@ namespace dds
 		"projection": {
 			"depth": <int>,
 			"width": <int>,
-			["epsilon": <float>]
+			["epsilon": <float>,]
+			["hash": "poly31" | "tabulation" | "multiply_shift" | "mix64",]
+			["seed": <int>,]
+			["family": "agms" | "count_min" | "count_sketch",]
+			["fixed_shape": <bool>,]
+			["key_table": <bool>,]
+			["key_table_mb": <int>]
 		}
 		\endcode
+
+		The hash family is the cached family for the depth, hash policy 
+		(default "poly31") and seed (default 0). The sketch family
+		defaults to "agms".
+
+		If the shape of the projection is one of the precompiled
+		shapes (e.g. 7x500 or 5x1000), the projection is bound to its 
+		fixed-shape kernel, unless \c fixed_shape is false.
+
+		If the key range of the current data source is known, the projection
+		is bound to a table of the cells of the keys (see 
+		\c agms::key_cell_table), unless \c key_table is false or the table
+		needs more than \c key_table_mb megabytes (default 256).
 	  */
 	agms::projection get_projection(const Json::Value& js);
 
+	/// Names of the hash policies in the configuration
+	extern enum_repr<agms::hash_policy> hash_policy_repr;
+
+	/// Names of the sketch families in the configuration
+	extern enum_repr<agms::sketch_family> sketch_family_repr;
+
 	/**
 		\brief Return a set of sids from the current object.
 
@@ -0,0 +1,242 @@
+#include <algorithm>
+#include <cstring>
+#include <cassert>
+#include <cmath>
+#include <stdexcept>
+
+#include "codec.hh"
+
+using namespace gm;
+
+
+void gm::put_varint(byte_buffer& out, uint64_t x)
+{
+	while(x >= 0x80) {
+		out.push_back(uint8_t(x) | 0x80);
+		x >>= 7;
+	}
+	out.push_back(uint8_t(x));
+}
+
+
+uint64_t gm::get_varint(const uint8_t*& in)
+{
+	uint64_t x = 0;
+	for(unsigned shift=0; ; shift += 7) {
+		uint8_t b = *in++;
+		x |= uint64_t(b & 0x7f) << shift;
+		if(!(b & 0x80)) return x;
+	}
+}
+
+
+uint16_t gm::float_to_half(float x)
+{
+	uint32_t f;
+	std::memcpy(&f, &x, 4);
+	const uint16_t sign = (f >> 16) & 0x8000;
+	const uint32_t absf = f & 0x7fffffff;
+
+	if(absf >= 0x7f800000)			// inf or nan
+		return sign | 0x7c00 | ((absf > 0x7f800000) ? 0x200 : 0);
+	if(absf >= 0x477ff000)			// overflows to inf
+		return sign | 0x7c00;
+	if(absf < 0x38800000) {			// subnormal or zero
+		if(absf < 0x33000000) return sign;
+		const uint32_t mant = (absf & 0x7fffff) | 0x800000;
+		const int shift = 126 - int(absf >> 23);		// 14..24
+		uint32_t h = mant >> shift;
+		const uint32_t rem = mant & ((1u << shift)-1);
+		const uint32_t half = 1u << (shift-1);
+		if(rem > half || (rem == half && (h & 1))) h++;
+		return sign | h;
+	}
+
+	// normal: rebias the exponent and round the mantissa to 10 bits
+	uint32_t h = ((absf >> 13) - (112 << 10));
+	const uint32_t rem = absf & 0x1fff;
+	if(rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++;
+	return sign | h;
+}
+
+
+float gm::half_to_float(uint16_t h)
+{
+	const uint32_t sign = uint32_t(h & 0x8000) << 16;
+	uint32_t exp = (h >> 10) & 0x1f;
+	uint32_t mant = h & 0x3ff;
+	uint32_t f;
+
+	if(exp == 0x1f)
+		f = sign | 0x7f800000 | (mant << 13);
+	else if(exp != 0)
+		f = sign | ((exp + 112) << 23) | (mant << 13);
+	else if(mant == 0)
+		f = sign;
+	else {
+		// subnormal: normalize
+		exp = 113;
+		while(!(mant & 0x400)) { mant <<= 1; exp--; }
+		f = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+	}
+
+	float x;
+	std::memcpy(&x, &f, 4);
+	return x;
+}
+
+
+static inline void put_u32(byte_buffer& out, uint32_t x)
+{
+	for(int i=0; i<4; i++) out.push_back(uint8_t(x >> (8*i)));
+}
+
+static inline uint32_t get_u32(const uint8_t*& in)
+{
+	uint32_t x = 0;
+	for(int i=0; i<4; i++) x |= uint32_t(*in++) << (8*i);
+	return x;
+}
+
+static inline void put_float(byte_buffer& out, float v)
+{
+	uint32_t x;
+	std::memcpy(&x, &v, 4);
+	put_u32(out, x);
+}
+
+static inline float get_float(const uint8_t*& in)
+{
+	uint32_t x = get_u32(in);
+	float v;
+	std::memcpy(&v, &x, 4);
+	return v;
+}
+
+
+void gm::encode_elements(wire_codec codec, size_t dim,
+	std::vector<std::pair<size_t,double>>& elems, byte_buffer& out)
+{
+	put_varint(out, dim);
+
+	if(codec == wire_codec::dense) {
+		std::vector<float> v(dim, 0.0f);
+		for(auto& e : elems) v[e.first] = e.second;
+		for(float x : v) put_float(out, x);
+		return;
+	}
+	if(codec == wire_codec::estimate)
+		throw std::invalid_argument("The 'estimate' codec does not encode vectors");
+
+	// the sparse codecs
+	elems.erase(std::remove_if(elems.begin(), elems.end(),
+		[](auto& e) { return e.second == 0.0; }), elems.end());
+	std::sort(elems.begin(), elems.end());
+	put_varint(out, elems.size());
+
+	size_t next = 0;
+	for(auto& e : elems) {
+		switch(codec) {
+			case wire_codec::sparse:
+				put_u32(out, e.first);
+				put_float(out, e.second);
+				break;
+			case wire_codec::varint:
+				put_varint(out, e.first - next);
+				put_float(out, e.second);
+				break;
+			case wire_codec::float16: {
+				put_varint(out, e.first - next);
+				uint16_t h = float_to_half(e.second);
+				out.push_back(uint8_t(h));
+				out.push_back(uint8_t(h >> 8));
+				break;
+			}
+			default:
+				assert(false);
+		}
+		next = e.first + 1;
+	}
+}
+
+
+void gm::encode_vector(wire_codec codec, const Vec& v, byte_buffer& out,
+	const std::vector<size_t>* nz)
+{
+	std::vector<std::pair<size_t,double>> elems;
+	if(nz != nullptr && codec != wire_codec::dense) {
+		elems.reserve(nz->size());
+		for(size_t i : *nz) elems.emplace_back(i, v[i]);
+	} else {
+		for(size_t i=0; i<v.size(); i++)
+			if(v[i] != 0.0) elems.emplace_back(i, v[i]);
+	}
+	encode_elements(codec, v.size(), elems, out);
+}
+
+
+size_t gm::decode_vector(wire_codec codec, const uint8_t* in, Vec& v)
+{
+	const uint8_t* start = in;
+	const size_t dim = get_varint(in);
+	v.resize(dim, 0.0);
+
+	if(codec == wire_codec::dense) {
+		for(size_t i=0; i<dim; i++) v[i] = get_float(in);
+		return in-start;
+	}
+	if(codec == wire_codec::estimate)
+		throw std::invalid_argument("The 'estimate' codec does not encode vectors");
+
+	const size_t n = get_varint(in);
+	size_t next = 0;
+	for(size_t j=0; j<n; j++) {
+		size_t i;
+		switch(codec) {
+			case wire_codec::sparse:
+				i = get_u32(in);
+				v[i] = get_float(in);
+				break;
+			case wire_codec::varint:
+				i = next + get_varint(in);
+				v[i] = get_float(in);
+				break;
+			case wire_codec::float16: {
+				i = next + get_varint(in);
+				uint16_t h = uint16_t(in[0]) | (uint16_t(in[1]) << 8);
+				in += 2;
+				v[i] = half_to_float(h);
+				break;
+			}
+			default:
+				throw std::invalid_argument("Unknown codec");
+		}
+		next = i + 1;
+	}
+	return in-start;
+}
+
+
+size_t gm::encoded_size(wire_codec codec, const Vec& v, const std::vector<size_t>* nz)
+{
+	if(codec == wire_codec::estimate)
+		return v.size()*sizeof(float);
+
+	// the buffer is reused; messages may be charged by several threads
+	static thread_local byte_buffer buf;
+	buf.clear();
+	encode_vector(codec, v, buf, nz);
+	return buf.size();
+}
+
+
+size_t gm::encoded_size(wire_codec codec, size_t dim, std::vector<std::pair<size_t,double>>& elems)
+{
+	if(codec == wire_codec::estimate)
+		return dim*sizeof(float);
+
+	static thread_local byte_buffer buf;
+	buf.clear();
+	encode_elements(codec, dim, elems, buf);
+	return buf.size();
+}
@@ -0,0 +1,98 @@
+#ifndef __CODEC_HH__
+#define __CODEC_HH__
+
+/**
+	\file Wire encodings of protocol messages.
+
+	The simulation passes messages by reference, and charges each message
+	by its \c byte_size(). By default, state vectors and safe zones are
+	charged by an estimate, proportional to their length. The codecs of
+	this file produce the actual bytes of a message, so that the charge
+	is the true encoded size.
+
+	All encodings start with the dimension of the vector, as a varint.
+	Multi-byte numbers are little-endian.
+  */
+
+#include <cstdint>
+#include <vector>
+#include <utility>
+
+#include "hdv.hh"
+
+namespace gm {
+
+using hdv::Vec;
+
+
+/**
+	The wire encodings of vectors
+  */
+enum class wire_codec
+{
+	estimate,	// no encoding, charge 4 bytes per element (the default)
+	dense,		// all elements, as floats
+	sparse,		// the count of non-zero elements, then (uint32 index, float value) pairs
+	varint,		// as sparse, but each index is a varint of the gap from the previous one
+	float16		// as varint, but the values are half-precision floats (lossy)
+};
+
+
+/// A buffer of encoded bytes
+typedef std::vector<uint8_t> byte_buffer;
+
+
+/// Append an unsigned LEB128 varint to \c out
+void put_varint(byte_buffer& out, uint64_t x);
+
+/// Read an unsigned LEB128 varint and advance \c in past it
+uint64_t get_varint(const uint8_t*& in);
+
+/// Convert to IEEE 754 half precision, rounding to nearest even
+uint16_t float_to_half(float x);
+
+/// Convert from IEEE 754 half precision
+float half_to_float(uint16_t h);
+
+
+/**
+	Append the encoding of a vector of dimension \c dim to \c out.
+	The vector is given by its elements \c elems, as (index, value) pairs,
+	in any order and without repeated indices. Elements not given are zero,
+	and given elements may also be zero.
+
+	The \c estimate codec produces no bytes, and throws \c std::invalid_argument.
+  */
+void encode_elements(wire_codec codec, size_t dim,
+	std::vector<std::pair<size_t,double>>& elems, byte_buffer& out);
+
+/**
+	Append the encoding of \c v to \c out. If \c nz is not null, it lists
+	all indices where \c v may be non-zero, and the encoding takes time
+	proportional to its length (except for the dense codec).
+  */
+void encode_vector(wire_codec codec, const Vec& v, byte_buffer& out,
+	const std::vector<size_t>* nz = nullptr);
+
+/**
+	Decode a vector encoded by \c codec at \c in into \c v, and return the
+	number of bytes read. The float codecs round the values.
+  */
+size_t decode_vector(wire_codec codec, const uint8_t* in, Vec& v);
+
+/**
+	The number of bytes of the encoding of \c v (see \c encode_vector).
+	For the \c estimate codec, this is 4 bytes per element.
+  */
+size_t encoded_size(wire_codec codec, const Vec& v, const std::vector<size_t>* nz = nullptr);
+
+/**
+	The number of bytes of the encoding of the vector given by its elements
+	(see \c encode_elements). The elements may be reordered.
+  */
+size_t encoded_size(wire_codec codec, size_t dim, std::vector<std::pair<size_t,double>>& elems);
+
+
+} // end namespace gm
+
+#endif
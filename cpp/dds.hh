@@ -12,6 +12,7 @@
 #include <array>
 #include <cassert>
 #include <typeinfo>
+#include <functional>
 
 namespace dds {
 
@@ -373,6 +374,19 @@ public:
 } // end namespace dds
 
 
+namespace std {
+
+template <>
+struct hash<dds::local_stream_id>
+{
+	inline size_t operator()(dds::local_stream_id lsid) const {
+		return (size_t(uint16_t(lsid.sid)) << 16) | uint16_t(lsid.hid);
+	}
+};
+
+}
+
+
 
 
 
@@ -83,7 +83,7 @@ from _dds import data_source_statistics, selfjoin_exact_method,\
 # results.hh
 
 from _dds import local_stream_stats, network_comm_results, \
-	network_host_traffic, network_interfaces
+	network_host_traffic, network_level_traffic, network_interfaces
 
 # safezone.hh
 
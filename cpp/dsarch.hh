@@ -14,6 +14,7 @@
 #include <vector>
 #include <typeinfo>
 #include <typeindex>
+#include <type_traits>
 #include <stdexcept>
 #include <algorithm>
 #include <map>
@@ -854,6 +855,190 @@ struct star_network : public basic_network
 };
 
 
+/**
+	A tree network topology.
+
+	The sites are the leaves of a tree, whose root is the hub. Between 
+	them there are one or more levels of aggregators. The hub and each
+	aggregator have at most \c fanout children. The children of an 
+	aggregator are either all sites or all aggregators, and the children
+	of the hub are aggregators. The sites are assigned to the aggregators
+	in contiguous groups of (almost) equal size, in the order of their 
+	source ids, and the same holds for the aggregators of each level.
+
+	The hub is at level 0 and the sites are at level \c depth()-1.
+
+	This class is a mixin, used like \c star_network. A concrete class
+	\c mynetwork is defined as 
+	\code[c++]
+     class mynetwork 
+       : public tree_network<mynetwork, myhub, myaggregator, mysite>,
+       public reactive
+     { ... };
+	\endcode
+	Aggregators are constructed as \c Aggr(net,args...) and receive the 
+	next free addresses.
+
+	@tparam Net  the concrete network class composed by this mixin
+	@tparam Hub  the node type for the hub node (aka. coordinator)
+	@tparam Aggr the node type for aggregators
+	@tparam Site the node type for local sites
+  */
+template <typename Net, typename Hub, typename Aggr, typename Site>
+struct tree_network : public basic_network
+{
+	typedef Net network_type;
+	typedef Hub hub_type;
+	typedef Aggr aggregator_type;
+	typedef Site site_type;
+
+	set<source_id> hids;
+	size_t fanout;
+	Hub* hub;
+	vector<Aggr*> aggregators;
+	vector<Site*> sites;
+
+	tree_network(const set<source_id>& _hids, size_t _fanout) 
+	: hids(_hids), fanout(_fanout), hub(nullptr) 
+	{ 
+		if(fanout < 2)
+			throw std::invalid_argument("The fanout of a tree network must be at least 2");
+
+		// reserve the source_id addresses for the sites
+		if(! hids.empty()) {
+			reserve_addresses(* hids.rbegin());
+		}
+	}
+
+	inline site_type* source_site(source_id hid) const {
+		return static_cast<site_type*>(by_addr(hid));
+	}
+
+	/// The parent of a site or an aggregator
+	inline process* parent(const host* h) const { return links.at(h).parent; }
+
+	/// The children of the hub or an aggregator, which are aggregators
+	inline const vector<Aggr*>& child_aggregators(const host* h) const { return links.at(h).aggrs; }
+
+	/// The children of an aggregator, which are sites
+	inline const vector<Site*>& child_sites(const host* h) const { return links.at(h).sites; }
+
+	/// The number of sites in the subtree of a host
+	inline size_t leaves(const host* h) const { return links.at(h).leaves; }
+
+	/// The level of a host
+	inline size_t level(const host* h) const { return links.at(h).level; }
+
+	/// The number of levels
+	inline size_t depth() const { return levels.size(); }
+
+	/// The hosts of each level
+	inline const vector<host_set>& level_hosts() const { return levels; }
+
+	template <typename ... Args>
+	Net* setup(Args...args)
+	{
+		// create the nodes
+		hub = new Hub((Net*)this, args...);
+
+		for(auto hid : hids) 
+		{
+			Site* n = new Site((Net*)this, hid, args...);
+			n->set_addr(hid);
+			sites.push_back(n);
+			links[n].leaves = 1;
+		}
+
+		// the aggregator levels, bottom-up
+		vector<vector<Aggr*>> tiers;
+		auto make_tier = [&](auto& below, auto member) {
+			const size_t n = below.size();
+			const size_t m = std::max<size_t>(1, (n+fanout-1)/fanout);
+			vector<Aggr*> tier;
+			for(size_t i=0; i<m; i++) {
+				Aggr* a = new Aggr((Net*)this, args...);
+				aggregators.push_back(a);
+				tier.push_back(a);
+				auto& al = links[a];
+				for(size_t j=(n*i)/m; j<(n*(i+1))/m; j++) {
+					(al.*member).push_back(below[j]);
+					links[below[j]].parent = a;
+					al.leaves += links[below[j]].leaves;
+				}
+			}
+			tiers.push_back(tier);
+		};
+		make_tier(sites, &tree_links::sites);
+		while(tiers.back().size() > fanout)
+			make_tier(tiers.back(), &tree_links::aggrs);
+
+		auto& hl = links[hub];
+		for(auto a : tiers.back()) {
+			hl.aggrs.push_back(a);
+			links[a].parent = hub;
+			hl.leaves += links[a].leaves;
+		}
+
+		// number the levels
+		levels.assign(tiers.size()+2, host_set());
+		levels[0].insert(hub);
+		for(size_t t=0; t<tiers.size(); t++) {
+			const size_t l = tiers.size()-t;
+			for(auto a : tiers[t]) {
+				levels[l].insert(a);
+				links[a].level = l;
+			}
+		}
+		for(auto n : sites) {
+			levels.back().insert(n);
+			links[n].level = levels.size()-1;
+		}
+
+		// make the connections
+		hub->setup_connections();
+		for(auto a : aggregators) {
+			a->setup_connections();
+		}
+		for(auto n : sites) {
+			n->setup_connections();
+		}
+
+		return (Net*)this;
+	}
+
+	~tree_network() 
+	{
+		// Delete the nodes that we created...
+		for(auto n : sites) {
+			n->finalize();
+		}
+		for(auto a : aggregators) {
+			a->finalize();
+		}
+		if(hub) hub->finalize();
+
+		for(auto n : sites) {
+			delete n;
+		}
+		for(auto a : aggregators) {
+			delete a;
+		}
+		delete hub;
+	}
+
+private:
+	struct tree_links {
+		process* parent = nullptr;
+		vector<Aggr*> aggrs;
+		vector<Site*> sites;
+		size_t leaves = 0;
+		size_t level = 0;
+	};
+	std::unordered_map<const host*, tree_links> links;
+	vector<host_set> levels;
+};
+
+
 /*	----------------------------------------
 
 	Typed RPC for protocols
@@ -1134,14 +1319,18 @@ struct remote_method<Dest, void, Args...> : proxy_method<Dest>
 };
 
 
-template <typename T, typename Response, typename...Args>
+/*
+	The method may be inherited by T, from a base class
+  */
+template <typename T, typename Base, typename Response, typename...Args>
 inline remote_method<T, Response, Args...> 
 make_remote_method(
 	remote_proxy<T>* owner, 
-	Response (T::*method)(Args...), 
+	Response (Base::*method)(Args...), 
 	const string& _name
 	)
 {
+	static_assert(std::is_base_of<Base, T>::value, "Remote method of an unrelated class");
 	return remote_method<T, Response, Args...>(owner, method, _name);
 }
 
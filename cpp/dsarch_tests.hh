@@ -202,6 +202,40 @@ void Peer::change_key(int newkey)
 
 
 
+/****************************************
+	A tree network
+*****************************************/
+
+struct TreeNet;
+
+struct TreeHub : process
+{
+	TreeHub(TreeNet* nw);
+};
+
+struct TreeAggr : process
+{
+	TreeAggr(TreeNet* nw);
+};
+
+struct TreeSite : local_site
+{
+	TreeSite(TreeNet* nw, source_id hid);
+};
+
+struct TreeNet : tree_network<TreeNet, TreeHub, TreeAggr, TreeSite>
+{
+	TreeNet(const set<source_id>& hids, size_t fanout) 
+	: tree_network(hids, fanout) 
+	{ setup(); }
+};
+
+TreeHub::TreeHub(TreeNet* nw) : process(nw) {}
+TreeAggr::TreeAggr(TreeNet* nw) : process(nw) {}
+TreeSite::TreeSite(TreeNet* nw, source_id hid) : local_site(nw, hid) {}
+
+
+
 //
 //  Test suite
 //
@@ -370,6 +404,54 @@ public:
 	}
 
 
+	void test_tree_network()
+	{
+		TS_ASSERT_THROWS(TreeNet({1,2,3}, 1), std::invalid_argument);
+
+		set<source_id> hids;
+		for(source_id i=1; i<=10; i++) hids.insert(i);
+		TreeNet nw(hids, 3);
+
+		// 10 sites, 4 aggregators over them, 2 above them, and the hub
+		TS_ASSERT_EQUALS(nw.sites.size(), 10);
+		TS_ASSERT_EQUALS(nw.aggregators.size(), 6);
+		TS_ASSERT_EQUALS(nw.depth(), 4);
+		TS_ASSERT_EQUALS(nw.level_hosts()[0].size(), 1);
+		TS_ASSERT_EQUALS(nw.level_hosts()[1].size(), 2);
+		TS_ASSERT_EQUALS(nw.level_hosts()[2].size(), 4);
+		TS_ASSERT_EQUALS(nw.level_hosts()[3].size(), 10);
+
+		TS_ASSERT_EQUALS(nw.level(nw.hub), 0);
+		TS_ASSERT_EQUALS(nw.leaves(nw.hub), 10);
+		TS_ASSERT_EQUALS(nw.child_aggregators(nw.hub).size(), 2);
+
+		size_t leaves = 0;
+		for(auto a : nw.child_aggregators(nw.hub)) {
+			TS_ASSERT_EQUALS(nw.parent(a), nw.hub);
+			TS_ASSERT_EQUALS(nw.child_aggregators(a).size(), 2);
+			TS_ASSERT(nw.child_sites(a).empty());
+			leaves += nw.leaves(a);
+		}
+		TS_ASSERT_EQUALS(leaves, 10);
+
+		// the sites are split contiguously
+		for(auto s : nw.sites) {
+			TS_ASSERT_EQUALS(nw.level(s), 3);
+			TreeAggr* a = static_cast<TreeAggr*>(nw.parent(s));
+			auto& sibs = nw.child_sites(a);
+			TS_ASSERT(sibs.size()==2 || sibs.size()==3);
+			TS_ASSERT(std::find(sibs.begin(), sibs.end(), s) != sibs.end());
+			TS_ASSERT_EQUALS(sibs.back()->site_id() - sibs.front()->site_id(), sibs.size()-1);
+		}
+		TS_ASSERT_EQUALS(nw.source_site(7)->site_id(), 7);
+
+		// a small tree still has an aggregator
+		TreeNet small({1,2}, 4);
+		TS_ASSERT_EQUALS(small.aggregators.size(), 1);
+		TS_ASSERT_EQUALS(small.depth(), 3);
+	}
+
+
 
 };
 
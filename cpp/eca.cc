@@ -11,35 +11,42 @@ using namespace dds;
 //using namespace std::literals;
 
 
+action_seq& basic_control::event_rules(Event evt)
+{
+	assert(evt >= 0);
+	if((size_t)evt >= rules.size())
+		rules.resize(evt+1);
+	return rules[evt];
+}
+
+
 void basic_control::cancel_rule(eca_rule rule)
 {
 	// Rule cancelation is complicated by the fact
 	// that we need to delete the action
-	// BUT!!! The action may be already in the
-	// action queue, or worse, may be the current
+	// BUT!!! The action may be pending in the
+	// current dispatch, or worse, may be the current
 	// action!!!
-	action_seq& aseq = rules[rule.first];
-	action_seq::iterator i = rule.second;
+	action_seq& aseq = event_rules(rule.first);
+	auto i = std::find(aseq.begin(), aseq.end(), rule.second);
+	assert(i != aseq.end());
 
-	if( (*i) == current_action) {
-		// if (*i) is the current action, we
-		// cannot remove it!
+	if(rule.second == current_action) {
+		// if it is the current action, we
+		// cannot delete it!
 		assert(! purge_current);
 		purge_current = true;
 	} else {
-		purge_action(*i);
+		delete rule.second;
 	}
 
-	aseq.erase(i);
-}
-
-void basic_control::purge_action(action* a)
-{
-	// remove from the action queue ( O(n) time ...)
-	auto pos = remove(action_queue.begin(), action_queue.end(), a);
-	auto num_instances = distance(pos, action_queue.end());
-	action_queue.resize(action_queue.size()-num_instances);
-	delete a;
+	if(dispatching && dispatch_evt == rule.first) {
+		// leave a tombstone, so that the positions of 
+		// the pending rules do not change
+		*i = nullptr;
+		tombstones++;
+	} else
+		aseq.erase(i);
 }
 
 
@@ -94,7 +101,7 @@ void basic_control::run_action(action* a)
 	current_action = a;
 	a->run();
 	if(purge_current) {
-		purge_action(current_action);
+		delete current_action;
 		purge_current = false;
 	}
 	current_action = nullptr;
@@ -145,8 +152,23 @@ void basic_control::dispatch_event(Event evt)
 			break;
 	}
 
-	auto aseq = rules[evt];
-	std::copy(aseq.begin(), aseq.end(), back_inserter(action_queue));
+	// Run the rules in place; rules added from now on run
+	// at the next dispatch
+	dispatching = true;
+	dispatch_evt = evt;
+	next_rule = 0;
+	end_rule = event_rules(evt).size();
+}
+
+
+void basic_control::end_dispatch()
+{
+	if(tombstones) {
+		action_seq& aseq = rules[dispatch_evt];
+		aseq.erase(std::remove(aseq.begin(), aseq.end(), nullptr), aseq.end());
+		tombstones = 0;
+	}
+	dispatching = false;
 }
 
 
@@ -154,11 +176,14 @@ void basic_control::run()
 {
 	while(true) {
 
-		if(!action_queue.empty()) {
+		if(dispatching) {
 
-			action* a = action_queue.front();
-			action_queue.pop_front();
-			run_action(a);
+			if(next_rule < end_rule) {
+				// cancelled rules are skipped
+				action* a = rules[dispatch_evt][next_rule++];
+				if(a) run_action(a);
+			} else
+				end_dispatch();
 
 		} else if(! event_queue.empty()) {
 
@@ -181,7 +206,7 @@ void basic_control::initialize()
 {
 	data_feed(nullptr);
 	event_queue.clear();
-	action_queue.clear();
+	if(dispatching) end_dispatch();
 	current_action = nullptr;
 	purge_current = false;
 
@@ -6,6 +6,7 @@
 #include <unordered_map>
 #include <deque>
 #include <list>
+#include <vector>
 
 #include "dds.hh"
 #include "data_source.hh"
@@ -53,10 +54,9 @@ struct action
 	virtual ~action() { }
 };
 
-using action_queue_t = std::deque<action*>;
-using action_seq = std::list<action*>;
-using eca_rule = std::pair<Event,action_seq::iterator>;
-using eca_map = std::unordered_map<Event, action_seq>;
+using action_seq = std::vector<action*>;
+using eca_rule = std::pair<Event,action*>;
+using eca_map = std::vector<action_seq>;
 
 /**
 	Typed wrapper for Actions
@@ -202,6 +202,12 @@ struct level_changed
 	This is achieved by capturing the special __EMPTY
 	event.
 
+	The rules of each event are kept in a vector, indexed by the event id.
+	An event is dispatched by running its rules in place, in the order 
+	they were added. Rules added during the dispatch of an event do not 
+	run until the next dispatch. Rules cancelled during the dispatch of 
+	their event are replaced by null tombstones, which are skipped and 
+	then removed when the dispatch ends.
  */
 struct basic_control
 {
@@ -210,13 +216,20 @@ protected:
 	// State for ECA callbacks
 
 	event_queue_t event_queue; // the emitted but not dispatched events
-	action_queue_t action_queue; // the dispatched actions
-	eca_map rules;  // the rules
+	eca_map rules;  // the rules, indexed by event id
 	action* current_action;  // the current action, or null
 	bool purge_current = false; // denote that the current action 
 							// is to be purged asap (or null)
 
-	void purge_action(action* a);
+	// The event being dispatched, if any. The rules in 
+	// [next_rule, end_rule) have not run yet.
+	bool dispatching = false;
+	Event dispatch_evt;
+	size_t next_rule = 0, end_rule = 0;
+	size_t tombstones = 0;	// the cancelled rules of dispatch_evt
+
+	// the rules of an event
+	action_seq& event_rules(Event evt);
 
 
 	// current time
@@ -228,6 +241,7 @@ protected:
 	// internal methods
 	void run_action(action*);
 	void dispatch_event(Event);
+	void end_dispatch();
 	void empty_handler();
 	void advance();
 	void proceed();
@@ -262,6 +276,9 @@ public:
 		return ds->metadata();
 	}
 
+	/// True if a data source has been added to the controller
+	inline bool has_data_feed() const { return ds != nullptr; }
+
 	/**
 		Add data source to the controller
 	  */
@@ -288,9 +305,8 @@ public:
 		ownership.
 	 */
 	inline eca_rule add_rule(Event evt, action* _action) {
-		action_seq& aseq = rules[evt];
-		action_seq::iterator i = aseq.insert(aseq.end(), _action);
-		return std::make_pair(evt, i);
+		event_rules(evt).push_back(_action);
+		return std::make_pair(evt, _action);
 	}
 
 	/**
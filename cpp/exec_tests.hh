@@ -23,7 +23,33 @@ public:
 		x=0;
 		CTX.run();
 
-		TS_ASSERT_EQUALS(x,0);		
+		TS_ASSERT_EQUALS(x,0);
+	}
+
+	// Rules added or cancelled while their event is dispatched
+	void test_cancel_during_dispatch()
+	{
+		std::string trace;
+		eca_rule b, c, d;
+
+		auto a = ON(INIT, [&]() {
+			trace += "a";
+			CTX.cancel_rule(b);
+			d = ON(INIT, [&]() { trace += "d"; });
+		});
+		b = ON(INIT, [&]() { trace += "b"; });
+		c = ON(INIT, [&]() { trace += "c"; CTX.cancel_rule(c); });
+
+		CTX.initialize();
+		CTX.run();
+		TS_ASSERT_EQUALS(trace, "ac");
+
+		// the first run added d
+		CTX.cancel_rule(a);
+		CTX.initialize();
+		CTX.run();
+		TS_ASSERT_EQUALS(trace, "acd");
+		CTX.cancel_rule(d);
 	}
 
 };
@@ -24,25 +24,28 @@ oneway node::reset(const safezone& newsz)
 	szone = newsz;
 
 	// reset the drift vector
-	U = 0.0;
+	U.clear();
 	update_count = 0;
-	zeta = minzeta = szone(U);
+	zeta = minzeta = szone.zero(U);
+	lazy.reset(zeta);
 
 	// reset for the first subround		
 	reset_bitweight(zeta/2.0);
 
 	// reset round statistics
-	dS = 0.0;
+	dS.clear();
 	round_local_updates = 0;
 }
 
 int node::set_safezone(const safezone& newsz) 
 {
 	// reset the safezone object
+	sync_zeta();
 	szone = newsz;
 	double newzeta = szone(U);
 	assert(newzeta >= zeta);
 	zeta = newzeta;
+	lazy.reset(zeta);
 
 	// reset the bit count
 	int delta_bitweight = floor((zeta_0-zeta)/zeta_quantum) - bitweight;
@@ -53,29 +56,34 @@ int node::set_safezone(const safezone& newsz)
 	
 float node::get_zeta() 
 {
+	sync_zeta();
 	return zeta;
 }
 
 oneway node::reset_bitweight(float Z)
 {
+	sync_zeta();
 	minzeta = zeta_0 = zeta;
 	zeta_quantum = Z;
 	bitweight = 0;
 }
 
-compressed_state_ref node::get_drift() 
+drift_state_ref node::get_drift() 
 {
+	sync_zeta();
 	size_t upd = update_count;
 	update_count = 0;
-	return compressed_state_ref { U, upd };
+	return drift_state_ref { U, upd, Q->config.codec };
 }
 
 double node::set_drift(compressed_state_ref newU) 
 {
+	sync_zeta();
 	U = newU.vec;
 	// we should not touch this: update_count = newU.updates;
 	double old_zeta = zeta;
 	zeta = szone(U);
+	lazy.reset(zeta);
 	return zeta-old_zeta;
 }
 
@@ -83,26 +91,86 @@ double node::set_drift(compressed_state_ref newU)
 void node::update_stream() 
 {
 	assert(CTX.stream_record().hid == site_id());
+	if(update_local(CTX.stream_record()))
+		notify_coordinator();
+}
 
-	delta_vector delta = Q->delta_update(dS, CTX.stream_record());
 
+bool node::update_local(const dds_record& rec)
+{
 	// oops, not an update
-	if(delta.size()==0) return;
+	if(! Q->delta_update(delta, dS.values(), rec)) return false;
+	undo.save(dS, delta.index, delta.xold);
+	dS.touch(delta.index);
 
+	undo.save(U, delta.index);
 	delta.apply_delta(U);
 
 	update_count++;
 	round_local_updates++;
 
-	zeta = szone(delta, U);
+	zeta = lazy.update(zeta, delta, 1.0,
+		[&](double z) { return (int)floor((zeta_0-std::min(minzeta, z))/zeta_quantum) <= bitweight; },
+		[&]() { return szone(U); },
+		[&]() { return szone(delta, U); });
 	if(zeta<minzeta) minzeta = zeta;
 
 	int bwnew = floor((zeta_0-minzeta)/zeta_quantum);
 	int dbw = bwnew - bitweight;
 	if(dbw>0) {
 		bitweight = bwnew;
-		coord.threshold_crossed(this, dbw);
+		pending_dbw = dbw;
+		return true;
 	}
+	return false;
+}
+
+
+void node::notify_coordinator()
+{
+	coord.threshold_crossed(this, pending_dbw);
+}
+
+
+void node::checkpoint()
+{
+	saved.minzeta = minzeta;
+	saved.zeta = zeta;
+	saved.bitweight = bitweight;
+	saved.update_count = update_count;
+	saved.round_local_updates = round_local_updates;
+	saved.lazy = lazy;
+	szone.save_state(saved.szone);
+	undo.start();
+}
+
+
+void node::commit()
+{
+	undo.commit();
+	szone.commit_state(saved.szone);
+	saved.szone = safezone();
+}
+
+
+void node::rollback()
+{
+	undo.rollback();
+	minzeta = saved.minzeta;
+	zeta = saved.zeta;
+	bitweight = saved.bitweight;
+	update_count = saved.update_count;
+	round_local_updates = saved.round_local_updates;
+	lazy = saved.lazy;
+	szone.restore_state(saved.szone);
+	saved.szone = safezone();
+}
+
+
+void node::sync_zeta()
+{
+	zeta = lazy.sync(zeta, [&]() { return szone(U); });
+	if(zeta<minzeta) minzeta = zeta;
 }
 
 
@@ -140,8 +208,10 @@ Vec node::get_projection(size_t m)
 
 double node::set_projection(Vec mu)
 {
+	sync_zeta();
 	const size_t m = mu.size();
 	Vec PU = get_projection(m);
+	auto& Uall = U.touch_all();
 
 	//  U.size() = k*m+r
 	const size_t r = U.size() % m;  
@@ -153,7 +223,7 @@ double node::set_projection(Vec mu)
 		const double delta = mu[i] - PU[i];
 
 		for(size_t j=p; j<p+ni; j++)
-			U[j] += delta;
+			Uall[j] += delta;
 
 		p += ni;
 	}
@@ -161,6 +231,7 @@ double node::set_projection(Vec mu)
 
 	double old_zeta = zeta;
 	zeta = szone(U);
+	lazy.reset(zeta);
 	return zeta-old_zeta;	
 }
 
@@ -183,16 +254,19 @@ Vec node::get_random_projection(size_t m, size_t a, size_t b)
 
 double node::set_random_projection(Vec mu, size_t a, size_t b)
 {
+	sync_zeta();
 	const size_t m = mu.size();
 	Vec dPU = mu - get_random_projection(m, a, b);
+	auto& Uall = U.touch_all();
 
 	for(size_t i=0; i<U.size(); i++) {
 		size_t h = (a*i+b) % m;
-		U[i] += dPU[h];
+		Uall[i] += dPU[h];
 	}
 
 	double old_zeta = zeta;
 	zeta = szone(U);
+	lazy.reset(zeta);
 	return zeta-old_zeta;
 }
 
@@ -209,6 +283,10 @@ double node::set_random_projection(Vec mu, size_t a, size_t b)
 // initialize a new round
 void coordinator::start_round()
 {
+	// discard the cached safe zone data of the previous round
+	safe_zone->begin_round();
+	if(radial_safe_zone) radial_safe_zone->begin_round();
+
 	// compute current parameters from query
 	bitweight.assign(k, 0);
 	total_bitweight.assign(k,0);
@@ -227,10 +305,10 @@ void coordinator::start_round()
 		// based on the above line this is unnecessary
 		if(! has_cheap_safezone[node_index[n]]) {
 			sz_sent++;
-			proxy[n].reset(safezone(safe_zone));
+			proxy[n].reset(safezone(safe_zone, cfg().codec));
 		}
 		else
-			proxy[n].reset(safezone(radial_safe_zone));
+			proxy[n].reset(safezone(radial_safe_zone, cfg().codec));
 	}
 }	
 
@@ -258,7 +336,7 @@ oneway coordinator::threshold_crossed(sender<node_t> ctx, int delta_bits)
 		sz_sent++;
 		round_sz_sent++;
 		delta_bits += 
-			proxy[n].set_safezone( safezone(safe_zone) );
+			proxy[n].set_safezone( safezone(safe_zone, cfg().codec) );
 		has_cheap_safezone[nid] = false;
 	}
 
@@ -325,12 +403,15 @@ void coordinator::finish_subrounds(double total_zeta)
 // initialize a new round
 void coordinator::finish_round()
 {
-	// collect all data
-	Vec newE(0.0, Q->state_vector_size());
-	size_t newE_updates = 0;
+	// collect all data, and add it up in parallel
+	vector<drift_state_ref> drifts;
+	drifts.reserve(k);
 	for(auto n : node_ptr) {
-		fetch_updates(n, newE, newE_updates);
+		drifts.push_back(proxy[n].get_drift());
+		total_updates += drifts.back().updates;
 	}
+	Vec newE(0.0, Q->state_vector_size());
+	add_states(newE, drifts);
 	newE /= (double)k;
 
 	finish_with_newE(newE);
@@ -374,6 +455,7 @@ void coordinator::trace_round(const Vec& newE)
 	for(size_t i=0; i<k; i++) 
 	{
 		auto ni = node_ptr[i];
+		ni->sync_zeta();
 		zeta_total += ni->zeta;
 		minzeta_total += ni->minzeta;
 		minzeta_min = min(minzeta_min, ni->minzeta);
@@ -420,6 +502,7 @@ void coordinator::print_state()
 	for(auto n : node_ptr) {
 		auto nid = node_index[n];
 
+		n->sync_zeta();
 		auto zeta = n->zeta;
 		zeta_t += zeta;
 
@@ -443,8 +526,7 @@ void coordinator::warmup()
 {
 	Vec dE(Q->state_vector_size());
 
-	for(auto&& rec : CTX.warmup) 
-		Q->update(dE, rec);
+	Q->update_all(dE, CTX.warmup);
 
 	query->update_estimate(dE/(double)k);
 }
@@ -483,8 +565,8 @@ coordinator::coordinator(network_t* nw, continuous_query* _Q)
 
 void coordinator::fetch_updates(node_t* n, Vec& S, size_t& upd)
 {
-	compressed_state_ref cs = proxy[n].get_drift();
-	S += cs.vec;
+	drift_state_ref cs = proxy[n].get_drift();
+	cs.add_to(S);
 	upd += cs.updates;	
 	total_updates += cs.updates;
 }
@@ -548,7 +630,7 @@ void coordinator::rebalance_random(double total_zeta)
 				Vec Ubal = newE/ (double)B;
 
 				for(auto node: Bset)
-					node->set_drift(compressed_state_ref {Ubal, newE_updates});
+					node->set_drift(compressed_state_ref {Ubal, newE_updates, cfg().codec});
 
 				return ;				
 			}
@@ -742,20 +824,36 @@ void cost_model::update_model()
 	// reset proper sites
 	proper.assign(k,false);
 
-	// collect the arrays
+	// get gamma, and collect the drifts of the sites with updates
+	vector<size_t> active;
+	vector<const Vec*> dS;
+	active.reserve(k);
+	dS.reserve(k);
 	for(size_t i=0;i<k;i++) {
-		// get gamma
 		gamma[i] = node[i]->round_local_updates;
 		if(gamma[i]==0.0) continue;
+		active.push_back(i);
+		dS.push_back(& node[i]->dS.values());
+	}
+
+	// evaluate both safe zones on all the drifts
+	const size_t na = active.size();
+	vector<double> zeta_radial(na), zeta_full(na);
+	coord->radial_safe_zone->compute_zeta_batch(dS.data(), na, zeta_radial.data());
+	coord->safe_zone->compute_zeta_batch(dS.data(), na, zeta_full.data());
+
+	// collect the arrays
+	for(size_t j=0;j<na;j++) {
+		const size_t i = active[j];
 
 		// Get beta
-		beta[i] = zeta_E - coord->radial_safe_zone->compute_zeta(node[i]->dS);
+		beta[i] = zeta_E - zeta_radial[j];
 		if(beta[i]==0.0) continue;
 		assert(beta[i]>0.0);
 
 		// Get alpha
 		// Note: zeta(n)
-		alpha[i] = zeta_E - coord->safe_zone->compute_zeta(node[i]->dS);
+		alpha[i] = zeta_E - zeta_full[j];
 
 
 		if(alpha[i]<0.0) { beta[i]-=alpha[i]; alpha[i] = 0.0; }
@@ -216,12 +216,26 @@ struct node : local_site
 	double zeta_quantum;	// discretization for bitweight, set by reset_bitweight()
 	int bitweight;			// equal to number of bits sent since last reset_bitweight()
 
-	Vec U;					// drift vector
+	drift_vector U;			// drift vector
 	size_t update_count;	// number of updates in drift vector
 
-	Vec dS;						// the sketch of all updates over a round
+	touched_vector dS;						// the sketch of all updates over a round
+	delta_vector delta;			// the delta of the last stream update (reused)
+	lazy_zeta lazy;				// lazy safe zone evaluation
 	size_t round_local_updates; // number of local stream updates since last reset
 
+	int pending_dbw = 0;		// the bitweight increase to report to the coordinator
+
+	// Speculative execution (see gm_network)
+	undo_log undo;				// the changes to U and dS
+	struct saved_state {
+		double minzeta, zeta;
+		int bitweight;
+		size_t update_count, round_local_updates;
+		lazy_zeta lazy;
+		safezone szone;
+	} saved;
+
 	coord_proxy_t coord;
 
 	node(network_t* net, source_id hid, continuous_query* _Q)
@@ -231,12 +245,27 @@ struct node : local_site
 		coord( this )
 	{ 
 		coord <<= net->hub;
+		lazy.set_mode(Q->config.lazy_zeta);
 	}
 
 	void setup_connections() override;
 
 	void update_stream();
 
+	// process a record locally, return true if the coordinator must be notified
+	bool update_local(const dds_record& rec);
+
+	// notify the coordinator, after update_local() returned true
+	void notify_coordinator();
+
+	// speculative execution
+	void checkpoint();
+	void commit();
+	void rollback();
+
+	// bring zeta up to date, if evaluations were skipped
+	void sync_zeta();
+
 	//
 	// Remote methods
 	//
@@ -254,7 +283,7 @@ struct node : local_site
 	oneway reset_bitweight(float Z);
 
 	// Get the data
-	compressed_state_ref get_drift();
+	drift_state_ref get_drift();
 
 	// This can be used for rebalancing
 	double set_drift(compressed_state_ref newU);
@@ -300,12 +329,6 @@ template <>
 inline size_t byte_size< gm::fgm::node *>
 	(gm::fgm::node * const &) { return 4; }
 
-using hdv::Vec;
-
-template <>
-inline size_t byte_size< Vec >
-	(Vec const & v) { return sizeof(float)* v.size(); }
-
 }
 
 
@@ -15,13 +15,13 @@ using binc::elements_of;
 
 
 /*********************************************
-	node
+	node_base
 *********************************************/
 
-oneway node::reset(const safezone& newsz) 
+oneway node_base::reset(const safezone& newsz) 
 { 
 	// we need not do U=0, but check !
-	assert(norm_L2(U)==0.0);
+	assert(U.is_zero());
 
 	// reset the safezone object
 	szone = newsz;
@@ -30,73 +30,88 @@ oneway node::reset(const safezone& newsz)
 	lambda = 1.0;
 
 	// init safezone inc. code (n.b.  lambda = 1)
-	zeta = minzeta = szone(Uinc);
+	zeta = minzeta = szone.zero(Uinc);
+	lazy.reset(zeta);
 
 	// reset for the first subround
 	reset_bitweight(zeta/2.0);
 
 	// reset round state vector
-	dS = 0.0;
+	dS.clear();
 	round_local_updates = 0;
 }
 	
-float node::get_zeta() 
+float node_base::get_zeta() 
 {
+	sync_zeta();
 	return zeta;
 }
 
 
-oneway node::reset_bitweight(float Z)
+oneway node_base::reset_bitweight(float Z)
 {
+	sync_zeta();
 	minzeta = zeta_0 = zeta;
 	zeta_quantum = Z;
 	bitweight = 0;
 }
 
 
-compressed_state_obj node::flush_drift() 
+compressed_state_obj node_base::flush_drift() 
 {
 	// switch on rebalanced status
-	compressed_state_obj retval { U, update_count };
+	compressed_state_obj retval { U, update_count, Q->config.codec };
 
-	U = 0.0;
-	Uinc = 0.0;
+	U.clear();
+	Uinc.clear();
 	update_count = 0;
-	zeta = lambda*szone(Uinc);
+	zeta = lambda*szone.zero(Uinc);
+	lazy.reset(zeta);
 
 	return retval;
 }
 
 
-double node::reset_lambda(float _lambda) 
+double node_base::reset_lambda(float _lambda) 
 {
 	assert(_lambda > 0.0);
 	lambda = _lambda;
-	Uinc = U / lambda;
+	Uinc.assign_div(U, lambda);
 	zeta = lambda * szone(Uinc);
+	lazy.reset(zeta);
 	return zeta;
 }
 
 
 
-void node::update_stream() 
+void node_base::update_stream() 
 {
-
 	assert(CTX.stream_record().hid == site_id());
+	if(update_local(CTX.stream_record()))
+		notify_coordinator();
+}
 
-	delta_vector delta = Q->delta_update(dS, CTX.stream_record());
 
+bool node_base::update_local(const dds_record& rec)
+{
 	// oops, not an update
-	if(delta.size()==0) return;
+	if(! Q->delta_update(delta, dS.values(), rec)) return false;
+	undo.save(dS, delta.index, delta.xold);
+	dS.touch(delta.index);
 
 	update_count++;
 	round_local_updates++;
 
+	undo.save(U, delta.index);
 	delta.apply_delta(U);
 
 	delta /= lambda;
+	undo.save(Uinc, delta.index);
 	delta.rebase_apply_delta(Uinc);
-	zeta = lambda * szone(delta, Uinc);
+	zeta = lazy.update(zeta, delta, lambda,
+		[&](double z) { return (int)floor((zeta_0-std::min(minzeta, z))/zeta_quantum) <= bitweight; },
+		[&]() { return lambda * szone(Uinc); },
+		[&]() { return lambda * szone(delta, Uinc); });
 
 	if(zeta<minzeta) minzeta = zeta;
 
@@ -104,26 +119,87 @@ void node::update_stream()
 	int dbw = bwnew - bitweight;
 	if(dbw>0) {
 		bitweight = bwnew;
-		coord.threshold_crossed(this, dbw);
+		pending_dbw = dbw;
+		return true;
 	}
+	return false;
 }
 
 
-void node::setup_connections()
+void node_base::checkpoint()
 {
-	num_sites = coord.proc()->k;
+	saved.minzeta = minzeta;
+	saved.zeta = zeta;
+	saved.bitweight = bitweight;
+	saved.update_count = update_count;
+	saved.round_local_updates = round_local_updates;
+	saved.lazy = lazy;
+	szone.save_state(saved.szone);
+	undo.start();
 }
 
 
-node::node(network_t* net, source_id hid, continuous_query* _Q)
+void node_base::commit()
+{
+	undo.commit();
+	szone.commit_state(saved.szone);
+	saved.szone = safezone();
+}
+
+
+void node_base::rollback()
+{
+	undo.rollback();
+	minzeta = saved.minzeta;
+	zeta = saved.zeta;
+	bitweight = saved.bitweight;
+	update_count = saved.update_count;
+	round_local_updates = saved.round_local_updates;
+	lazy = saved.lazy;
+	szone.restore_state(saved.szone);
+	saved.szone = safezone();
+}
+
+
+void node_base::sync_zeta()
+{
+	zeta = lazy.sync(zeta, [&]() { return lambda * szone(Uinc); });
+	if(zeta<minzeta) minzeta = zeta;
+}
+
+
+node_base::node_base(basic_network* net, source_id hid, continuous_query* _Q)
 	: 	local_site(net, hid), 
 		Q(_Q),
 		lambda(1.0),
-		U(0.0, Q->state_vector_size()), 
-		Uinc(0.0, Q->state_vector_size()), 
+		U(Q->state_vector_size()), 
+		Uinc(Q->state_vector_size()), 
 		update_count(0),
 		dS(Q->state_vector_size()), 
-		round_local_updates(0),
+		round_local_updates(0)
+{ 
+	lazy.set_mode(Q->config.lazy_zeta);
+}
+
+
+/*********************************************
+	node
+*********************************************/
+
+void node::notify_coordinator()
+{
+	coord.threshold_crossed(this, pending_dbw);
+}
+
+
+void node::setup_connections()
+{
+	num_sites = coord.proc()->k;
+}
+
+
+node::node(network_t* net, source_id hid, continuous_query* _Q)
+	: 	node_base(net, hid, _Q),
 		coord( this )
 { 
 	coord <<= net->hub;
@@ -138,6 +214,10 @@ node::node(network_t* net, source_id hid, continuous_query* _Q)
 // and the first subround
 void coordinator::start_round()
 {
+	// discard the cached safe zone data of the previous round
+	safe_zone->begin_round();
+	if(radial_safe_zone) radial_safe_zone->begin_round();
+
 	// reset rebalancing
 	B.clear();
 	psi_Ebal = 0.0;
@@ -162,11 +242,11 @@ void coordinator::start_round()
 
 		// send the right safezone to the node
 		if(using_cost_model && !cmodel.d[nid]) 
-			proxy[n].reset(safezone(radial_safe_zone));
+			proxy[n].reset(safezone(radial_safe_zone, cfg().codec));
 		else {
 			sz_sent++;
 			round_sz_sent++;
-			proxy[n].reset(safezone(safe_zone));			
+			proxy[n].reset(safezone(safe_zone, cfg().codec));			
 		}
 	}
 }
@@ -237,12 +317,14 @@ static void print_potential(const string& when, double psi, double psi_Ebal, aut
 
 void coordinator::collect_drift_vectors(double& psi, size_t& upd)
 {
+	vector<compressed_state_obj> drifts;
+	drifts.reserve(k);
 	for(auto n : node_ptr) {
-		compressed_state_obj cs = proxy[n].flush_drift();
-		DeltaEbal += cs.vec;
-		upd += cs.updates;
-		total_updates += cs.updates;
+		drifts.push_back(proxy[n].flush_drift());
+		upd += drifts.back().updates;
+		total_updates += drifts.back().updates;
 	}
+	add_states(DeltaEbal, drifts);
 }
 
 
@@ -296,16 +378,48 @@ bool coordinator::rebalance_zero_balance(double& psi)
 		mu = 0.5*(mumin+mumax);
 		psi_Ebal = mu * query->compute_zeta( DeltaEbal / (mu*k) );
 
+		// Each batch evaluates the midpoints of the next 'levels' levels of 
+		// the bisection tree, in heap order (the children of the midpoint at 
+		// position j are at 2j and 2j+1). The bisection is then replayed on 
+		// the batch, so the result is the same for any number of levels.
+		size_t levels = 1;
+		while(levels<8) {
+			const size_t next_m = (size_t(2)<<levels)-1;
+			if(safe_zone->batch_threads(next_m) < next_m) break;
+			levels++;
+		}
+		const size_t m = (size_t(1)<<levels)-1;
+
+		double lo[m+1], hi[m+1], mid[m+1], zmid[m+1];
+		vector<Vec> Ubatch(m);
+		vector<const Vec*> Uptr(m);
+
 		while(fabs(zmax-zmin)>prec) {
-			mu = 0.5*(mumin+mumax);
-			psi_Ebal = query->compute_zeta( DeltaEbal / (mu*k) );
-
-			if(psi_Ebal>=0) {
-				mumax = mu;
-				zmax = psi_Ebal;
-			} else {
-				mumin = mu;
-				zmin = psi_Ebal;
+			lo[1] = mumin; hi[1] = mumax;
+			for(size_t j=1; j<=m; j++) {
+				mid[j] = 0.5*(lo[j]+hi[j]);
+				if(2*j<=m) {
+					lo[2*j] = lo[j]; hi[2*j] = mid[j];
+					lo[2*j+1] = mid[j]; hi[2*j+1] = hi[j];
+				}
+				Ubatch[j-1] = DeltaEbal / (mid[j]*k);
+				Uptr[j-1] = &Ubatch[j-1];
+			}
+			safe_zone->compute_zeta_batch(Uptr.data(), m, zmid+1);
+
+			for(size_t j=1; j<=m && fabs(zmax-zmin)>prec; ) {
+				mu = mid[j];
+				psi_Ebal = zmid[j];
+
+				if(psi_Ebal>=0) {
+					mumax = mu;
+					zmax = psi_Ebal;
+					j = 2*j;
+				} else {
+					mumin = mu;
+					zmin = psi_Ebal;
+					j = 2*j+1;
+				}
 			}
 		}
 
@@ -423,6 +537,7 @@ void coordinator::trace_round(const Vec& newE)
 	for(size_t i=0; i<k; i++) 
 	{
 		auto ni = node_ptr[i];
+		ni->sync_zeta();
 		zeta_total += ni->zeta;
 		minzeta_total += ni->minzeta;
 		minzeta_min = min(minzeta_min, ni->minzeta);
@@ -475,6 +590,7 @@ void coordinator::print_state()
 	for(auto n : node_ptr) {
 		auto nid = node_index[n];
 
+		n->sync_zeta();
 		auto zeta = n->zeta;
 		zeta_t += zeta;
 
@@ -498,8 +614,7 @@ void coordinator::warmup()
 {
 	Vec dE(Q->state_vector_size());
 
-	for(auto&& rec : CTX.warmup) 
-		Q->update(dE, rec);
+	Q->update_all(dE, CTX.warmup);
 
 	query->update_estimate(dE/(double)k);
 }
@@ -601,20 +716,36 @@ void cost_model::update_model()
 	// reset proper sites
 	proper.assign(k,false);
 
-	// collect the arrays
+	// get gamma, and collect the drifts of the sites with updates
+	vector<size_t> active;
+	vector<const Vec*> dS;
+	active.reserve(k);
+	dS.reserve(k);
 	for(size_t i=0;i<k;i++) {
-		// get gamma
 		gamma[i] = node[i]->round_local_updates;
 		if(gamma[i]==0.0) continue;
+		active.push_back(i);
+		dS.push_back(& node[i]->dS.values());
+	}
+
+	// evaluate both safe zones on all the drifts
+	const size_t na = active.size();
+	vector<double> zeta_radial(na), zeta_full(na);
+	coord->radial_safe_zone->compute_zeta_batch(dS.data(), na, zeta_radial.data());
+	coord->safe_zone->compute_zeta_batch(dS.data(), na, zeta_full.data());
+
+	// collect the arrays
+	for(size_t j=0;j<na;j++) {
+		const size_t i = active[j];
 
 		// Get beta
-		beta[i] = zeta_E - coord->radial_safe_zone->compute_zeta(node[i]->dS);
+		beta[i] = zeta_E - zeta_radial[j];
 		if(beta[i]==0.0) continue;
 		assert(beta[i]>0.0);
 
 		// Get alpha
 		// Note: zeta(n)
-		alpha[i] = zeta_E - coord->safe_zone->compute_zeta(node[i]->dS);
+		alpha[i] = zeta_E - zeta_full[j];
 
 
 		if(alpha[i]<0.0) { beta[i]-=alpha[i]; alpha[i] = 0.0; }
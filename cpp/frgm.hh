@@ -1,5 +1,5 @@
-#ifndef __FGM_HH__
-#define __FGM_HH__
+#ifndef __FRGM_HH__
+#define __FRGM_HH__
 
 #include <iostream>
 #include <unordered_map>
@@ -227,21 +227,17 @@ struct coord_proxy : remote_proxy< coordinator >
 
 
 /**
-	The FRGM node
+	The state and the local processing of an FRGM site.
+
+	This is shared by the FRGM node and the TGM node (see tgm.hh), which
+	differ only in the process that they report threshold crossings to.
+	The remote methods are called through the proxy of the derived class.
   */
-struct node : local_site
+struct node_base : local_site
 {
-	typedef coordinator coordinator_t;
-	typedef node node_t;
-	typedef node_proxy node_proxy_t;
-	typedef network network_t;
-	typedef coord_proxy coord_proxy_t;
-
 	continuous_query* Q;	// the query management object
 	safezone szone;			// safezone object
 
-	int num_sites;			// number of sites
-
 	double minzeta; 		// minimum value of zeta so far
 	double zeta;			// current zeta 
 
@@ -251,23 +247,47 @@ struct node : local_site
 
 	double lambda;			// the current lambda scaling factor for U.
 
-	Vec U;					// drift vector
-	Vec Uinc;				// This vector maintains the value needed for incremental computation.
+	drift_vector U;			// drift vector
+	drift_vector Uinc;		// This vector maintains the value needed for incremental computation.
 							// It is equal to U/lambda
 
 	size_t update_count;	// number of updates in drift vector
 
-	Vec dS;						// the vector of all updates over a round
+	touched_vector dS;			// the vector of all updates over a round
+	delta_vector delta;			// the delta of the last stream update (reused)
+	lazy_zeta lazy;				// lazy safe zone evaluation
 	size_t round_local_updates; // number of local stream updates since last reset
 
-	coord_proxy_t coord;
+	int pending_dbw = 0;		// the bitweight increase to report to the coordinator
 
-	node(network_t* net, source_id hid, continuous_query* _Q);
+	// Speculative execution (see gm_network)
+	undo_log undo;				// the changes to U, Uinc and dS
+	struct saved_state {
+		double minzeta, zeta;
+		int bitweight;
+		size_t update_count, round_local_updates;
+		lazy_zeta lazy;
+		safezone szone;
+	} saved;
 
-	void setup_connections() override;
+	node_base(basic_network* net, source_id hid, continuous_query* _Q);
 
 	void update_stream();
 
+	// process a record locally, return true if the coordinator must be notified
+	bool update_local(const dds_record& rec);
+
+	// notify the coordinator of pending_dbw, after update_local() returned true
+	virtual void notify_coordinator() = 0;
+
+	// speculative execution
+	void checkpoint();
+	void commit();
+	void rollback();
+
+	// bring zeta up to date, if evaluations were skipped
+	void sync_zeta();
+
 	//-----------------------------------
 	// Remote methods
 	//-----------------------------------
@@ -290,6 +310,29 @@ struct node : local_site
 };
 
 
+/**
+	The FRGM node
+  */
+struct node : node_base
+{
+	typedef coordinator coordinator_t;
+	typedef node node_t;
+	typedef node_proxy node_proxy_t;
+	typedef network network_t;
+	typedef coord_proxy coord_proxy_t;
+
+	int num_sites;			// number of sites
+
+	coord_proxy_t coord;
+
+	node(network_t* net, source_id hid, continuous_query* _Q);
+
+	void setup_connections() override;
+
+	void notify_coordinator() override;
+};
+
+
 struct node_proxy : remote_proxy< node >
 {
 	typedef node node_t;
@@ -314,12 +357,6 @@ template <>
 inline size_t byte_size< gm::frgm::node *>
 	(gm::frgm::node * const &) { return 4; }
 
-using hdv::Vec;
-
-template <>
-inline size_t byte_size< Vec >
-	(Vec const & v) { return sizeof(float)* v.size(); }
-
 }
 
 
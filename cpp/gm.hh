@@ -48,6 +48,11 @@ namespace frgm {
 	extern p_component_type<network> frgm_comptype;
 }
 
+namespace tgm {
+	struct network;
+	extern p_component_type<network> tgm_comptype;
+}
+
 
 } // end namespace gm
 
@@ -12,12 +12,12 @@ using namespace dds;
 //////////////////////////////////////
 
 safezone::safezone() 
-: szone(nullptr), inc(nullptr)
+: szone(nullptr), inc(nullptr), codec(wire_codec::estimate)
 { }
 
 // valid safezone
-safezone::safezone(safezone_func* sz)
-: szone(sz), inc(nullptr)
+safezone::safezone(safezone_func* sz, wire_codec _codec)
+: szone(sz), inc(nullptr), codec(_codec)
 {
 	assert(sz != nullptr);
 }
@@ -29,6 +29,7 @@ safezone::~safezone()
 
 // Movable
 safezone::safezone(safezone&& other)
+: szone(nullptr), inc(nullptr), codec(wire_codec::estimate)
 {
 	swap(other);
 }
@@ -41,7 +42,7 @@ safezone& safezone::operator=(safezone&& other)
 
 // Copyable
 safezone::safezone(const safezone& other) 
-	: inc(nullptr)
+	: inc(nullptr), codec(other.codec)
 {
 	szone = other.szone;
 }
@@ -52,9 +53,65 @@ safezone& safezone::operator=(const safezone& other)
 		clear_inc();
 		szone = other.szone;
 	}
+	codec = other.codec;
 	return *this;
 }
 
+size_t safezone::byte_size() const
+{
+	if(szone == nullptr) return 0;
+	if(codec == wire_codec::estimate)
+		return szone->zeta_size() * sizeof(float);
+
+	static thread_local byte_buffer buf;
+	buf.clear();
+	szone->encode(codec, buf);
+	return buf.size();
+}
+
+void safezone::save_state(safezone& chk)
+{
+	chk = *this;
+	if(szone != nullptr)
+		szone->checkpoint_incstate(chk.get_inc(), get_inc());
+}
+
+void safezone::restore_state(safezone& chk)
+{
+	assert(szone == chk.szone);
+	if(szone != nullptr)
+		szone->rollback_incstate(get_inc(), chk.get_inc());
+}
+
+void safezone::commit_state(safezone& chk)
+{
+	assert(szone == chk.szone);
+	if(szone != nullptr)
+		szone->commit_incstate(get_inc(), chk.get_inc());
+}
+
+
+//////////////////////////////////////
+//
+// Undo log
+//
+//////////////////////////////////////
+
+void undo_log::rollback()
+{
+	// the logs are of different vectors, so their order does not matter
+	wide.rollback();
+	narrow.rollback();
+	commit();
+}
+
+void undo_log::commit()
+{
+	wide.clear();
+	narrow.clear();
+	recording = false;
+}
+
 
 //////////////////////////////////////
 //
@@ -67,6 +124,10 @@ safezone& safezone::operator=(const safezone& other)
 
 continuous_query* gm::create_continuous_query(const Json::Value& js)
 {
+	// several queries over shared sketches
+	if(js.isMember("queries")) 
+		return create_multi_query(js);
+
 	// these are compulsory items
 	qtype qt = qtype_repr[js["query"].asString()];
 	vector<stream_id> sids = get_streams(js);
@@ -100,6 +161,31 @@ continuous_query* gm::create_continuous_query(const Json::Value& js)
 
 
 
+continuous_query* gm::create_multi_query(const Json::Value& js)
+{
+	projection proj = get_projection(js);
+	protocol_config cfg = get_protocol_config(js);
+
+	const Json::Value& jq = js["queries"];
+	if(! jq.isArray() || jq.size()==0)
+		throw std::invalid_argument("'queries' must be a non-empty array");
+
+	agms_multi_query* Q = new agms_multi_query(proj, cfg);
+	try {
+		for(auto&& q : jq) {
+			qtype qt = qtype_repr[q["query"].asString()];
+			double beta = q.get("beta", js["beta"]).asDouble();
+			Q->add_query(qt, get_streams(q), beta);
+		}
+	} catch(...) {
+		delete Q;
+		throw;
+	}
+	return Q;
+}
+
+
+
 //////////////////////////////////////
 //
 // gm_comm_results_t  table
@@ -161,12 +247,31 @@ enum_repr<rebalancing> gm::rebalancing_repr ({
 });
 
 
+enum_repr<lazy_zeta_mode> gm::lazy_zeta_mode_repr ({
+	{ lazy_zeta_mode::off, "off" },
+	{ lazy_zeta_mode::on, "on" },
+	{ lazy_zeta_mode::check, "check" }
+});
+
+
+enum_repr<wire_codec> gm::wire_codec_repr ({
+	{ wire_codec::estimate, "estimate" },
+	{ wire_codec::dense, "dense" },
+	{ wire_codec::sparse, "sparse" },
+	{ wire_codec::varint, "varint" },
+	{ wire_codec::float16, "float16" }
+});
+
+
 protocol_config gm::get_protocol_config(const Json::Value& js)
 {
 	protocol_config cfg;
 
 	cfg.use_cost_model = js.get("use_cost_model", cfg.use_cost_model).asBool();
 	cfg.eikonal = js.get("eikonal", cfg.eikonal).asBool();
+	cfg.sz_precision = js.get("sz_precision", cfg.sz_precision).asDouble();
+	if(!(cfg.sz_precision > 0.0 && cfg.sz_precision < 1.0))
+		throw std::invalid_argument("The 'sz_precision' option must lie in (0,1).");
 	cfg.rebalance_algorithm = rebalancing_repr[js.get("rebalancing", "none").asString()];
 
 	if(cfg.rebalance_algorithm == rebalancing::projection || 
@@ -180,6 +285,21 @@ protocol_config gm::get_protocol_config(const Json::Value& js)
 	if(js.isMember("epsilon_psi"))
 		cfg.epsilon_psi = js["epsilon_psi"].asDouble();
 
+	cfg.lazy_zeta = lazy_zeta_mode_repr[js.get("lazy_zeta", "off").asString()];
+	if(cfg.lazy_zeta != lazy_zeta_mode::off && !cfg.eikonal)
+		throw std::invalid_argument("The 'lazy_zeta' option requires an eikonal safe zone.");
+
+	cfg.site_threads = js.get("site_threads", (Json::UInt64)cfg.site_threads).asUInt64();
+	cfg.site_window = js.get("site_window", (Json::UInt64)cfg.site_window).asUInt64();
+	if(cfg.site_window == 0)
+		throw std::invalid_argument("The 'site_window' option must be positive.");
+
+	cfg.tree_fanout = js.get("tree_fanout", (Json::UInt64)cfg.tree_fanout).asUInt64();
+	if(cfg.tree_fanout < 2)
+		throw std::invalid_argument("The 'tree_fanout' option must be at least 2.");
+
+	cfg.codec = wire_codec_repr[js.get("codec", "estimate").asString()];
+
 	return cfg;
 }
 
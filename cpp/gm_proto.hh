@@ -7,6 +7,8 @@
  */
 
 #include <optional>
+#include <memory>
+#include <stdexcept>
 
 #include "dds.hh"
 #include "dsarch.hh"
@@ -15,6 +17,9 @@
 #include "hdv.hh"
 #include "gm.hh"
 #include "gm_szone.hh"
+#include "binc.hh"
+#include "parallel.hh"
+#include "codec.hh"
 
 namespace gm {
 
@@ -27,19 +32,67 @@ using namespace dds;
 	This class wraps a reference to a state vector together with 
 	a count of the updates it contains. The byte size of this 
 	object is computed to be the minimum of the size of the
-	sketch and the size of all the updates.
+	sketch and the size of all the updates. The size of the sketch
+	is its encoded size under \c codec (see \c wire_codec).
+
+	When the state vector is a \c touched_vector, the list of its
+	touched elements is also passed, so that the receiver can add the
+	vector to a sum in time proportional to the touched elements.
+	The elements of the state vector are of type \c T; drift vectors 
+	are passed as \c drift_state_ref.
   */
-struct compressed_state_ref
+template <typename T>
+struct basic_compressed_state_ref
 {
-	const Vec& vec;
+	const std::valarray<T>& vec;
 	size_t updates;
+	const std::vector<size_t>* touched = nullptr;	// non-zero elements, if known
+	wire_codec codec;
+
+	inline basic_compressed_state_ref(const std::valarray<T>& _vec, size_t _updates, 
+			wire_codec _codec = wire_codec::estimate)
+		: vec(_vec), updates(_updates), codec(_codec) { }
+
+	inline basic_compressed_state_ref(const basic_touched_vector<T>& _vec, size_t _updates,
+			wire_codec _codec = wire_codec::estimate)
+		: vec(_vec), updates(_updates), 
+		  touched(_vec.sparse() ? &_vec.touched() : nullptr), codec(_codec) { }
+
+	/// Add the state vector to \c S
+	inline void add_to(Vec& S) const {
+		if(touched)
+			for(size_t i : *touched) S[i] += vec[i];
+		else if constexpr (std::is_same<T, double>::value)
+			S += vec;
+		else
+			for(size_t i=0; i<vec.size(); i++) S[i] += vec[i];
+	}
 
-	inline compressed_state_ref(const Vec& _vec, size_t _updates)
-		: vec(_vec), updates(_updates) { }
+	/// Add the elements of the state vector in \f$[from,to)\f$ to \c S
+	inline void add_to(Vec& S, size_t from, size_t to) const {
+		if(touched) {
+			for(size_t i : *touched) 
+				if(i>=from && i<to) S[i] += vec[i];
+		} else
+			for(size_t i=from; i<to; i++) S[i] += vec[i];
+	}
 
 	size_t byte_size() const {
-		// State vectors are transmitted as floats (4 bytes)
-		size_t E_size = vec.size()*sizeof(float); 
+		// State vectors are transmitted encoded (by default, as floats)
+		size_t E_size;
+		if constexpr (std::is_same<T, double>::value)
+			E_size = encoded_size(codec, vec, touched); 
+		else if(codec == wire_codec::estimate)
+			E_size = vec.size()*sizeof(float);
+		else {
+			std::vector<std::pair<size_t,double>> elems;
+			if(touched)
+				for(size_t i : *touched) elems.emplace_back(i, vec[i]);
+			else
+				for(size_t i=0; i<vec.size(); i++) 
+					if(vec[i] != T(0)) elems.emplace_back(i, vec[i]);
+			E_size = encoded_size(codec, vec.size(), elems);
+		}
 
 		// Raw updates are transmitted as stream_update arrays (8 bytes)
 		size_t Raw_size = sizeof(dds::stream_update)*updates;
@@ -51,21 +104,72 @@ struct compressed_state_ref
 	}
 };
 
+/// Wrapper for a state vector of \c double elements
+typedef basic_compressed_state_ref<double> compressed_state_ref;
+
+/// Wrapper for the drift vector of a site
+typedef basic_compressed_state_ref<drift_counter> drift_state_ref;
+
 
 struct compressed_state_obj
 {
 	Vec vec;
 	size_t updates;
+	std::vector<size_t> index;		// if sparse, vec[j] is the element index[j]
+	bool sparse = false;
+	size_t dim;						// the dimension of the state vector
+	wire_codec codec;
+
+	inline compressed_state_obj(const Vec& _vec, size_t _updates,
+			wire_codec _codec = wire_codec::estimate)
+		: vec(_vec), updates(_updates), dim(_vec.size()), codec(_codec) { }
+
+	/// Copy only the touched elements of a sparse \c touched_vector
+	template <typename T>
+	inline compressed_state_obj(const basic_touched_vector<T>& _vec, size_t _updates,
+			wire_codec _codec = wire_codec::estimate)
+		: updates(_updates), sparse(_vec.sparse()), dim(_vec.size()), codec(_codec)
+	{
+		if(sparse) {
+			index = _vec.touched();
+			vec.resize(index.size());
+			for(size_t j=0; j<index.size(); j++) vec[j] = _vec[index[j]];
+		} else
+			_vec.copy_to(vec);
+	}
 
-	inline compressed_state_obj(const Vec& _vec, size_t _updates)
-		: vec(_vec), updates(_updates) { }
+	/// Add the state vector to \c S
+	inline void add_to(Vec& S) const {
+		if(sparse)
+			for(size_t j=0; j<index.size(); j++) S[index[j]] += vec[j];
+		else
+			S += vec;
+	}
+
+	/// Add the elements of the state vector in \f$[from,to)\f$ to \c S
+	inline void add_to(Vec& S, size_t from, size_t to) const {
+		if(sparse) {
+			for(size_t j=0; j<index.size(); j++) 
+				if(index[j]>=from && index[j]<to) S[index[j]] += vec[j];
+		} else
+			for(size_t i=from; i<to; i++) S[i] += vec[i];
+	}
 
 	inline compressed_state_obj(compressed_state_obj&& obj) = default;
 	compressed_state_obj(const compressed_state_obj&) = delete;
 
 	inline size_t byte_size() const {
-		// State vectors are transmitted as floats (4 bytes)
-		size_t E_size = vec.size()*sizeof(float); 
+		// State vectors are transmitted encoded (by default, as floats)
+		size_t E_size;
+		if(codec == wire_codec::estimate)
+			E_size = dim*sizeof(float);
+		else if(sparse) {
+			std::vector<std::pair<size_t,double>> elems;
+			elems.reserve(index.size());
+			for(size_t j=0; j<index.size(); j++) elems.emplace_back(index[j], vec[j]);
+			E_size = encoded_size(codec, dim, elems);
+		} else
+			E_size = encoded_size(codec, vec);
 
 		// Raw updates are transmitted as stream_update arrays (8 bytes)
 		size_t Raw_size = sizeof(dds::stream_update)*updates;
@@ -79,18 +183,44 @@ struct compressed_state_obj
 
 
 
+/**
+	Add a sequence of state vectors (\c compressed_state_ref or 
+	\c compressed_state_obj) to \c S, in parallel.
+
+	The elements of \c S are split into contiguous ranges, one per thread,
+	and each thread adds the states to its range in the order given. Thus,
+	every element is summed in the same order as by calling \c add_to on 
+	each state in turn, and the result does not depend on the number of 
+	threads. The number of threads is given by \c par::num_threads, with 
+	at most \c maxthreads threads if it is nonzero.
+  */
+template <typename State>
+void add_states(Vec& S, const std::vector<State>& states, size_t maxthreads = 0)
+{
+	constexpr size_t min_adds_per_thread = 1<<16;
+	const size_t nthreads = par::num_threads(S.size()*states.size(), 
+		min_adds_per_thread, maxthreads);
+	par::for_shards(S.size(), nthreads, [&](size_t, size_t from, size_t to) {
+		for(auto& s : states)
+			s.add_to(S, from, to);
+	});
+}
+
+
 /**
 	This class wraps safezone_funct objects for transmission and access.
 
 	It is essentially a wrapper for the more verbose, polymorphic \c safezone_func API,
 	but it conforms to the standard functional API. It is copyable and moveable
 	In addition, it provides a byte_size() method, making it suitable for integration
-	with the middleware.
+	with the middleware. The byte size is the size of the safe zone payload, encoded 
+	by \c codec (see \c safezone_func::encode).
   */
 class safezone
 {
 	safezone_func* szone;		// the safezone function, if any
 	void*  inc; 						// pointer to inc state if any
+	wire_codec codec;			// the encoding of the payload
 
 	inline void* get_inc() {
 		if(inc==nullptr && szone!=nullptr)
@@ -111,7 +241,7 @@ public:
 	safezone();
 
 	/// valid safezone
-	safezone(safezone_func* sz);
+	safezone(safezone_func* sz, wire_codec _codec = wire_codec::estimate);
 	~safezone();
 
 	/// Movable
@@ -125,6 +255,7 @@ public:
 	inline void swap(safezone& other) {
 		std::swap(szone, other.szone);
 		std::swap(inc, other.inc);
+		std::swap(codec, other.codec);
 	}
 
 	inline double operator()(const Vec& U)
@@ -137,9 +268,150 @@ public:
 		return (szone!=nullptr) ? szone->compute_zeta(get_inc(), delta, U) : NAN;
 	}
 
-	inline size_t byte_size() const {
-		return (szone!=nullptr) ? szone->zeta_size() * sizeof(float) : 0;
+	/**
+		Evaluate on drift vector \c U, which must be zero. This is 
+		cheaper than \c operator()(U) at the start of a round.
+	  */
+	inline double zero(const Vec& U)
+	{
+		return (szone!=nullptr) ? szone->compute_zeta_zero(get_inc(), U) : NAN;
+	}
+
+	/**
+		Evaluate on a drift vector with elements of type \c T. Unless
+		\c T is \c double, the drift is converted to a \c Vec; the 
+		incremental evaluation converts it only if the function reads it
+		(see \c safezone_func::reads_drift).
+	  */
+	template <typename T>
+	inline double operator()(const basic_touched_vector<T>& U)
+	{
+		return (szone!=nullptr) ? (*this)(drift_values(U)) : NAN;
+	}
+
+	template <typename T>
+	inline double operator()(const delta_vector& delta, const basic_touched_vector<T>& U)
+	{
+		static const Vec none;
+		if(szone==nullptr) return NAN;
+		if constexpr (std::is_same<T, double>::value)
+			return (*this)(delta, U.values());
+		else
+			return (*this)(delta, szone->reads_drift() ? drift_values(U) : none);
+	}
+
+	template <typename T>
+	inline double zero(const basic_touched_vector<T>& U)
+	{
+		return (szone!=nullptr) ? zero(drift_values(U)) : NAN;
+	}
+
+	size_t byte_size() const;
+
+	/**
+		Make \c chk a copy of this safe zone, with a checkpoint of the 
+		incremental state (see \c safezone_func::checkpoint_incstate). 
+		This is used to checkpoint a site.
+	  */
+	void save_state(safezone& chk);
+
+	/**
+		Restore the incremental state saved to \c chk by \c save_state().
+		The safe zone function must not have changed since.
+	  */
+	void restore_state(safezone& chk);
+
+	/**
+		Keep the incremental state, discarding the checkpoint \c chk
+		made by \c save_state().
+	  */
+	void commit_state(safezone& chk);
+};
+
+
+/**
+	Undo log for the speculative execution of a site.
+
+	While the log is active, a site calls \c save() before it changes 
+	elements of a drift vector. Then, \c rollback() restores the recorded 
+	values in reverse order, and the touched sets of the vectors. Restoring
+	old values (rather than subtracting the changes) is exact, so that
+	a rolled-back site is bit-identical to a site that never speculated.
+  */
+class undo_log
+{
+	// The log of the vectors with elements of type T
+	template <typename T>
+	struct typed_log {
+		struct entry { 
+			basic_touched_vector<T>* vec; 
+			size_t index; 
+			T value; 
+		};
+		std::vector<entry> entries;
+		std::vector<std::pair<basic_touched_vector<T>*, 
+			typename basic_touched_vector<T>::touch_mark>> marks;
+
+		inline void mark(basic_touched_vector<T>& v) {
+			for(auto& m : marks) 
+				if(m.first == &v) return;
+			marks.emplace_back(&v, v.touch_state());
+		}
+
+		void rollback() {
+			for(auto e = entries.rbegin(); e != entries.rend(); ++e)
+				e->vec->values()[e->index] = e->value;
+			for(auto& m : marks)
+				m.first->untouch_since(m.second);
+		}
+
+		void clear() {
+			entries.clear();
+			marks.clear();
+		}
+	};
+
+	typed_log<double> wide;
+	typed_log<float> narrow;
+	bool recording = false;
+
+	template <typename T>
+	inline typed_log<T>& log() { 
+		static_assert(std::is_same<T, double>::value || std::is_same<T, float>::value,
+			"undo_log supports double and float vectors");
+		if constexpr (std::is_same<T, float>::value) return narrow; 
+		else return wide; 
 	}
+
+public:
+	inline bool active() const { return recording; }
+
+	/// Start recording
+	inline void start() { recording = true; }
+
+	/// Record the current values of \c v at \c idx
+	template <typename T>
+	inline void save(basic_touched_vector<T>& v, const Index& idx) {
+		if(!recording) return;
+		typed_log<T>& L = log<T>();
+		L.mark(v);
+		for(size_t i : idx) L.entries.push_back({ &v, i, v.values()[i] });
+	}
+
+	/// Record that \c v had values \c old at \c idx, before its last change
+	template <typename T>
+	inline void save(basic_touched_vector<T>& v, const Index& idx, const Vec& old) {
+		if(!recording) return;
+		typed_log<T>& L = log<T>();
+		L.mark(v);
+		for(size_t j=0; j<idx.size(); j++) L.entries.push_back({ &v, idx[j], T(old[j]) });
+	}
+
+	/// Restore the recorded values and stop recording
+	void rollback();
+
+	/// Discard the recorded values and stop recording
+	void commit();
 };
 
 
@@ -174,6 +446,123 @@ enum class rebalancing
 extern enum_repr<rebalancing> rebalancing_repr;
 
 
+/**
+	Labels for the lazy evaluation of safe zones at the sites.
+  */
+enum class lazy_zeta_mode
+{
+	off,				// evaluate the safe zone on every update
+	on,					// skip evaluations that cannot change the outcome
+	check				// evaluate on every update, check that skipping was safe
+};
+
+extern enum_repr<lazy_zeta_mode> lazy_zeta_mode_repr;
+
+extern enum_repr<wire_codec> wire_codec_repr;
+
+
+/**
+	Lipschitz-bounded lazy evaluation of an eikonal safe zone at a site.
+
+	An eikonal safe zone function satisfies 
+	\f$ |\zeta(U+dU)-\zeta(U)| \leq \|dU\| \f$. After \f$\zeta\f$ is evaluated 
+	at drift \f$U_0\f$, the site accumulates a bound \f$ r \geq \|U-U_0\| \f$ 
+	over the following updates. An update need not evaluate the safe zone,
+	if no value \f$ \zeta \geq \zeta(U_0)-r \f$ could make the site act (report 
+	a violation, or cross a bitweight quantum). Then, the zeta of the site is
+	left at \f$\zeta(U_0)\f$ until the next evaluation. Because the incremental 
+	state of the safe zone falls behind, the next evaluation is done from scratch.
+
+	The protocol must call \c reset() whenever it evaluates the safe zone
+	from scratch, and \c sync() before it uses the zeta of a site for
+	anything other than the decision to act.
+
+	In \c check mode, the safe zone is evaluated on every update (so the
+	protocol behaves as with \c off), and every update that would have been 
+	skipped is checked against the actual zeta.
+  */
+class lazy_zeta
+{
+	lazy_zeta_mode mode = lazy_zeta_mode::off;
+	double zeta_eval = INFINITY;	// zeta at the last evaluation
+	double drift = 0.0;				// bound on the norm of the drift since then
+	bool stale = false;				// evaluations were skipped since then
+
+public:
+	inline void set_mode(lazy_zeta_mode m) { mode = m; }
+	inline lazy_zeta_mode get_mode() const { return mode; }
+
+	/// The norm of the change of a vector by a delta
+	static inline double step(const delta_vector& dv) {
+		double s = 0.0;
+		for(size_t i=0; i<dv.size(); i++) {
+			const double d = dv.xnew[i]-dv.xold[i];
+			s += d*d;
+		}
+		return sqrt(s);
+	}
+
+	/// Record that zeta was evaluated from scratch
+	inline void reset(double zeta) {
+		zeta_eval = zeta;
+		drift = 0.0;
+		stale = false;
+	}
+
+	/**
+		\brief Return the zeta of the site after an update.
+
+		@param zeta the current zeta of the site
+		@param dv the update, which changed the drift vector by \c scale*(dv.xnew-dv.xold)
+		@param scale the scale of the update
+		@param quiet \c quiet(z) returns true if the site would not act at zeta \c z
+		@param full evaluates the safe zone from scratch
+		@param inc evaluates the safe zone incrementally for the update
+	  */
+	template <typename Quiet, typename Full, typename Inc>
+	inline double update(double zeta, const delta_vector& dv, double scale,
+		const Quiet& quiet, const Full& full, const Inc& inc)
+	{
+		if(mode==lazy_zeta_mode::off) 
+			return inc();
+
+		drift += scale*step(dv);
+		const double zlow = zeta_eval - drift;
+		const bool skip = quiet(zlow);
+
+		if(mode==lazy_zeta_mode::check) {
+			double z = inc();
+			if(skip && !(quiet(z) && z >= zlow - 1E-9*(1.0+fabs(zeta_eval))))
+				throw std::logic_error(binc::sprint("lazy zeta: skipped a safe zone evaluation, zeta=",z,
+					" bound=",zlow));
+			if(! skip) reset(z);
+			return z;
+		}
+
+		if(skip) {
+			stale = true;
+			return zeta;
+		}
+		double z = stale ? full() : inc();
+		reset(z);
+		return z;
+	}
+
+	/**
+		Return the current zeta of the site, evaluating it from scratch if
+		evaluations were skipped.
+	  */
+	template <typename Full>
+	inline double sync(double zeta, const Full& full) {
+		if(stale) {
+			zeta = full();
+			reset(zeta);
+		}
+		return zeta;
+	}
+};
+
+
 /**
 	Query and protocol configuration.
   */
@@ -181,6 +570,7 @@ struct protocol_config
 {
 	bool use_cost_model = true;				// for fgm: use the cost model if possible
 	bool eikonal = true;					// select eikonal safe zone
+	double sz_precision = 1.E-13;			// relative accuracy of iterative safe zone computations
 	rebalancing rebalance_algorithm
 			 = rebalancing::none;			// select rebalancing algorithm
 
@@ -188,6 +578,18 @@ struct protocol_config
 	size_t rbl_proj_dim;					// the rebalancing projection dimension
 	std::optional<double> epsilon_psi;		// The threshold for ending subrounds
 
+	lazy_zeta_mode lazy_zeta = lazy_zeta_mode::off;	// lazy safe zone evaluation at sites (eikonal only)
+
+	// Parallel execution of the sites (see gm_network)
+	size_t site_threads = 1;				// worker threads, 1 for sequential execution
+	size_t site_window = 4096;				// the most records processed speculatively at once
+
+	// Hierarchical protocols (TGM)
+	size_t tree_fanout = 8;					// the most children of the coordinator and aggregators
+
+	// The encoding of state vectors and safe zones, for the traffic accounting
+	wire_codec codec = wire_codec::estimate;
+
 };
 
 
@@ -247,17 +649,44 @@ struct continuous_query
 	  */
 	virtual basic_stream_query query() const =0;
 
+	/**
+		\brief Apply an update to a state vector and store the delta.
+
+		If the record does not affect the state vector, false is returned 
+		and \c delta is not changed. The storage of \c delta is reused, so 
+		that a caller which keeps its delta vector across calls does not
+		allocate memory.
+	  */
+	virtual bool delta_update(delta_vector& delta, Vec& S, const dds_record& rec)=0;
+
 	/**
 		\brief Apply an update to a state vector and return a delta.
 		
+		The delta is empty if the record does not affect the state.
 	  */
-	virtual delta_vector delta_update(Vec& S, const dds_record& rec)=0;
+	inline delta_vector delta_update(Vec& S, const dds_record& rec) {
+		delta_vector delta;
+		delta_update(delta, S, rec);
+		return delta;
+	}
 
 	/**
 		\brief Appl
 	  */
 	virtual bool update(Vec& S, const dds_record& rec)=0;
 
+	/**
+		\brief Apply all the records of a dataset to a state vector.
+
+		This is used to process the warmup data. The default implementation
+		calls \c update for each record; subclasses may build the state
+		in parallel.
+	  */
+	virtual void update_all(Vec& S, const buffered_dataset& wset) {
+		for(auto&& rec : wset)
+			update(S, rec);
+	}
+
 };
 
 
@@ -366,29 +795,79 @@ extern gm_comm_results_t gm_comm_results;
 
 	Subclasses inherit from this class in order to further customize the
 	behaviour.
+
+	The topology of the network is a star by default. Hierarchical 
+	protocols pass a \c tree_network instead, and the extra arguments 
+	of the constructor (e.g., the fanout) are passed to the topology.
+
+	By default, each stream record is processed by its site when it arrives.
+	If \c protocol_config::site_threads is more than 1, the records are 
+	buffered instead, and processed in windows of at most 
+	\c protocol_config::site_window records. The sites of a window are 
+	partitioned among the threads, and each site processes its records 
+	speculatively, up to the first one that needs to notify the coordinator.
+	Then, the sites that went past the earliest notification are rolled back
+	and replay their records up to it, the coordinator is notified, and the 
+	next window starts after the notifying record. 
+
+	Thus, every site and the coordinator see exactly the same sequence of 
+	operations as in sequential execution, and the results are bit-identical.
+	Buffered records are processed before the state of the network is 
+	observed (by the \c Qest_series column, and at the end of the stream). 
+	The window shrinks when notifications are frequent and grows back when
+	they are rare.
+
+	The sites must provide:
+	- \c update_local(rec), which processes a record without contacting 
+	  the coordinator, and returns true if the coordinator must be notified,
+	- \c notify_coordinator(), which performs the notification,
+	- \c checkpoint(), \c commit() and \c rollback() for speculation.
   */
-template <typename Net, typename Coord, typename Node>
-struct gm_network : star_network<Net, Coord, Node>, component
+template <typename Net, typename Coord, typename Node, 
+	typename Topology = star_network<Net, Coord, Node> >
+struct gm_network : Topology, component
 {
 	typedef Coord coordinator_t;
 	typedef Node node_t;
 	typedef Net network_t;
-	typedef star_network<network_t, coordinator_t, node_t> star_network_t;
+	typedef Topology topology_t;
 
 	continuous_query* Q;
 	
 	const protocol_config& cfg() const { return Q->config; }
 
-	gm_network(const string& _name, continuous_query* _Q)
-	: star_network_t(CTX.metadata().source_ids()), Q(_Q)
+	// The estimate of the coordinator, up to date with the stream
+	computed<double> Qest_series;
+
+	// For several queries, the estimate of each member query
+	std::vector<std::unique_ptr<computed<double>>> member_Qest_series;
+
+	template <typename ... TopologyArgs>
+	gm_network(const string& _name, continuous_query* _Q, TopologyArgs ... targs)
+	: topology_t(CTX.metadata().source_ids(), targs...), Q(_Q),
+	  Qest_series(_name+".qest", "%.10g", [&]() { 
+	  	flush_records();
+	  	return this->hub->Qest_series.value(); 
+	  })
 	{ 
 		this->set_name(_name);
 		this->setup(Q);
+		spec_window = cfg().site_window;
+
+		const size_t nmembers = this->hub->query->num_members();
+		if(nmembers > 1)
+			for(size_t m=0; m<nmembers; m++)
+				member_Qest_series.emplace_back(new computed<double>(
+					_name+".qest."+std::to_string(m), "%.10g", [this,m]() {
+						flush_records();
+						return this->hub->query->member_estimate(m);
+					}));
 
 		on(START_STREAM, [&]() { 
 			process_init(); 
 		} );
 		on(END_STREAM, [&]() { 
+			flush_records();
 			process_fini(); 
 		} );
 		on(START_RECORD, [&]() { 
@@ -398,10 +877,14 @@ struct gm_network : star_network<Net, Coord, Node>, component
 			output_results();
 		});
 		on(INIT, [&]() {
-			CTX.timeseries.add(this->hub->Qest_series);
+			CTX.timeseries.add(Qest_series);
+			for(auto& col : member_Qest_series)
+				CTX.timeseries.add(*col);
 		});
 		on(DONE, [&]() { 
-			CTX.timeseries.remove(this->hub->Qest_series);
+			CTX.timeseries.remove(Qest_series);
+			for(auto& col : member_Qest_series)
+				CTX.timeseries.remove(*col);
 		});
 	}
 
@@ -417,9 +900,134 @@ struct gm_network : star_network<Net, Coord, Node>, component
 	void process_record()
 	{
 		const dds_record& rec = CTX.stream_record();
-		this->source_site(rec.hid)->update_stream();		
+		if(cfg().site_threads <= 1) {
+			this->source_site(rec.hid)->update_stream();
+			return;
+		}
+		pending.push_back(rec);
+		if(pending.size() >= cfg().site_window)
+			flush_records();
+	}
+
+	/// Process the buffered records
+	void flush_records()
+	{
+		size_t from = 0;
+		while(from < pending.size())
+			from = speculate(from, std::min(pending.size(), from+spec_window));
+		pending.clear();
+	}
+
+	// statistics of parallel execution
+	size_t spec_windows = 0;		// number of windows
+	size_t spec_rollbacks = 0;		// number of sites rolled back
+
+private:
+	// State of parallel execution
+	struct site_run {
+		node_t* site = nullptr;
+		std::vector<size_t> recs;	// the records of the site in the window
+		size_t done = 0;			// the number processed speculatively
+		bool notify = false;		// the last one processed must be reported
+	};
+	std::vector<dds_record> pending;	// the buffered records
+	std::vector<site_run> runs;			// indexed by source id
+	std::vector<site_run*> active;		// the runs of the current window
+	size_t spec_window = 1;				// the current window length
+
+	/**
+		Process the records of \c pending in \c [from,to) speculatively, up
+		to and including the first one that notifies the coordinator. 
+		Return the position after the last record processed.
+	  */
+	size_t speculate(size_t from, size_t to)
+	{
+		// short windows are not worth the threads
+		constexpr size_t min_records_per_thread = 64;
+		const size_t nthreads = par::num_threads(to-from, min_records_per_thread, cfg().site_threads);
+		spec_windows++;
+
+		if(runs.empty()) {
+			runs.resize(*this->hids.rbegin()+1);
+			for(auto hid : this->hids)
+				runs[hid].site = this->source_site(hid);
+		}
+
+		// assign the records to their sites
+		active.clear();
+		for(size_t i=from; i<to; i++) {
+			site_run& r = runs.at(pending[i].hid);
+			if(r.recs.empty()) 
+				active.push_back(&r);
+			r.recs.push_back(i);
+		}
+
+		// checkpoints may allocate, so they are taken sequentially
+		for(auto r : active) 
+			r->site->checkpoint();
+
+		par::for_shards(active.size(), nthreads, [&](size_t, size_t b, size_t e) {
+			for(size_t j=b; j<e; j++) {
+				site_run& r = *active[j];
+				r.done = 0;
+				r.notify = false;
+				for(size_t i : r.recs) {
+					r.done++;
+					if(r.site->update_local(pending[i])) {
+						r.notify = true;
+						break;
+					}
+				}
+			}
+		});
+
+		// the first notification
+		size_t stop = to;
+		node_t* notifier = nullptr;
+		for(auto r : active)
+			if(r->notify && r->recs[r->done-1] < stop) {
+				stop = r->recs[r->done-1];
+				notifier = r->site;
+			}
+
+		// Roll back the sites that went past it, and replay their records before it
+		std::vector<site_run*> replay;
+		for(auto r : active) {
+			if(r->recs[r->done-1] > stop) {
+				r->site->rollback();
+				if(r->recs[0] < stop) replay.push_back(r);
+			} else
+				r->site->commit();
+		}
+		spec_rollbacks += replay.size();
+
+		par::for_shards(replay.size(), nthreads, [&](size_t, size_t b, size_t e) {
+			for(size_t j=b; j<e; j++) {
+				site_run& r = *replay[j];
+				for(size_t i : r.recs) {
+					if(i >= stop) break;
+					bool notify = r.site->update_local(pending[i]);
+					assert(!notify);
+				}
+			}
+		});
+
+		for(auto r : active)
+			r->recs.clear();
+
+		if(notifier == nullptr) {
+			spec_window = std::min(2*spec_window, cfg().site_window);
+			return to;
+		}
+
+		// aim for windows about twice the distance between notifications
+		spec_window = std::clamp<size_t>(2*(stop+1-from), 1, cfg().site_window);
+		notifier->notify_coordinator();
+		return stop+1;
 	}
 
+public:
+
 	virtual void process_init()
 	{
 		// let the coordinator initialize the nodes
@@ -456,6 +1064,19 @@ struct gm_network : star_network<Net, Coord, Node>, component
 continuous_query* create_continuous_query(const Json::Value& js);
 
 
+/**
+	Returns an \c agms_multi_query specified by the given component json.
+
+	The json contains an array \c queries, each of whose entries
+	specifies a member query by \c query, \c stream (or \c streams) and,
+	optionally, \c beta, which defaults to the \c beta of the component.
+	The projection and protocol options are common to all members.
+
+	This is called internally by \c create_continuous_query
+ */
+continuous_query* create_multi_query(const Json::Value& js);
+
+
 /**
 	Returns a \c protocol_config object specified by the given component json.
 
@@ -480,4 +1101,18 @@ component* p_component_type<GMProto>::create(const Json::Value& js)
 } // end namespace gm
 
 
+namespace dds {
+
+using hdv::Vec;
+
+/// State vectors are transmitted as floats
+template <>
+inline size_t byte_size< Vec >
+	(Vec const & v) { return sizeof(float)* v.size(); }
+
+}
+
+
+
+
 #endif
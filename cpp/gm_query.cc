@@ -32,7 +32,12 @@ agms_query_state::agms_query_state(double _beta, projection _proj, size_t arity)
 
 void* ball_safezone::alloc_incstate()
 {
-	return new double;
+	return new double(0.0);
+}
+
+void ball_safezone::copy_incstate(void* dst, const void* src)
+{
+	*static_cast<double*>(dst) = *static_cast<const double*>(src);
 }
 
 void ball_safezone::free_incstate(void* ptr)
@@ -57,8 +62,413 @@ double ball_safezone::compute_zeta(const Vec& U)
 	return zeta_E() - norm_L2(U);
 }
 
+bool ball_safezone::reads_drift() const
+{
+	return false;
+}
+
 size_t ball_safezone::zeta_size() const
 {
 	return 1;
 }
 
+void ball_safezone::encode(wire_codec codec, byte_buffer& out) const
+{
+	Vec r(zeta_E(), 1);
+	encode_vector(codec, r, out);
+}
+
+
+
+/////////////////////////////////////////////////////////
+//
+//  agms_multi_query_state
+//
+/////////////////////////////////////////////////////////
+
+
+basic_stream_query agms_member_query::query() const
+{
+	basic_stream_query q(type, beta);
+	q.set_operands(sids);
+	return q;
+}
+
+
+agms_multi_query_state::agms_multi_query_state(const projection& proj, size_t nstreams, 
+		const vector<agms_member_query>& _members, bool _eikonal, double precision)
+	: query_state(nstreams*proj.size()), 
+	  sketch_size(proj.size()), members(_members), eikonal(_eikonal)
+{
+	if(members.empty())
+		throw std::invalid_argument("a multi-query needs at least one member query");
+
+	for(auto& m : members) {
+		switch(m.type) {
+			case qtype::SELFJOIN:
+				parts.emplace_back(new agms_join_query_state<qtype::SELFJOIN, selfjoin_agms_safezone>
+					(m.beta, proj, eikonal, precision));
+				break;
+			case qtype::JOIN:
+				parts.emplace_back(new agms_join_query_state<qtype::JOIN, twoway_join_agms_safezone>
+					(m.beta, proj, eikonal, precision));
+				break;
+			default:
+				throw std::invalid_argument("unsupported member query type");
+		}
+	}
+	compute();
+}
+
+
+void agms_multi_query_state::gather(size_t m, const Vec& X, Vec& Xm) const
+{
+	const auto& slots = members[m].slots;
+	if(Xm.size() != member_size(m))
+		Xm.resize(member_size(m));
+	for(size_t p=0; p<slots.size(); p++) {
+		auto from = begin(X) + slots[p]*sketch_size;
+		std::copy(from, from+sketch_size, begin(Xm)+p*sketch_size);
+	}
+}
+
+
+void agms_multi_query_state::compute()
+{
+	member_Qest.resize(parts.size());
+	member_Tlow.resize(parts.size());
+	member_Thigh.resize(parts.size());
+	for(size_t m=0; m<parts.size(); m++) {
+		member_Qest[m] = parts[m]->Qest;
+		member_Tlow[m] = parts[m]->Tlow;
+		member_Thigh[m] = parts[m]->Thigh;
+	}
+
+	Qest = member_Qest[0];
+	Tlow = member_Tlow[0];
+	Thigh = member_Thigh[0];
+
+	zeta_E = INFINITY;
+	for(auto& part : parts)
+		zeta_E = std::min(zeta_E, part->zeta_E);
+}
+
+
+double agms_multi_query_state::query_func(const Vec& x)
+{
+	Vec x0;
+	gather(0, x, x0);
+	return parts[0]->query_func(x0);
+}
+
+
+double agms_multi_query_state::zeta(const Vec& X)
+{
+	double zmin = INFINITY;
+	Vec Xm;
+	for(size_t m=0; m<parts.size(); m++) {
+		gather(m, X, Xm);
+		zmin = std::min(zmin, parts[m]->zeta(Xm));
+	}
+	return zmin;
+}
+
+
+void agms_multi_query_state::update_estimate(const Vec& dE)
+{
+	E += dE;
+	Vec dEm;
+	for(size_t m=0; m<parts.size(); m++) {
+		gather(m, dE, dEm);
+		parts[m]->update_estimate(dEm);
+	}
+	compute();
+}
+
+
+safezone_func* agms_multi_query_state::safezone()
+{
+	return new multi_safezone(this);
+}
+
+
+safezone_func* agms_multi_query_state::radial_safezone()
+{
+	// The members are 1-Lipschitz, hence so is their minimum
+	return eikonal ? new ball_safezone(this) : nullptr;
+}
+
+
+/////////////////////////////////////////////////////////
+//
+//  multi_safezone
+//
+/////////////////////////////////////////////////////////
+
+
+multi_safezone::multi_safezone(agms_multi_query_state* q)
+	: query(q)
+{
+	for(auto& part : query->parts)
+		parts.push_back(part->safezone());
+}
+
+multi_safezone::~multi_safezone()
+{
+	for(auto sz : parts)
+		delete sz;
+}
+
+void* multi_safezone::alloc_incstate()
+{
+	incremental_state* inc = new incremental_state;
+	for(size_t m=0; m<parts.size(); m++)
+		inc->inc.push_back(parts[m]->alloc_incstate());
+	inc->zeta.assign(parts.size(), 0.0);
+	return inc;
+}
+
+void multi_safezone::free_incstate(void* ptr)
+{
+	incremental_state* inc = static_cast<incremental_state*>(ptr);
+	for(size_t m=0; m<parts.size(); m++)
+		parts[m]->free_incstate(inc->inc[m]);
+	delete inc;
+}
+
+void multi_safezone::copy_incstate(void* dst, const void* src)
+{
+	incremental_state* to = static_cast<incremental_state*>(dst);
+	const incremental_state* from = static_cast<const incremental_state*>(src);
+	for(size_t m=0; m<parts.size(); m++)
+		parts[m]->copy_incstate(to->inc[m], from->inc[m]);
+	to->zeta = from->zeta;
+}
+
+void multi_safezone::checkpoint_incstate(void* chk, void* inc)
+{
+	incremental_state* to = static_cast<incremental_state*>(chk);
+	incremental_state* from = static_cast<incremental_state*>(inc);
+	for(size_t m=0; m<parts.size(); m++)
+		parts[m]->checkpoint_incstate(to->inc[m], from->inc[m]);
+	to->zeta = from->zeta;
+}
+
+void multi_safezone::rollback_incstate(void* inc, void* chk)
+{
+	incremental_state* to = static_cast<incremental_state*>(inc);
+	incremental_state* from = static_cast<incremental_state*>(chk);
+	for(size_t m=0; m<parts.size(); m++)
+		parts[m]->rollback_incstate(to->inc[m], from->inc[m]);
+	to->zeta = from->zeta;
+}
+
+void multi_safezone::commit_incstate(void* inc, void* chk)
+{
+	incremental_state* state = static_cast<incremental_state*>(inc);
+	incremental_state* saved = static_cast<incremental_state*>(chk);
+	for(size_t m=0; m<parts.size(); m++)
+		parts[m]->commit_incstate(state->inc[m], saved->inc[m]);
+}
+
+double multi_safezone::compute_zeta(const Vec& U)
+{
+	double zmin = INFINITY;
+	Vec Um;
+	for(size_t m=0; m<parts.size(); m++) {
+		query->gather(m, U, Um);
+		zmin = std::min(zmin, parts[m]->compute_zeta(Um));
+	}
+	return zmin;
+}
+
+double multi_safezone::compute_zeta(void* ptr, const Vec& U)
+{
+	// Scratch, per thread since sites may be updated by several threads
+	static thread_local Vec Um;
+	incremental_state* inc = static_cast<incremental_state*>(ptr);
+	double zmin = INFINITY;
+	for(size_t m=0; m<parts.size(); m++) {
+		query->gather(m, U, Um);
+		inc->zeta[m] = parts[m]->compute_zeta(inc->inc[m], Um);
+		zmin = std::min(zmin, inc->zeta[m]);
+	}
+	return zmin;
+}
+
+double multi_safezone::compute_zeta(void* ptr, const delta_vector& dU, const Vec& U)
+{
+	static thread_local delta_vector dUm;
+	static thread_local Vec Um;
+	static const Vec none;
+	incremental_state* inc = static_cast<incremental_state*>(ptr);
+	const size_t W = query->sketch_size;
+
+	double zmin = INFINITY;
+	for(size_t m=0; m<parts.size(); m++) {
+		const auto& slots = query->members[m].slots;
+
+		// count the elements of dU in the operands of m
+		size_t count = 0;
+		for(size_t i=0; i<dU.size(); i++)
+			count += std::count(slots.begin(), slots.end(), dU.index[i]/W);
+
+		// only the members touched by dU change
+		if(count>0) {
+			dUm.resize(count);
+			size_t j = 0;
+			for(size_t p=0; p<slots.size(); p++)
+				for(size_t i=0; i<dU.size(); i++) {
+					if(dU.index[i]/W != slots[p]) continue;
+					dUm.index[j] = dU.index[i] - slots[p]*W + p*W;
+					dUm.xold[j] = dU.xold[i];
+					dUm.xnew[j] = dU.xnew[i];
+					j++;
+				}
+			assert(j==count);
+
+			// U already holds the new values
+			const Vec* Up = &none;
+			if(parts[m]->reads_drift()) {
+				query->gather(m, U, Um);
+				Up = &Um;
+			}
+			inc->zeta[m] = parts[m]->compute_zeta(inc->inc[m], dUm, *Up);
+		}
+		zmin = std::min(zmin, inc->zeta[m]);
+	}
+	return zmin;
+}
+
+bool multi_safezone::reads_drift() const
+{
+	for(auto sz : parts)
+		if(sz->reads_drift()) return true;
+	return false;
+}
+
+double multi_safezone::compute_zeta_zero(void* ptr, const Vec& Z)
+{
+	static thread_local Vec Zm;
+	incremental_state* inc = static_cast<incremental_state*>(ptr);
+	double zmin = INFINITY;
+	for(size_t m=0; m<parts.size(); m++) {
+		if(Zm.size() != query->member_size(m))
+			Zm.resize(query->member_size(m));
+		Zm = 0.0;
+		inc->zeta[m] = parts[m]->compute_zeta_zero(inc->inc[m], Zm);
+		zmin = std::min(zmin, inc->zeta[m]);
+	}
+	return zmin;
+}
+
+void multi_safezone::begin_round()
+{
+	for(auto sz : parts)
+		sz->begin_round();
+}
+
+void multi_safezone::compute_zeta_batch(const Vec* const U[], size_t n, double* out)
+{
+	std::fill(out, out+n, INFINITY);
+
+	vector<Vec> Um(n);
+	vector<const Vec*> Uptr(n);
+	vector<double> zm(n);
+	for(size_t m=0; m<parts.size(); m++) {
+		for(size_t i=0; i<n; i++) {
+			query->gather(m, *U[i], Um[i]);
+			Uptr[i] = &Um[i];
+		}
+		parts[m]->compute_zeta_batch(Uptr.data(), n, zm.data());
+		for(size_t i=0; i<n; i++)
+			out[i] = std::min(out[i], zm[i]);
+	}
+}
+
+size_t multi_safezone::batch_threads(size_t n) const
+{
+	size_t t = 1;
+	for(auto sz : parts)
+		t = std::max(t, sz->batch_threads(n));
+	return t;
+}
+
+size_t multi_safezone::zeta_size() const
+{
+	size_t s = 0;
+	for(auto sz : parts)
+		s += sz->zeta_size();
+	return s;
+}
+
+void multi_safezone::encode(wire_codec codec, byte_buffer& out) const
+{
+	for(auto sz : parts)
+		sz->encode(codec, out);
+}
+
+
+/////////////////////////////////////////////////////////
+//
+//  agms_multi_query
+//
+/////////////////////////////////////////////////////////
+
+
+agms_multi_query::agms_multi_query(const projection& _proj, const protocol_config& _cfg)
+	: proj(_proj)
+{
+	config = _cfg;
+	k = CTX.metadata().source_ids().size();
+}
+
+
+void agms_multi_query::add_query(qtype qt, const vector<stream_id>& ops, double beta)
+{
+	size_t arity;
+	switch(qt) {
+		case qtype::SELFJOIN: arity = 1; break;
+		case qtype::JOIN: arity = 2; break;
+		default:
+			throw std::invalid_argument("unsupported member query type");
+	}
+	if(ops.size()!=arity)
+		throw std::length_error(binc::sprint("Expected ",arity,"operands, got",ops.size()));
+
+	agms_member_query mq { qt, ops, {}, beta };
+	for(auto sid : ops) {
+		size_t slot = std::find(sids.begin(), sids.end(), sid) - sids.begin();
+		if(slot == sids.size())
+			sids.push_back(sid);
+		mq.slots.push_back(slot);
+	}
+	members.push_back(mq);
+}
+
+
+double agms_multi_query::theta() const
+{
+	if(members.empty())
+		throw std::logic_error("multi-query without member queries");
+	double epsilon = proj.epsilon();
+	double th = INFINITY;
+	for(auto& m : members)
+		th = std::min(th, (m.beta-epsilon)/(1.0-m.beta*m.beta));
+	return th;
+}
+
+
+basic_stream_query agms_multi_query::query() const
+{
+	if(members.empty())
+		throw std::logic_error("multi-query without member queries");
+	return members[0].query();
+}
+
+
+query_state* agms_multi_query::create_query_state()
+{
+	return new agms_multi_query_state(proj, sids.size(), members, 
+		config.eikonal, config.sz_precision);
+}
@@ -1,6 +1,9 @@
 #ifndef __GM_QUERY_HH__
 #define __GM_QUERY_HH__
 
+#include <memory>
+#include <type_traits>
+
 #include "gm_proto.hh"
 #include "safezone.hh"
 #include "binc.hh"
@@ -26,10 +29,13 @@ struct ball_safezone : safezone_func
 
 	virtual void* alloc_incstate() override;
     virtual void free_incstate(void*) override;
+    virtual void copy_incstate(void* dst, const void* src) override;
     virtual double compute_zeta(void* inc, const delta_vector& dU, const Vec& U) override;
     virtual double compute_zeta(void* inc, const Vec& U) override;
     virtual double compute_zeta(const Vec& U) override;
+    virtual bool reads_drift() const override;
     virtual size_t zeta_size() const override;
+    virtual void encode(wire_codec codec, byte_buffer& out) const override;
 };
 
 
@@ -49,9 +55,10 @@ struct agms_join_query_state : agms_query_state
 	static constexpr size_t arity = (QType==qtype::JOIN)? 2 : 1;
 
 	bool eikonal;	
+	double precision;	// accuracy of the hyperbola distances (join safe zones)
 
-	agms_join_query_state(double _beta, projection _proj, bool _eikonal)
-	: agms_query_state(_beta, _proj, arity), eikonal(_eikonal)
+	agms_join_query_state(double _beta, projection _proj, bool _eikonal, double _precision=1.E-13)
+	: agms_query_state(_beta, _proj, arity), eikonal(_eikonal), precision(_precision)
 	{ 
 		compute();
 	}
@@ -107,7 +114,10 @@ private:
 		else {
 			Tlow = -1.0; Thigh=1.0;
 		}
-		safe_zone = std::move(SafezoneFunc(E, proj, Tlow, Thigh, eikonal));
+		if constexpr (std::is_same_v<SafezoneFunc, twoway_join_agms_safezone>)
+			safe_zone = SafezoneFunc(E, proj, Tlow, Thigh, eikonal, precision);
+		else
+			safe_zone = std::move(SafezoneFunc(E, proj, Tlow, Thigh, eikonal));
 
 		zeta_E = safe_zone(E);
 	}
@@ -118,6 +128,77 @@ typedef agms_join_query_state<qtype::SELFJOIN, twoway_join_agms_safezone> twoway
 
 
 
+/*
+	Update helpers for state vectors which are the concatenation of one 
+	AGMS sketch per stream, for the streams in [sb,se). Updates are scaled 
+	by k, so that the global state is independent of the number of sites.
+ */
+
+/// Apply a record to the state vector and store the delta, or return false
+template <typename SidIter>
+bool sketches_delta_update(const projection& proj, long int k, SidIter sb, SidIter se, 
+	delta_vector& delta, Vec& S, const dds_record& rec)
+{
+	const size_t nops = se-sb;
+	assert(S.size() == nops*proj.size());
+	size_t opno = std::find(sb, se, rec.sid)-sb;
+	if(opno != nops) 
+	{
+		delta.resize(proj.depth());
+		auto S_b = begin(S) + opno*proj.size();
+		auto S_e = S_b + proj.size();
+		auto sk = proj(S_b, S_e);
+
+		sk.update(delta, rec.key, k*rec.upd);
+
+		// Remember to re-base delta indices!
+		if(opno>0)
+			delta.index += opno*proj.size();
+		return true;
+	}
+	return false;
+}
+
+/// Apply a record to the state vector, or return false
+template <typename SidIter>
+bool sketches_update(const projection& proj, long int k, SidIter sb, SidIter se, 
+	Vec& S, const dds_record& rec)
+{
+	const size_t nops = se-sb;
+	assert(S.size() == nops*proj.size());
+	size_t opno = std::find(sb, se, rec.sid)-sb;
+	if(opno != nops) 
+	{
+		auto S_b = begin(S) + opno*proj.size();
+		auto S_e = S_b + proj.size();
+		auto sk = proj(S_b, S_e);
+		sk.update(rec.key, k*rec.upd);
+		return true;
+	}
+	return false;
+}
+
+/// Apply all the records of a dataset, building each sketch in parallel
+template <typename SidIter>
+void sketches_update_all(const projection& proj, long int k, SidIter sb, SidIter se, 
+	Vec& S, const buffered_dataset& wset)
+{
+	const size_t nops = se-sb;
+	assert(S.size() == nops*proj.size());
+	for(size_t opno=0; opno<nops; opno++) {
+		auto S_b = begin(S) + opno*proj.size();
+		auto S_e = S_b + proj.size();
+		agms::parallel_update(proj(S_b, S_e), wset.begin(), wset.end(),
+			[&](const dds_record& rec, size_t& key, double& freq) {
+				if(size_t(std::find(sb, se, rec.sid)-sb) != opno) return false;
+				key = rec.key;
+				freq = k*rec.upd;
+				return true;
+			});
+	}
+}
+
+
 template <typename QueryState>
 struct agms_continuous_query : continuous_query
 {
@@ -155,42 +236,21 @@ struct agms_continuous_query : continuous_query
 		return std::vector<stream_id>(sids.begin(), sids.end());
 	}
 
-	delta_vector delta_update(Vec& S, const dds_record& rec) override
+	using continuous_query::delta_update;
+
+	bool delta_update(delta_vector& delta, Vec& S, const dds_record& rec) override
 	{
-		assert(S.size() == arity*proj.size());
-		size_t opno = stream_operand(rec.sid);
-		if(opno != arity) 
-		{
-			delta_vector delta(proj.depth());
-			auto S_b = begin(S) + opno*proj.size();
-			auto S_e = S_b + proj.size();
-			auto sk = proj(S_b, S_e);
-
-			// Update with scaled quantity, so that the global state is
-			// independent of the number of sites
-			sk.update(delta, rec.key, k*rec.upd);
-
-			// Remember to re-base delta indices!
-			delta.index += opno*proj.size();
-			return delta;
-		}
-		return delta_vector();
+		return sketches_delta_update(proj, k, sids.begin(), sids.end(), delta, S, rec);
 	}
 
-
 	bool update(Vec& S, const dds_record& rec) override
 	{
-		assert(S.size() == arity*proj.size());
-		size_t opno = stream_operand(rec.sid);
-		if(opno != arity) 
-		{
-			auto S_b = begin(S) + opno*proj.size();
-			auto S_e = S_b + proj.size();
-			auto sk = proj(S_b, S_e);
-			sk.update(rec.key, k*rec.upd);
-			return true;
-		}
-		return false;
+		return sketches_update(proj, k, sids.begin(), sids.end(), S, rec);
+	}
+
+	void update_all(Vec& S, const buffered_dataset& wset) override
+	{
+		sketches_update_all(proj, k, sids.begin(), sids.end(), S, wset);
 	}
 
 	basic_stream_query query() const override { 
@@ -203,7 +263,7 @@ struct agms_continuous_query : continuous_query
 		// So far, all query state types are constructed thus!
 		// N.B. will need to change in order to support eikonality selection!
 
-		return new query_state_type(beta, proj, config.eikonal);
+		return new query_state_type(beta, proj, config.eikonal, config.sz_precision);
 	}
 
 	double theta() const override {
@@ -215,6 +275,175 @@ struct agms_continuous_query : continuous_query
 
 
 
+
+//////////////////////////////////////
+//
+// Multiple AGMS queries over shared sketches
+//
+//////////////////////////////////////
+
+
+/**
+	A member query of an \c agms_multi_query.
+  */
+struct agms_member_query
+{
+	qtype type;					// SELFJOIN or JOIN
+	std::vector<stream_id> sids;// the operand streams
+	std::vector<size_t> slots;	// the sketches of the operands in the state vector
+	double beta;				// the query accuracy
+
+	/// The basic query description
+	basic_stream_query query() const;
+};
+
+
+/**
+	Query state for several AGMS queries over shared sketches.
+
+	The state vector is the concatenation of one sketch per stream. Each
+	member query has its own query state, on the sketches of its operands. 
+	The safe zone is the minimum of the safe zones of the members, so its
+	zone is the intersection of their zones, which is contained in the 
+	intersection of the admissible regions.
+
+	The estimate and admissible region of each member are in \c member_Qest,
+	\c member_Tlow and \c member_Thigh. Members \c Qest, \c Tlow and \c Thigh 
+	are those of the first member query, which is the one reported by the 
+	protocols as their estimate. The query states of all members are in \c parts.
+  */
+struct agms_multi_query_state : query_state
+{
+	size_t sketch_size;							// the size of each sketch
+	std::vector<agms_member_query> members;		// the member queries
+	std::vector<std::unique_ptr<query_state>> parts; // the member query states
+	bool eikonal;
+
+	std::vector<double> member_Qest;			// the estimate of each member
+	std::vector<double> member_Tlow;			// the admissible region of each member
+	std::vector<double> member_Thigh;
+
+	agms_multi_query_state(const projection& proj, size_t nstreams, 
+		const std::vector<agms_member_query>& members, bool eikonal, double precision);
+
+	/// The size of the state vector of member \c m
+	inline size_t member_size(size_t m) const { return members[m].slots.size()*sketch_size; }
+
+	/// Copy the operands of member \c m from state vector \c X to \c Xm
+	void gather(size_t m, const Vec& X, Vec& Xm) const;
+
+	double query_func(const Vec& x) override;
+	double zeta(const Vec& X) override;
+	void update_estimate(const Vec& dE) override;
+	safezone_func* safezone() override;
+	safezone_func* radial_safezone() override;
+
+	size_t num_members() const override { return members.size(); }
+	double member_estimate(size_t m) const override { return member_Qest.at(m); }
+
+private:
+	void compute();
+};
+
+
+/**
+	The safe zone function of an \c agms_multi_query_state.
+
+	The incremental state holds the incremental states and zetas of the 
+	members, so that an update is passed only to the members whose operands 
+	it touches, with its indices translated to the member's state vector.
+	The drift vector of a member is not kept; it is gathered from the shared 
+	drift vector only for members that read it (see \c safezone_func::reads_drift).
+  */
+struct multi_safezone : safezone_func
+{
+	agms_multi_query_state* query;
+	std::vector<safezone_func*> parts;	// the member safe zones (owned)
+
+	struct incremental_state {
+		std::vector<void*> inc;		// member incremental states
+		std::vector<double> zeta;	// member zetas
+	};
+
+	multi_safezone(agms_multi_query_state* q);
+	~multi_safezone();
+
+	virtual void* alloc_incstate() override;
+	virtual void free_incstate(void*) override;
+	virtual void copy_incstate(void* dst, const void* src) override;
+	virtual void checkpoint_incstate(void* chk, void* inc) override;
+	virtual void rollback_incstate(void* inc, void* chk) override;
+	virtual void commit_incstate(void* inc, void* chk) override;
+	virtual double compute_zeta(const Vec& U) override;
+	virtual double compute_zeta(void* inc, const Vec& U) override;
+	virtual double compute_zeta(void* inc, const delta_vector& dU, const Vec& U) override;
+	virtual bool reads_drift() const override;
+	virtual double compute_zeta_zero(void* inc, const Vec& Z) override;
+	virtual void begin_round() override;
+	virtual void compute_zeta_batch(const Vec* const U[], size_t n, double* out) override;
+	virtual size_t batch_threads(size_t n) const override;
+	virtual size_t zeta_size() const override;
+	virtual void encode(wire_codec codec, byte_buffer& out) const override;
+};
+
+
+/**
+	A continuous query for several AGMS queries, which share one sketch per stream.
+
+	All member queries use the same projection. Sites maintain a single
+	drift vector for all of them, so that each record updates one sketch,
+	and each message of the protocol serves all member queries.
+  */
+struct agms_multi_query : continuous_query
+{
+	projection proj;							// the common projection
+	std::vector<stream_id> sids;				// one sketch per stream
+	std::vector<agms_member_query> members;		// the member queries
+	long int k;									// number of sites (for scaling)
+
+	agms_multi_query(const projection& _proj, const protocol_config& _cfg);
+
+	/**
+		\brief Add a member query.
+
+		A self-join query takes one operand and a join query takes two.
+		New operand streams are appended to the state vector.
+	  */
+	void add_query(qtype qt, const std::vector<stream_id>& ops, double beta);
+
+	inline size_t state_vector_size() const override {
+		return sids.size()*proj.size();
+	}
+
+	/// The smallest theta among the member queries
+	double theta() const override;
+
+	std::vector<stream_id> get_streams() const override { return sids; }
+
+	/// The query of the first member
+	basic_stream_query query() const override;
+
+	using continuous_query::delta_update;
+
+	bool delta_update(delta_vector& delta, Vec& S, const dds_record& rec) override
+	{
+		return sketches_delta_update(proj, k, sids.begin(), sids.end(), delta, S, rec);
+	}
+
+	bool update(Vec& S, const dds_record& rec) override
+	{
+		return sketches_update(proj, k, sids.begin(), sids.end(), S, rec);
+	}
+
+	void update_all(Vec& S, const buffered_dataset& wset) override
+	{
+		sketches_update_all(proj, k, sids.begin(), sids.end(), S, wset);
+	}
+
+	query_state* create_query_state() override;
+};
+
+
 } // end namespace gm
  
 #endif
@@ -29,6 +29,17 @@ safezone_func* query_state::radial_safezone()
 	return nullptr;
 }
 
+size_t query_state::num_members() const
+{
+	return 1;
+}
+
+double query_state::member_estimate(size_t m) const
+{
+	assert(m==0);
+	return Qest;
+}
+
 
 /////////////////////////////////////////////////////////
 //
@@ -39,3 +50,50 @@ safezone_func* query_state::radial_safezone()
 safezone_func::~safezone_func() 
 { }
 
+void safezone_func::copy_incstate(void* dst, const void* src)
+{
+	throw std::logic_error("this safe zone function cannot copy its incremental state");
+}
+
+void safezone_func::checkpoint_incstate(void* chk, void* inc)
+{
+	copy_incstate(chk, inc);
+}
+
+void safezone_func::rollback_incstate(void* inc, void* chk)
+{
+	copy_incstate(inc, chk);
+}
+
+void safezone_func::commit_incstate(void* inc, void* chk)
+{ }
+
+void safezone_func::encode(wire_codec codec, byte_buffer& out) const
+{
+	throw std::logic_error("this safe zone function has no wire encoding");
+}
+
+double safezone_func::compute_zeta_zero(void* inc, const Vec& Z)
+{
+	return compute_zeta(inc, Z);
+}
+
+void safezone_func::begin_round()
+{ }
+
+void safezone_func::compute_zeta_batch(const Vec* const U[], size_t n, double* out)
+{
+	for(size_t i=0; i<n; i++)
+		out[i] = compute_zeta(*U[i]);
+}
+
+bool safezone_func::reads_drift() const
+{
+	return true;
+}
+
+size_t safezone_func::batch_threads(size_t n) const
+{
+	return 1;
+}
+
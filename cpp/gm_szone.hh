@@ -6,11 +6,52 @@
   */
 
 #include "hdv.hh"
+#include "parallel.hh"
+#include "codec.hh"
 
 namespace gm {
 
 using namespace hdv;
 
+
+/**
+	The type of the elements of the drift vectors kept at the sites
+	(\c U, and \c Uinc where a protocol keeps one).
+
+	It is \c double by default. Building with \c -DGM_DRIFT_COUNTER=float
+	(\c make \c DRIFT_COUNTER=float) halves the memory of the drift vectors 
+	and of the polarized drift of the join safe zone, so that many more 
+	sites with wide sketches fit in memory. The drift is then rounded to 
+	float, while the safe zones still compute in \c double.
+  */
+#ifndef GM_DRIFT_COUNTER
+#define GM_DRIFT_COUNTER double
+#endif
+typedef GM_DRIFT_COUNTER drift_counter;
+
+/// The drift vector of a site
+typedef basic_touched_vector<drift_counter> drift_vector;
+
+/**
+	Return the elements of a touched vector as a \c Vec.
+
+	For \c double elements this is the vector itself. Otherwise, the 
+	elements are converted into a scratch vector of the calling thread, 
+	which is valid until the next call.
+  */
+template <typename T>
+inline const Vec& drift_values(const basic_touched_vector<T>& U)
+{
+	if constexpr (std::is_same<T, double>::value)
+		return U.values();
+	else {
+		static thread_local Vec scratch;
+		U.copy_to(scratch);
+		return scratch;
+	}
+}
+
+
 /**
 	Abstract base class for a safe zone function wrapper.
 
@@ -38,6 +79,32 @@ struct safezone_func
 	  */
 	virtual void free_incstate(void*)=0;
 
+	/**
+		\brief Copy incremental state \c src to \c dst.
+
+		Both states must have been allocated by this object. This is used
+		to checkpoint a site during speculative execution. The default 
+		implementation throws \c std::logic_error.
+	  */
+	virtual void copy_incstate(void* dst, const void* src);
+
+	/**
+		\brief Checkpoint the incremental state \c inc into \c chk.
+
+		This is used for the speculative execution of a site. Until
+		\c rollback_incstate() or \c commit_incstate() is called, \c chk 
+		holds what is needed to restore \c inc. The default implementation 
+		copies \c inc to \c chk; functions with large incremental states 
+		may instead record the changes to \c inc.
+	  */
+	virtual void checkpoint_incstate(void* chk, void* inc);
+
+	/// \brief Restore \c inc to its state at checkpoint \c chk.
+	virtual void rollback_incstate(void* inc, void* chk);
+
+	/// \brief Discard the checkpoint \c chk of \c inc.
+	virtual void commit_incstate(void* inc, void* chk);
+
 	/**
 		\brief Compute the function on a drift vector
 	  */
@@ -57,6 +124,53 @@ struct safezone_func
 	  */
 	virtual double compute_zeta(void* inc, const delta_vector& dU, const Vec& U)=0;
 
+	/**
+		\brief True if the incremental \c compute_zeta(inc,dU,U) reads \c U.
+
+		Functions with a true incremental version need only the delta. Then, 
+		callers that hold the drift vector in another layout (see 
+		\c multi_safezone) may pass an empty vector instead of assembling it.
+		The default implementation returns true.
+	  */
+	virtual bool reads_drift() const;
+
+	/**
+		\brief Compute the function on the zero drift vector and set incremental state.
+
+		Every site starts a round at the zero drift vector \c Z, therefore
+		implementations may compute the incremental state once per round
+		and reset each caller's state to it. The default implementation calls 
+		\c compute_zeta(inc,Z).
+	  */
+	virtual double compute_zeta_zero(void* inc, const Vec& Z);
+
+	/**
+		\brief Signal the start of a new round.
+
+		This is called by the coordinator at the start of each round, after the 
+		estimate vector has been updated. It discards any data cached for the 
+		previous round. The default implementation does nothing.
+	  */
+	virtual void begin_round();
+
+	/**
+		\brief Compute the function on \c n drift vectors.
+
+		Stores \c compute_zeta(*U[i]) into \c out[i], for \f$ i<n \f$.
+		The default implementation just loops over the vectors.
+		Subclasses may evaluate the vectors in parallel, therefore the
+		results must not depend on the order of evaluation.
+	  */
+	virtual void compute_zeta_batch(const Vec* const U[], size_t n, double* out);
+
+	/**
+		\brief The number of threads used by \c compute_zeta_batch on \c n vectors.
+
+		Callers can use this to decide how much speculative work to
+		submit in a batch. The default implementation returns 1.
+	  */
+	virtual size_t batch_threads(size_t n) const;
+
 	/**
 		\brief The dimension of the safe zone function space.
 
@@ -68,6 +182,16 @@ struct safezone_func
 		state vector.
 	  */
 	virtual size_t zeta_size() const = 0;
+
+	/**
+		\brief Append the wire encoding of the safe zone to \c out.
+
+		This encodes the data counted by \c zeta_size(), and it is used 
+		to charge the real size of a safe zone message, for codecs other 
+		than \c wire_codec::estimate. The default implementation throws 
+		\c std::logic_error.
+	  */
+	virtual void encode(wire_codec codec, byte_buffer& out) const;
 };
 
 
@@ -153,6 +277,19 @@ struct query_state
 	 */
 	virtual safezone_func* radial_safezone();
 
+	/**
+		\brief The number of queries monitored by this state.
+
+		A state may monitor several queries (see \c agms_multi_query_state).
+		Then, \c Qest, \c Tlow and \c Thigh are those of the first member, and
+		\c member_estimate returns the estimate of each member.
+		The default implementation returns 1.
+	  */
+	virtual size_t num_members() const;
+
+	/// The estimate of member \c m. The default implementation returns \c Qest.
+	virtual double member_estimate(size_t m) const;
+
 
 	/// A functional interface to the query function
 	inline double operator()(const Vec& x) { return query_func(x); }
@@ -160,6 +297,32 @@ struct query_state
 
 
 
+/**
+	How \c std_safezone_func checkpoints an incremental state of type 
+	\c IncState (see \c safezone_func::checkpoint_incstate). By default, 
+	the state is copied; specializations may record its changes instead.
+  */
+template <typename IncState>
+struct incstate_checkpoint
+{
+	static void checkpoint(IncState& chk, IncState& inc) { chk = inc; }
+	static void rollback(IncState& inc, IncState& chk) { inc = chk; }
+	static void commit(IncState& inc, IncState& chk) { }
+};
+
+
+/**
+	How \c std_safezone_func sets an incremental state of type \c IncState
+	to the state at the zero drift (see \c safezone_func::compute_zeta_zero). 
+	By default, the state is copied; specializations may reset it in place.
+  */
+template <typename IncState>
+struct incstate_reset
+{
+	static void reset(IncState& inc, const IncState& zero) { inc = zero; }
+};
+
+
 /**
 	Template for providing a standard implementation for safezone wrapping.
 
@@ -175,22 +338,90 @@ struct std_safezone_func : safezone_func
 	size_t zsize;
 	const Vec& E;
 
+	// Released incremental states, kept for reuse
+	std::vector<incremental_state*> inc_pool;
+
+	// The incremental state at the zero drift, for the current round
+	incremental_state zero_inc;
+	double zero_zeta;
+	bool zero_valid = false;
+
 	std_safezone_func(SZFunc& _func, size_t _zsize, const Vec& _E) 
 		: func(_func), zsize(_zsize), E(_E)
 	{ }
 
+	~std_safezone_func()
+	{
+		for(auto p : inc_pool)
+			delete p;
+	}
+
+	/**
+		Incremental states are recycled: a released state is kept, and
+		returned by a subsequent allocation, so that the vectors it holds
+		need not be reallocated.
+	  */
 	virtual void* alloc_incstate() override 
 	{
-		return new incremental_state;
+		if(inc_pool.empty())
+			return new incremental_state;
+		incremental_state* ret = inc_pool.back();
+		inc_pool.pop_back();
+		return ret;
 	}
 	virtual void free_incstate(void* ptr) override 
 	{
-		delete static_cast<incremental_state*>(ptr);
+		inc_pool.push_back(static_cast<incremental_state*>(ptr));
+	}
+
+	virtual void copy_incstate(void* dst, const void* src) override
+	{
+		*static_cast<incremental_state*>(dst) = *static_cast<const incremental_state*>(src);
+	}
+
+	virtual void checkpoint_incstate(void* chk, void* inc) override
+	{
+		incstate_checkpoint<incremental_state>::checkpoint(
+			*static_cast<incremental_state*>(chk), *static_cast<incremental_state*>(inc));
+	}
+
+	virtual void rollback_incstate(void* inc, void* chk) override
+	{
+		incstate_checkpoint<incremental_state>::rollback(
+			*static_cast<incremental_state*>(inc), *static_cast<incremental_state*>(chk));
+	}
+
+	virtual void commit_incstate(void* inc, void* chk) override
+	{
+		incstate_checkpoint<incremental_state>::commit(
+			*static_cast<incremental_state*>(inc), *static_cast<incremental_state*>(chk));
+	}
+
+	virtual double compute_zeta_zero(void* inc, const Vec& Z) override
+	{
+		if(!zero_valid) {
+			zero_zeta = func.with_inc(zero_inc, E);
+			zero_valid = true;
+		}
+		incstate_reset<incremental_state>::reset(*static_cast<incremental_state*>(inc), zero_inc);
+		return zero_zeta;
 	}
+
+	virtual void begin_round() override
+	{
+		zero_valid = false;
+	}
+
 	virtual size_t zeta_size() const override 
 	{
 		return zsize;
 	}
+
+	/// The safe zone is sent as its reference point
+	virtual void encode(wire_codec codec, byte_buffer& out) const override
+	{
+		encode_vector(codec, E, out);
+	}
 	virtual double compute_zeta(const Vec& U) {
 		return func(U+E);
 	}
@@ -200,11 +431,44 @@ struct std_safezone_func : safezone_func
 	}
 	virtual double compute_zeta(void* inc, const delta_vector& dU, const Vec& U)
 	{
+		// Scratch, reused across calls. Sites may be updated by 
+		// several threads (see gm_network), hence it is per thread.
+		static thread_local delta_vector DU;
 		incremental_state* incstate = static_cast<incremental_state*>(inc);
-		delta_vector DU = dU;
+		DU.assign(dU);
 		DU += E;
 		return func.inc(*incstate, DU);
 	}
+
+	virtual bool reads_drift() const override
+	{
+		return false;
+	}
+
+	/// Least number of vector elements processed by each thread of a batch
+	static constexpr size_t batch_grain = 1<<15;
+
+	virtual size_t batch_threads(size_t n) const override
+	{
+		return par::num_threads(n, std::max<size_t>(1, batch_grain/std::max<size_t>(1, E.size())));
+	}
+
+	/**
+		The vectors are split into contiguous shards, which are
+		evaluated from scratch in parallel. This requires that the 
+		from-scratch evaluation of \c SZFunc does not modify the object.
+	  */
+	virtual void compute_zeta_batch(const Vec* const U[], size_t n, double* out) override
+	{
+		par::for_shards(n, batch_threads(n), [&](size_t, size_t from, size_t to) {
+			Vec X(E.size());
+			for(size_t i=from; i<to; i++) {
+				X = *U[i];
+				X += E;
+				out[i] = func(X);
+			}
+		});
+	}
 };
 
 } // end namespace gm
@@ -7,6 +7,9 @@
 
 #include "data_source.hh"
 #include "fgm.hh"
+#include "sgm.hh"
+#include "frgm.hh"
+#include "tgm.hh"
 #include "gm_query.hh"
 #include "binc.hh"
 
@@ -34,6 +37,532 @@ public:
 		TS_ASSERT_EQUALS(30*4, message_size(a2));
 	}
 
+	void test_sparse_drift_messages()
+	{
+		touched_vector U(100);
+		U.values()[7] = 2.0;  U.touch(7);
+		U.values()[42] = -1.0;  U.touch(42);
+
+		// the message size does not depend on the representation
+		compressed_state_ref r { U, 1000 };
+		TS_ASSERT(r.touched != nullptr);
+		TS_ASSERT_EQUALS(100*4, message_size(r));
+		compressed_state_obj o { U, 1000 };
+		TS_ASSERT_EQUALS(o.vec.size(), 2);
+		TS_ASSERT_EQUALS(100*4, message_size(o));
+
+		Vec S1(1.0, 100), S2(1.0, 100);
+		r.add_to(S1);
+		o.add_to(S2);
+		Vec S = Vec(1.0, 100) + (const Vec&)U;
+		TS_ASSERT( (S1==S).min() );
+		TS_ASSERT( (S2==S).min() );
+	}
+
+	// Drift vectors of float elements, as in a build with GM_DRIFT_COUNTER=float
+	void test_narrow_drift_vectors()
+	{
+		typedef basic_touched_vector<float> float_vector;
+		float_vector U(100), V(100);
+		touched_vector W(100);
+
+		delta_vector d(Index{3, 42});
+		d.xnew[0] = 2.5;  d.xnew[1] = -1.0;
+		d.apply_delta(U);
+		d.apply_delta(W);
+		TS_ASSERT_EQUALS(U[3], 2.5);
+		TS_ASSERT_EQUALS(U.touched_size(), 2);
+
+		// the messages are the same as for a double vector
+		basic_compressed_state_ref<float> ru { U, 1000, wire_codec::varint };
+		compressed_state_ref rw { W, 1000, wire_codec::varint };
+		TS_ASSERT_EQUALS(message_size(ru), message_size(rw));
+		compressed_state_obj o { U, 1000 };
+		Vec S1(0.0, 100), S2(0.0, 100);
+		o.add_to(S1);
+		ru.add_to(S2);
+		TS_ASSERT( (S1==W.values()).min() );
+		TS_ASSERT( (S2==W.values()).min() );
+
+		// the rebased delta holds the rounded stored value
+		delta_vector e(Index{5});
+		e.xnew[0] = 0.1;
+		e.rebase_apply_delta(V);
+		TS_ASSERT_EQUALS(e.xnew[0], (double) 0.1f);
+		TS_ASSERT_EQUALS(V[5], e.xnew[0]);
+
+		// the undo log restores narrow and wide vectors
+		undo_log undo;
+		undo.start();
+		delta_vector f(Index{3, 7});
+		f.xnew = 1.0;
+		undo.save(U, f.index);
+		f.apply_delta(U);
+		undo.save(W, f.index);
+		f.apply_delta(W);
+		undo.rollback();
+		TS_ASSERT_EQUALS(U[3], 2.5);
+		TS_ASSERT_EQUALS(U[7], 0.0);
+		TS_ASSERT_EQUALS(U.touched_size(), 2);
+		TS_ASSERT_EQUALS(W[7], 0.0);
+		TS_ASSERT_EQUALS(W.touched_size(), 2);
+
+		// a safe zone evaluates an integral drift exactly
+		selfjoin_query_state qs(0.5, projection(5, 400), true);
+		qs.update_estimate(uniform_random_vector(qs.E.size(), 10.0, 20.0));
+		std::unique_ptr<safezone_func> szf { qs.safezone() };
+		safezone szu(szf.get()), szw(szf.get());
+		float_vector Uf(qs.E.size());
+		touched_vector Ud(qs.E.size());
+		TS_ASSERT_EQUALS(szu.zero(Uf), szw.zero(Ud));
+		delta_vector g(Index{10, 500, 1700});
+		g.xnew = 3.0;
+		g.apply_delta(Uf);
+		g.apply_delta(Ud);
+		TS_ASSERT_EQUALS(szu(g, Uf), szw(g, Ud));
+		TS_ASSERT_EQUALS(szu(Uf), szw(Ud));
+	}
+
+	void test_wire_codecs()
+	{
+		byte_buffer buf;
+		for(uint64_t x : {0ul, 127ul, 128ul, 300ul, 1ul<<40})
+			put_varint(buf, x);
+		TS_ASSERT_EQUALS(buf.size(), 1+1+2+2+6);
+		const uint8_t* p = buf.data();
+		for(uint64_t x : {0ul, 127ul, 128ul, 300ul, 1ul<<40})
+			TS_ASSERT_EQUALS(get_varint(p), x);
+		TS_ASSERT_EQUALS(p, buf.data()+buf.size());
+
+		for(float x : {0.0f, 1.0f, -2.5f, 65504.0f, 0.000061035156f, 5.9604645e-08f})
+			TS_ASSERT_EQUALS(half_to_float(float_to_half(x)), x);
+		TS_ASSERT(std::isinf(half_to_float(float_to_half(1E6))));
+		TS_ASSERT_EQUALS(half_to_float(float_to_half(1E-9)), 0.0f);
+
+		Vec X(0.0, 100);
+		X[7] = 2.0; X[42] = -1.0/3;
+		const std::vector<size_t> nz { 42, 7, 99 };
+		const std::map<wire_codec, size_t> sizes {
+			{ wire_codec::dense, 1+400 },
+			{ wire_codec::sparse, 1+1+2*(4+4) },
+			{ wire_codec::varint, 1+1+2*(1+4) },
+			{ wire_codec::float16, 1+1+2*(1+2) }
+		};
+		for(auto& cs : sizes) {
+			TS_ASSERT_EQUALS(encoded_size(cs.first, X), cs.second);
+			TS_ASSERT_EQUALS(encoded_size(cs.first, X, &nz), cs.second);
+
+			buf.clear();
+			encode_vector(cs.first, X, buf);
+			Vec Y;
+			TS_ASSERT_EQUALS(decode_vector(cs.first, buf.data(), Y), cs.second);
+			TS_ASSERT_EQUALS(Y.size(), X.size());
+			double tol = (cs.first==wire_codec::float16) ? 1.0/2048 : 1E-7;
+			for(size_t i=0; i<X.size(); i++)
+				TS_ASSERT_DELTA(Y[i], X[i], tol*fabs(X[i]));
+		}
+		TS_ASSERT_EQUALS(encoded_size(wire_codec::estimate, X), 400);
+		TS_ASSERT_THROWS(encode_vector(wire_codec::estimate, X, buf), std::invalid_argument);
+	}
+
+	void test_encoded_message_sizes()
+	{
+		touched_vector U(100);
+		U.values()[7] = 2.0;  U.touch(7);
+		U.values()[42] = -1.0;  U.touch(42);
+
+		compressed_state_ref r { U, 1000, wire_codec::varint };
+		TS_ASSERT_EQUALS(12, message_size(r));
+		compressed_state_obj o { U, 1000, wire_codec::varint };
+		TS_ASSERT_EQUALS(12, message_size(o));
+		compressed_state_obj d { (const Vec&)U, 1000, wire_codec::sparse };
+		TS_ASSERT_EQUALS(18, message_size(d));
+
+		// the raw updates are sent, if fewer
+		compressed_state_ref r1 { U, 1, wire_codec::dense };
+		TS_ASSERT_EQUALS(8, message_size(r1));
+
+		// safe zones are charged for their payload
+		selfjoin_query_state qs(0.5, projection(5, 400), true);
+		qs.update_estimate(uniform_random_vector(qs.E.size(), 10.0, 20.0));
+		std::unique_ptr<safezone_func> szf { qs.safezone() };
+		TS_ASSERT_EQUALS(safezone(szf.get()).byte_size(), 2000*4);
+		safezone sz(szf.get(), wire_codec::float16);
+		TS_ASSERT_EQUALS(sz.byte_size(), 2+2+2000*3);
+		safezone sz2 = sz;
+		TS_ASSERT_EQUALS(sz2.byte_size(), sz.byte_size());
+
+		ball_safezone ball(&qs);
+		TS_ASSERT_EQUALS(safezone(&ball, wire_codec::dense).byte_size(), 1+4);
+	}
+
+	// The codec changes the traffic, but not the protocol
+	void test_codec_accounting()
+	{
+		buffered_dataset dset = make_uniform_dataset(1, 10, 1000, 20000);
+
+		// send the full safe zones, not balls
+		protocol_config cfg;
+		cfg.use_cost_model = false;
+		auto est = run_selfjoin<fgm::network>(dset, cfg);
+		cfg.codec = wire_codec::dense;
+		auto dense = run_selfjoin<fgm::network>(dset, cfg);
+		cfg.codec = wire_codec::float16;
+		auto half = run_selfjoin<fgm::network>(dset, cfg);
+
+		TS_ASSERT_LESS_THAN(0, est[0]);
+		for(size_t i : {0, 1, 2, 4}) {
+			TS_ASSERT_EQUALS(dense[i], est[i]);
+			TS_ASSERT_EQUALS(half[i], est[i]);
+		}
+		TS_ASSERT_LESS_THAN(est[3], dense[3]);
+		TS_ASSERT_LESS_THAN(half[3], dense[3]);
+
+		Json::Value js;
+		js["codec"] = "varint";
+		TS_ASSERT_EQUALS(get_protocol_config(js).codec, wire_codec::varint);
+		js["codec"] = "zip";
+		TS_ASSERT_THROWS(get_protocol_config(js), std::out_of_range);
+	}
+
+	// The parallel sum of drift vectors is the sequential sum, for any
+	// number of threads
+	void test_add_states()
+	{
+		const size_t D = 50000;
+		vector<touched_vector> U;
+		for(size_t i=0; i<6; i++) {
+			U.emplace_back(D);
+			// even vectors are sparse, odd ones dense
+			for(size_t j=i; j<D; j += (i%2) ? 1 : 997) {
+				U[i].values()[j] = 0.1*(j%13) - 0.3*i;
+				U[i].touch(j);
+			}
+		}
+
+		Vec seq(0.0, D);
+		vector<compressed_state_ref> refs;
+		vector<compressed_state_obj> objs;
+		for(auto& u : U) {
+			refs.emplace_back(u, 10);
+			objs.emplace_back(u, 10);
+			refs.back().add_to(seq);
+		}
+
+		for(size_t nthreads : {1, 2, 5}) {
+			Vec S1(0.0, D), S2(0.0, D);
+			add_states(S1, refs, nthreads);
+			add_states(S2, objs, nthreads);
+			TS_ASSERT( (S1==seq).min() );
+			TS_ASSERT( (S2==seq).min() );
+		}
+	}
+
+	// Batch evaluation must agree with one-at-a-time evaluation
+	template <typename QueryState>
+	void check_zeta_batch(const projection& proj)
+	{
+		QueryState qs(0.5, proj, true);
+		const size_t D = qs.E.size();
+		qs.update_estimate(uniform_random_vector(D, 10.0, 20.0));
+
+		std::unique_ptr<safezone_func> sz { qs.safezone() };
+
+		const size_t n = 40;
+		vector<Vec> U;
+		vector<const Vec*> Uptr;
+		for(size_t i=0; i<n; i++)
+			U.push_back(uniform_random_vector(D, -2.0*i, 2.0*i));
+		for(auto& u : U) 
+			Uptr.push_back(&u);
+
+		double z[n];
+		sz->compute_zeta_batch(Uptr.data(), n, z);
+		for(size_t i=0; i<n; i++)
+			TS_ASSERT_EQUALS(z[i], sz->compute_zeta(U[i]));
+	}
+
+	void test_zeta_batch()
+	{
+		check_zeta_batch<selfjoin_query_state>(projection(7, 1000));
+		check_zeta_batch<agms_join_query_state<qtype::JOIN, twoway_join_agms_safezone>>(projection(5, 1000));
+	}
+
+	// The per-round zero state must agree with from-scratch evaluation
+	void test_safezone_zero()
+	{
+		selfjoin_query_state qs(0.5, projection(5, 400), true);
+		const size_t D = qs.E.size();
+		qs.update_estimate(uniform_random_vector(D, 10.0, 20.0));
+
+		std::unique_ptr<safezone_func> szf { qs.safezone() };
+		Vec Z(0.0, D);
+
+		for(size_t round=0; round<3; round++) {
+			szf->begin_round();
+			double zeta_E = qs.compute_zeta(Z);
+
+			safezone s1(szf.get()), s2(szf.get());
+			TS_ASSERT_EQUALS(s1.zero(Z), zeta_E);
+			TS_ASSERT_EQUALS(s2.zero(Z), zeta_E);
+
+			// the copied incremental state is usable (a sketch delta 
+			// has one element per row)
+			Vec U = Z;
+			delta_vector dU(5);
+			for(size_t i=0; i<5; i++) {
+				size_t j = 400*i + 7*(round+i);
+				dU.index[i] = j;
+				dU.xold[i] = 0.0;
+				dU.xnew[i] = U[j] = 5.0*(i+1);
+			}
+			TS_ASSERT_DELTA(s1(dU, U), qs.compute_zeta(U), 1E-9);
+			TS_ASSERT_EQUALS(s2.zero(Z), zeta_E);
+
+			qs.update_estimate(uniform_random_vector(D, -1.0, 1.0));
+		}
+
+		// released incremental states are reused
+		void* inc = szf->alloc_incstate();
+		szf->free_incstate(inc);
+		TS_ASSERT_EQUALS(szf->alloc_incstate(), inc);
+		szf->free_incstate(inc);
+	}
+
+	// Run a GM protocol over a dataset, return the rounds, subrounds, traffic
+	// and the final estimate
+	template <typename Net>
+	std::vector<double> run_selfjoin(buffered_dataset& dset, const protocol_config& cfg)
+	{
+		CTX.initialize();
+		dataset D;
+		D.load(datasrc(new buffered_data_source(dset)));
+		D.warmup_size(2000);
+		D.create();
+
+		auto Q = new agms_continuous_query<selfjoin_query_state>(
+			vector<stream_id> { 1 }, projection(5, 400), 0.5, qtype::SELFJOIN, cfg);
+		Net net("selfjoin", Q);
+		CTX.run();
+		return { (double)net.hub->num_rounds, (double)net.hub->num_subrounds, 
+			(double)chan_frame(net).msgs(), (double)chan_frame(net).bytes(),
+			net.Qest_series.value() };
+	}
+
+	template <typename Net>
+	std::vector<double> run_selfjoin(buffered_dataset& dset, lazy_zeta_mode mode)
+	{
+		protocol_config cfg;
+		cfg.lazy_zeta = mode;
+		return run_selfjoin<Net>(dset, cfg);
+	}
+
+	template <typename Net>
+	void check_lazy_zeta()
+	{
+		buffered_dataset dset = make_uniform_dataset(1, 5, 1000, 20000);
+
+		auto eager = run_selfjoin<Net>(dset, lazy_zeta_mode::off);
+		auto lazy = run_selfjoin<Net>(dset, lazy_zeta_mode::on);
+		auto checked = run_selfjoin<Net>(dset, lazy_zeta_mode::check);
+
+		TS_ASSERT_LESS_THAN(0, eager[0]);
+		TS_ASSERT(eager == lazy);
+		TS_ASSERT(eager == checked);
+	}
+
+	void test_lazy_zeta()
+	{
+		check_lazy_zeta<sgm::network>();
+		check_lazy_zeta<fgm::network>();
+		check_lazy_zeta<frgm::network>();
+	}
+
+	// Parallel execution of the sites must not change the results
+	template <typename Net>
+	void check_parallel_sites(lazy_zeta_mode mode)
+	{
+		buffered_dataset dset = make_uniform_dataset(1, 10, 1000, 20000);
+
+		protocol_config cfg;
+		cfg.lazy_zeta = mode;
+		auto seq = run_selfjoin<Net>(dset, cfg);
+
+		cfg.site_threads = 4;
+		cfg.site_window = 256;
+		auto par = run_selfjoin<Net>(dset, cfg);
+
+		TS_ASSERT_LESS_THAN(0, seq[0]);
+		TS_ASSERT(seq == par);
+	}
+
+	void test_parallel_sites()
+	{
+		check_parallel_sites<sgm::network>(lazy_zeta_mode::off);
+		check_parallel_sites<fgm::network>(lazy_zeta_mode::off);
+		check_parallel_sites<frgm::network>(lazy_zeta_mode::off);
+		check_parallel_sites<fgm::network>(lazy_zeta_mode::on);
+		check_parallel_sites<tgm::network>(lazy_zeta_mode::off);
+	}
+
+	// The tree protocol ends its subrounds exactly when FRGM does
+	void test_tree_gm()
+	{
+		buffered_dataset dset = make_uniform_dataset(1, 20, 1000, 20000);
+
+		protocol_config cfg;
+		cfg.use_cost_model = false;
+		cfg.tree_fanout = 3;
+		auto star = run_selfjoin<frgm::network>(dset, cfg);
+		auto tree = run_selfjoin<tgm::network>(dset, cfg);
+
+		TS_ASSERT_LESS_THAN(0, tree[0]);
+		TS_ASSERT_EQUALS(tree[0], star[0]);
+		TS_ASSERT_EQUALS(tree[1], star[1]);
+		TS_ASSERT_DELTA(tree[4], star[4], 1E-6*fabs(star[4]));
+
+		// the traffic of the levels adds up to the total
+		CTX.initialize();
+		dataset D;
+		D.load(datasrc(new buffered_data_source(dset)));
+		D.warmup_size(2000);
+		D.create();
+		auto Q = new agms_continuous_query<selfjoin_query_state>(
+			vector<stream_id> { 1 }, projection(5, 400), 0.5, qtype::SELFJOIN, cfg);
+		tgm::network net("tree", Q);
+		CTX.run();
+
+		TS_ASSERT_EQUALS(net.depth(), 4);
+		chan_frame all(net);
+		size_t msgs = 0, bytes = 0;
+		for(size_t l=1; l<net.depth(); l++) {
+			auto& lvl = net.level_hosts();
+			chan_frame up = all.src_in(lvl[l]).dst_in(lvl[l-1]);
+			chan_frame down = all.src_in(lvl[l-1]).dst_in(lvl[l]);
+			TS_ASSERT_LESS_THAN(0, up.msgs());
+			msgs += up.msgs() + down.msgs();
+			bytes += up.bytes() + down.bytes();
+		}
+		TS_ASSERT_EQUALS(msgs, all.msgs());
+		TS_ASSERT_EQUALS(bytes, all.bytes());
+	}
+
+	// A multi-query is the intersection of its members
+	void test_multi_query_state()
+	{
+		projection proj(5, 400);
+		const size_t W = proj.size();
+		vector<agms_member_query> members {
+			{ qtype::SELFJOIN, {2}, {1}, 0.5 },
+			{ qtype::JOIN, {1, 2}, {0, 1}, 0.5 }
+		};
+		agms_multi_query_state qs(proj, 2, members, true, 1e-13);
+		selfjoin_query_state q0(0.5, proj, true);
+		agms_join_query_state<qtype::JOIN, twoway_join_agms_safezone> q1(0.5, proj, true);
+
+		Vec dE = uniform_random_vector(2*W, 10.0, 20.0);
+		qs.update_estimate(dE);
+		q0.update_estimate(dE[std::slice(W, W, 1)]);
+		q1.update_estimate(dE);
+		TS_ASSERT_EQUALS(qs.Qest, q0.Qest);
+		TS_ASSERT_EQUALS(qs.zeta_E, std::min(q0.zeta_E, q1.zeta_E));
+
+		std::unique_ptr<safezone_func> szf { qs.safezone() };
+		safezone sz(szf.get());
+		Vec U(0.0, 2*W);
+		TS_ASSERT_EQUALS(sz(U), qs.zeta_E);
+
+		// updates to either sketch, one element per row
+		for(size_t step=0; step<6; step++) {
+			size_t slot = step % 2;
+			delta_vector dU(proj.depth());
+			for(size_t i=0; i<proj.depth(); i++) {
+				size_t j = slot*W + i*proj.width() + 3*step + i;
+				dU.index[i] = j;
+				dU.xold[i] = U[j];
+				dU.xnew[i] = U[j] = U[j] + 2.0*(i+1);
+			}
+			Vec U0 = U[std::slice(W, W, 1)];
+			double zeta = std::min(q0.compute_zeta(U0), q1.compute_zeta(U));
+			TS_ASSERT_DELTA(sz(dU, U), zeta, 1E-9);
+			TS_ASSERT_DELTA(sz(U), zeta, 1E-9);
+		}
+	}
+
+	// Run a network for a query over a dataset, return its messages and bytes
+	template <typename Net>
+	std::array<size_t,2> run_query(buffered_dataset& dset, continuous_query* Q)
+	{
+		CTX.initialize();
+		dataset D;
+		D.load(datasrc(new buffered_data_source(dset)));
+		D.warmup_size(2000);
+		D.create();
+
+		Net net("single", Q);
+		CTX.run();
+		return { chan_frame(net).msgs(), chan_frame(net).bytes() };
+	}
+
+	void test_multi_query_network()
+	{
+		buffered_dataset dset = make_uniform_dataset(2, 5, 1000, 20000);
+		const projection proj(5, 400);
+
+		CTX.initialize();
+		dataset D;
+		D.load(datasrc(new buffered_data_source(dset)));
+		D.warmup_size(2000);
+		D.create();
+
+		auto Q = new agms_multi_query(proj, protocol_config());
+		Q->add_query(qtype::SELFJOIN, {1}, 0.5);
+		Q->add_query(qtype::SELFJOIN, {2}, 0.5);
+		Q->add_query(qtype::JOIN, {1, 2}, 0.5);
+		TS_ASSERT_THROWS(Q->add_query(qtype::JOIN, {1}, 0.5), std::length_error);
+		TS_ASSERT_EQUALS(Q->state_vector_size(), 2*400*5);
+
+		fgm::network net("multi", Q);
+		TS_ASSERT_EQUALS(net.member_Qest_series.size(), 3);
+		CTX.run();
+		TS_ASSERT_LESS_THAN(0, net.hub->num_rounds);
+
+		// every member query lies in its admissible region
+		auto qs = dynamic_cast<agms_multi_query_state*>(net.hub->query);
+		TS_ASSERT(qs != nullptr);
+		Vec S(0.0, Q->state_vector_size());
+		for(auto& rec : dset) {
+			size_t slot = std::find(Q->sids.begin(), Q->sids.end(), rec.sid) - Q->sids.begin();
+			auto S_b = begin(S) + slot*proj.size();
+			proj(S_b, S_b+proj.size()).update(rec.key, rec.upd);
+		}
+		Vec Sm;
+		for(size_t m=0; m<3; m++) {
+			qs->gather(m, S, Sm);
+			double Qm = qs->parts[m]->query_func(Sm);
+			TS_ASSERT_EQUALS(net.member_Qest_series[m]->value(), qs->member_Qest[m]);
+			TS_ASSERT_LESS_THAN_EQUALS(qs->member_Tlow[m], Qm);
+			TS_ASSERT_LESS_THAN_EQUALS(Qm, qs->member_Thigh[m]);
+			TS_ASSERT_LESS_THAN(qs->member_Tlow[m], qs->member_Qest[m]);
+			TS_ASSERT_LESS_THAN(qs->member_Qest[m], qs->member_Thigh[m]);
+		}
+		TS_ASSERT_EQUALS(qs->Qest, qs->member_Qest[0]);
+
+		// one network for all queries costs less than one network per query
+		auto multi = std::array<size_t,2> { chan_frame(net).msgs(), chan_frame(net).bytes() };
+		std::array<size_t,2> single { 0, 0 };
+		auto add = [&](const std::array<size_t,2>& t) { single[0] += t[0]; single[1] += t[1]; };
+		add(run_query<fgm::network>(dset, new agms_continuous_query<selfjoin_query_state>(
+			vector<stream_id> { 1 }, proj, 0.5, qtype::SELFJOIN, protocol_config())));
+		add(run_query<fgm::network>(dset, new agms_continuous_query<selfjoin_query_state>(
+			vector<stream_id> { 2 }, proj, 0.5, qtype::SELFJOIN, protocol_config())));
+		add(run_query<fgm::network>(dset, new agms_continuous_query<
+				agms_join_query_state<qtype::JOIN, twoway_join_agms_safezone>>(
+			vector<stream_id> { 1, 2 }, proj, 0.5, qtype::JOIN, protocol_config())));
+		TS_ASSERT_LESS_THAN(multi[0], single[0]);
+		TS_ASSERT_LESS_THAN(multi[1], single[1]);
+	}
+
 	void test_gm2_network()
 	{
 
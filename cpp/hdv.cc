@@ -3,6 +3,8 @@
 #include <algorithm>
 #include <vector>
 #include <cassert>
+#include <array>
+#include <utility>
 
 #include "hdv.hh"
 
@@ -58,22 +60,67 @@ double hdv::order_select(size_t k, Vec v)
 }
 
 
-double hdv::median(Vec v)
+double hdv::median(const Vec& v)
+{
+	return median(&v[0], v.size());
+}
+
+
+//
+// Sorting networks for the median of small inputs. The odd-even
+// transposition network of N inputs has N rounds; with N a constant,
+// the compiler unrolls it into a sequence of min/max instructions.
+//
+
+static inline void compare_exchange(double& a, double& b)
+{
+	const double lo = std::min(a,b);
+	const double hi = std::max(a,b);
+	a = lo; b = hi;
+}
+
+template <size_t N>
+static double median_network(const double* v)
+{
+	double w[N];
+	std::copy(v, v+N, w);
+	for(size_t r=0; r<N; r++)
+		for(size_t i=r&1; i+1<N; i+=2)
+			compare_exchange(w[i], w[i+1]);
+	if constexpr (N & 1) 
+		return w[N/2];
+	else
+		return (w[N/2]+w[N/2-1])*0.5;
+}
+
+template <size_t ... N>
+static constexpr auto median_network_table(std::index_sequence<N...>)
+{
+	return std::array<double (*)(const double*), sizeof...(N)> {{ &median_network<N+1>... }};
+}
+
+static constexpr auto median_networks = median_network_table(std::make_index_sequence<16>());
+
+
+double hdv::median(const double* v, size_t n)
 {
-	const auto n = v.size();
 	if(n==0) throw std::length_error("median called on 0-size vector");
+	if(n <= median_networks.size())
+		return median_networks[n-1](v);
+
+	double w[n];
+	std::copy(v, v+n, w);
 	if(n & 1) {
 		// odd order
-		std::nth_element(begin(v), begin(v)+n/2, end(v));
-		return v[n/2];
+		std::nth_element(w, w+n/2, w+n);
+		return w[n/2];
 	} else {
 		// even order
 		auto k = n/2;
-		std::nth_element(begin(v), begin(v)+k, end(v));
-		double m = v[k];
-		k--;
-		std::nth_element(begin(v), begin(v)+k, end(v));
-		return (m+v[k])*0.5;
+		std::nth_element(w, w+k, w+n);
+		double m = w[k];
+		// the lower middle is the maximum of the lower half
+		return (m + *std::max_element(w, w+k))*0.5;
 	}
 }
 
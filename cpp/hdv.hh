@@ -145,6 +145,9 @@
   */
 
 #include <map>
+#include <vector>
+#include <cassert>
+#include <cstdint>
 #include <numeric>
 #include <valarray>
 #include <iostream>
@@ -175,6 +178,11 @@ typedef valarray<bool> Mask;
 
 
 
+template <typename T> class basic_touched_vector;
+
+/// A touched vector of \c double elements
+typedef basic_touched_vector<double> touched_vector;
+
 /**
 	A delta vector describes old and new values of a vector, 
 	after an update is applied to some cells.
@@ -226,24 +234,66 @@ struct delta_vector
 	// Some operations to allow convenient calculation of deltas of expressions,
 	// needed when we call an incremental function on an expression of the
 	// original vector
-	inline delta_vector& operator+=(const Vec& a) { xold += a[index]; xnew += a[index]; return *this; }
-	inline delta_vector& operator-=(const Vec& a) { xold -= a[index]; xnew -= a[index]; return *this; }
-	inline delta_vector& operator*=(const Vec& a) { xold *= a[index]; xnew *= a[index]; return *this; }
-	inline delta_vector& operator/=(const Vec& a) { xold /= a[index]; xnew /= a[index]; return *this; }
+	//
+	// These operations are loops over the entries, so that they do not 
+	// create temporary arrays (as, e.g., xold += a[index] would).
+	//
+	inline delta_vector& operator+=(const Vec& a) { 
+		for(size_t i=0; i<size(); i++) { xold[i] += a[index[i]]; xnew[i] += a[index[i]]; }
+		return *this; 
+	}
+	inline delta_vector& operator-=(const Vec& a) { 
+		for(size_t i=0; i<size(); i++) { xold[i] -= a[index[i]]; xnew[i] -= a[index[i]]; }
+		return *this; 
+	}
+	inline delta_vector& operator*=(const Vec& a) { 
+		for(size_t i=0; i<size(); i++) { xold[i] *= a[index[i]]; xnew[i] *= a[index[i]]; }
+		return *this; 
+	}
+	inline delta_vector& operator/=(const Vec& a) { 
+		for(size_t i=0; i<size(); i++) { xold[i] /= a[index[i]]; xnew[i] /= a[index[i]]; }
+		return *this; 
+	}
 
 	inline delta_vector& operator+=(double a) { xold += a; xnew += a; return *this; }
 	inline delta_vector& operator-=(double a) { xold -= a; xnew -= a; return *this; }
 	inline delta_vector& operator*=(double a) { xold *= a; xnew *= a; return *this; }
 	inline delta_vector& operator/=(double a) { xold /= a; xnew /= a; return *this; }
 
-	inline delta_vector& negate() { xold = -xold; xnew = -xnew; return *this; }
+	inline delta_vector& negate() { 
+		for(size_t i=0; i<size(); i++) { xold[i] = -xold[i]; xnew[i] = -xnew[i]; }
+		return *this; 
+	}
+
+	/**
+		\brief Copy another delta vector into this one.
+
+		Unlike assignment, the storage of this delta vector is
+		reused when the sizes match, and is never shared. This is the
+		way to fill a reusable delta vector.
+	  */
+	inline void assign(const delta_vector& other) {
+		resize(other.size());
+		for(size_t i=0; i<size(); i++) {
+			index[i] = other.index[i];
+			xold[i] = other.xold[i];
+			xnew[i] = other.xnew[i];
+		}
+	}
 
 	/**
 		\brief Apply this delta to a vector.
 
-		That is, a +=  xnew-xold
+		That is, a +=  xnew-xold. The vector may have elements narrower
+		than \c double, which are then rounded.
 	  */
-	inline void apply_delta(Vec& a) const {  a[index] += xnew - xold; }
+	template <typename T>
+	inline void apply_delta(std::valarray<T>& a) const {  
+		for(size_t i=0; i<size(); i++)
+			a[index[i]] += xnew[i] - xold[i];
+	}
+	template <typename T>
+	inline void apply_delta(basic_touched_vector<T>& a) const;
 
 	/**
 	 	\brief Reset to a new base vector plus the delta.
@@ -251,7 +301,13 @@ struct delta_vector
 		This call makes \c xold equal to \c a[index] and changes \c xnew so
 		that \c xnew-xold remains unchanged.
 	 */
-	inline void rebase(const Vec& a) { 	xnew -= xold; xnew += a[index]; xold = a[index]; }
+	template <typename T>
+	inline void rebase(const std::valarray<T>& a) { 	
+		for(size_t i=0; i<size(); i++) {
+			xnew[i] = (xnew[i] - xold[i]) + a[index[i]];
+			xold[i] = a[index[i]];
+		}
+	}
 
 	/**
 		Reset to a new base of the 0 vector.
@@ -270,15 +326,20 @@ struct delta_vector
 		this->apply_delta(a);
 		\endcode
 
-		but is executed more efficiently.
+		but is executed more efficiently. If the elements of \c a are 
+		narrower than \c double, \c xnew is the rounded value stored in \c a.
 	  */
-	inline void rebase_apply_delta(Vec& a) {
+	template <typename T>
+	inline void rebase_apply_delta(std::valarray<T>& a) {
 		for(size_t i=0; i < index.size(); i++) {
 			double delta = xnew[i] - xold[i];
 			xold[i] = a[index[i]];
-			xnew[i] = a[index[i]] = xold[i] + delta;
+			a[index[i]] = xold[i] + delta;
+			xnew[i] = a[index[i]];
 		}
 	}
+	template <typename T>
+	inline void rebase_apply_delta(basic_touched_vector<T>& a);
 
 
 	/**
@@ -301,8 +362,12 @@ struct delta_vector
 
 
 
+/**
+	Combine two (sorted) delta vectors into \c res, which must not be
+	one of them. The storage of \c res is reused, if its size fits.
+  */
 template <typename Func>
-delta_vector combine_deltas(const delta_vector& v1, const delta_vector& v2, Func func)
+void combine_deltas(delta_vector& res, const delta_vector& v1, const delta_vector& v2, Func func)
 {
 	//
 	// This code makes the case that v1.index and v2.index are sorted
@@ -325,7 +390,7 @@ delta_vector combine_deltas(const delta_vector& v1, const delta_vector& v2, Func
 	j += v1.size() - i1 + v2.size()-i2;
 
 	// now apply the function on the result
-	delta_vector res(j);
+	res.resize(j);
 
 	j=i1=i2=0;
 
@@ -366,7 +431,14 @@ delta_vector combine_deltas(const delta_vector& v1, const delta_vector& v2, Func
 		i2++;
 		j++;		
 	}	
+}
+
 
+template <typename Func>
+delta_vector combine_deltas(const delta_vector& v1, const delta_vector& v2, Func func)
+{
+	delta_vector res;
+	combine_deltas(res, v1, v2, func);
 	return res;
 }
 
@@ -484,7 +556,19 @@ double order_select(size_t k, Vec v);
 /**
    Return the median of a Vec.
   */
-double median(Vec v);
+double median(const Vec& v);
+
+
+/**
+	Return the median of the \f$n\f$ values in \c v[0..n), which are not 
+	modified.
+
+	This does not allocate memory: the values are copied to the stack
+	and, for \f$ n\leq 16\f$, sorted by a sorting network (so that the 
+	selection is branch-free); larger inputs use \c std::nth_element.
+	For even \f$n\f$, the result is the mean of the two middle values.
+  */
+double median(const double* v, size_t n);
 
 
 // Norms 
@@ -550,6 +634,194 @@ Vec uniform_random_vector(size_t n, double a, double b);
 
 
 
+/**
+	A dense vector that keeps track of the elements that may be non-zero.
+
+	Vectors which are zeroed often, but get only a few elements changed
+	between zeroings (such as the drift vectors of the sites of a 
+	geometric monitoring protocol), spend most of their time clearing
+	elements that are already zero. A \c touched_vector stores its elements
+	in a \c Vec, plus the list of elements written since the last \c clear(). 
+	Clearing, and other operations that need only the non-zero elements,
+	take time proportional to the number of touched elements.
+
+	When more than \f$ 1/8 \f$ of the elements have been touched, the list is
+	dropped and the vector behaves as a plain \c Vec until the next clear.
+
+	The element type \c T is \c double for \c touched_vector. A narrower
+	floating-point type (e.g., \c float) halves the memory of the vector;
+	writes are then rounded, and reads convert back to \c double.
+
+	Reading is done via the conversion to <tt>const valarray<T>&</tt>
+	(that is, <tt>const Vec&</tt> for \c touched_vector). Writing
+	is done either by the methods of this class, or by writing to \c values()
+	and then calling \c touch() on the written elements.
+  */
+template <typename T>
+class basic_touched_vector
+{
+	static_assert(std::is_floating_point<T>::value, 
+		"touched vectors have floating-point elements");
+	template <typename> friend class basic_touched_vector;
+public:
+	typedef T value_type;
+	typedef std::valarray<T> container_type;
+
+private:
+	container_type x;
+	std::vector<size_t> idx;		// the touched elements, if sparse
+	std::vector<uint8_t> mark;		// mark[i] iff i is in idx
+	bool isdense = false;
+
+	// The list of touched elements is kept, so that untouch_since() 
+	// can return to a sparse state
+	inline void make_dense() {
+		isdense = true;
+	}
+
+public:
+	basic_touched_vector() { }
+	explicit basic_touched_vector(size_t n) : x(T(0), n), mark(n, 0) { }
+
+	inline size_t size() const { return x.size(); }
+
+	/// The elements
+	inline const container_type& values() const { return x; }
+	inline operator const container_type& () const { return x; }
+	inline double operator[](size_t i) const { return x[i]; }
+
+	/// Copy the elements to \c v, resizing it if needed
+	void copy_to(Vec& v) const {
+		if(v.size()!=size()) v.resize(size());
+		std::copy(std::begin(x), std::end(x), std::begin(v));
+	}
+
+	/**
+		Writable access to the elements. The caller must \c touch()
+		every element that it writes.
+	  */
+	inline container_type& values() { return x; }
+
+	/// True if the touched elements are listed
+	inline bool sparse() const { return !isdense; }
+
+	/// The touched elements, in order of touching (only if \c sparse())
+	inline const std::vector<size_t>& touched() const { return idx; }
+
+	/// The number of elements that may be non-zero
+	inline size_t touched_size() const { return isdense ? size() : idx.size(); }
+
+	inline void touch(size_t i) {
+		if(isdense || mark[i]) return;
+		mark[i] = 1;
+		idx.push_back(i);
+		if(8*idx.size() > size()) make_dense();
+	}
+	inline void touch(const Index& I) {
+		for(size_t i : I) touch(i);
+	}
+
+	/// Mark all elements as touched and return them for writing
+	inline container_type& touch_all() { make_dense(); return x; }
+
+	/// The state of the touched set, see \c untouch_since()
+	struct touch_mark {
+		size_t count;		// number of listed elements
+		bool dense;
+	};
+
+	/// Return the current state of the touched set
+	inline touch_mark touch_state() const { return { idx.size(), isdense }; }
+
+	/**
+		Return the touched set to a previous state \c m, forgetting the 
+		elements touched since. The values are not changed. 
+		The vector must not have been cleared since \c m was taken.
+	  */
+	inline void untouch_since(const touch_mark& m) {
+		if(m.dense) return;
+		assert(m.count <= idx.size());
+		for(size_t j=m.count; j<idx.size(); j++) mark[idx[j]] = 0;
+		idx.resize(m.count);
+		isdense = false;
+	}
+
+	/// Zero the vector
+	void clear() {
+		if(isdense) {
+			x = T(0);
+			std::fill(mark.begin(), mark.end(), 0);
+			isdense = false;
+		} else {
+			for(size_t i : idx) { x[i] = T(0); mark[i] = 0; }
+		}
+		idx.clear();
+	}
+
+	/// Assign a dense vector
+	inline basic_touched_vector& operator=(const Vec& v) {
+		assert(v.size()==size());
+		std::copy(std::begin(v), std::end(v), std::begin(touch_all()));
+		return *this;
+	}
+
+	/// Make this vector equal to \c v/a, where \c v has the same size
+	template <typename T2>
+	void assign_div(const basic_touched_vector<T2>& v, double a) {
+		assert(v.size()==size());
+		clear();
+		if(v.isdense) {
+			container_type& y = touch_all();
+			for(size_t i=0; i<size(); i++) y[i] = v.x[i]/a;
+		} else
+			for(size_t i : v.idx) { x[i] = v.x[i]/a; touch(i); }
+	}
+
+	/// Call \c f(i, x[i]) for every touched element \c i
+	template <typename Func>
+	void foreach_touched(const Func& f) const {
+		if(isdense)
+			for(size_t i=0; i<size(); i++) f(i, x[i]);
+		else
+			for(size_t i : idx) f(i, x[i]);
+	}
+
+	/// Add this vector to \c S
+	inline void add_to(Vec& S) const {
+		assert(S.size()==size());
+		if(isdense) {
+			if constexpr (std::is_same<T, double>::value)
+				S += x;
+			else
+				for(size_t i=0; i<size(); i++) S[i] += x[i];
+		} else
+			for(size_t i : idx) S[i] += x[i];
+	}
+
+	/// True if all elements are zero
+	bool is_zero() const {
+		bool ret = true;
+		foreach_touched([&](size_t, double v) { ret = ret && (v==0.0); });
+		return ret;
+	}
+};
+
+
+template <typename T>
+inline void delta_vector::apply_delta(basic_touched_vector<T>& a) const
+{
+	apply_delta(a.values());
+	a.touch(index);
+}
+
+template <typename T>
+inline void delta_vector::rebase_apply_delta(basic_touched_vector<T>& a)
+{
+	rebase_apply_delta(a.values());
+	a.touch(index);
+}
+
+
 /**
 	A sparse vector-like object.
 
@@ -557,77 +829,254 @@ Vec uniform_random_vector(size_t n, double a, double b);
 	be properly called a vector, since its "dimension" is unknown. It much more
 	resembles a "materialized function".
 
-	The `Domain` type can be any type usable as a key to `std::map`. The range
-	should be a numeric type.
+	The mappings are stored in a flat open-addressing hash table with linear 
+	probing, so that a lookup is usually a single cache miss and an insertion
+	does not allocate. For integral domains, a range of keys can be
+	made dense (see \c set_dense_range); keys in the range map directly
+	to an array slot, and other keys are still hashed.
+
+	The `Domain` type must be hashable by `Hash` and ordered by `Compare`.
+	The range should be a numeric type.
+
+	Iteration (by \c begin() and \c end()) is in no particular order; 
+	\c ordered() returns the mappings sorted by key. Unlike \c std::map, 
+	adding a mapping invalidates references and iterators.
   */
-template <typename Domain, typename Range=long int, typename Compare=std::less<Domain> >
-class frequency_vector : public std::map<Domain, Range, Compare>
+template <typename Domain, typename Range=long int, 
+	typename Compare=std::less<Domain>, typename Hash=std::hash<Domain> >
+class frequency_vector
 {
 	static_assert(std::is_arithmetic<Range>::value, 
 		"non-arithmetic range in histogram is not allowed");
 public:
 	typedef Domain domain_type;
 	typedef Range range_type;
-	typedef std::map<Domain, Range> container;
-	typedef typename container::iterator iterator;
-	typedef typename container::const_iterator const_iterator;
+	typedef std::pair<Domain, Range> value_type;
+
+private:
+	// slots [0,ndense) are the dense range, the rest is the hash table
+	std::vector<value_type> slot;
+	std::vector<uint8_t> used;
+	size_t ndense = 0;
+	Domain dense_lo = Domain();
+	size_t hcap = 0;		// hash table capacity, 0 or a power of 2
+	size_t hshift = 64;		// 64 - log2(hcap)
+	size_t nmapped = 0;		// number of mappings
+	size_t nhashed = 0;		// number of mappings in the hash table
+
+	// the dense slot of a key, or ndense if it is not in the dense range
+	inline size_t dense_slot(const Domain& key) const {
+		if constexpr (std::is_integral<Domain>::value) {
+			if(ndense) {
+				size_t off = (size_t)((long long)key - (long long)dense_lo);
+				return (off < ndense) ? off : ndense;
+			}
+		}
+		return ndense;
+	}
 
+	// the first probe of a key in the hash table (Fibonacci hashing)
+	inline size_t home_slot(const Domain& key) const {
+		return (size_t)((uint64_t)Hash()(key) * 0x9E3779B97F4A7C15ull >> hshift);
+	}
 
-	using std::map<Domain,Range>::begin;
-	using std::map<Domain,Range>::end;
+	// the slot of a key in the hash table, or of the empty slot where it goes
+	inline size_t probe(const Domain& key) const {
+		const size_t mask = hcap-1;
+		size_t i = home_slot(key);
+		while(used[ndense+i] && !(slot[ndense+i].first == key))
+			i = (i+1) & mask;
+		return ndense+i;
+	}
+
+	// the slot of a mapped key, or npos
+	static constexpr size_t npos = ~size_t(0);
+	inline size_t locate(const Domain& key) const {
+		size_t j = dense_slot(key);
+		if(j < ndense) 
+			return used[j] ? j : npos;
+		if(hcap==0) return npos;
+		j = probe(key);
+		return used[j] ? j : npos;
+	}
+
+	void rehash(size_t newcap) {
+		std::vector<value_type> old;
+		old.reserve(nhashed);
+		for(size_t j=ndense; j<slot.size(); j++)
+			if(used[j]) old.push_back(slot[j]);
+
+		hcap = newcap;
+		hshift = 64;
+		for(size_t c=hcap; c>1; c>>=1) hshift--;
+		slot.resize(ndense+hcap);
+		used.resize(ndense);
+		used.resize(ndense+hcap, 0);
+		for(auto& v : old) {
+			size_t j = probe(v.first);
+			slot[j] = v;
+			used[j] = 1;
+		}
+	}
+
+public:
+
+	/**
+		Iterator over the mappings. The value type is \c std::pair<Domain,Range>;
+		the key (\c first) must not be modified.
+	  */
+	template <typename FV, typename V>
+	class basic_iterator
+	{
+		FV* fv;
+		size_t j;
+		friend class frequency_vector;
+		inline void skip() { while(j < fv->slot.size() && !fv->used[j]) j++; }
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef std::pair<Domain, Range> value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef V* pointer;
+		typedef V& reference;
+
+		basic_iterator() : fv(nullptr), j(0) { }
+		basic_iterator(FV* _fv, size_t _j) : fv(_fv), j(_j) { skip(); }
+
+		inline V& operator*() const { return fv->slot[j]; }
+		inline V* operator->() const { return &fv->slot[j]; }
+		inline basic_iterator& operator++() { j++; skip(); return *this; }
+		inline basic_iterator operator++(int) { auto r = *this; ++(*this); return r; }
+		inline bool operator==(const basic_iterator& o) const { return j==o.j; }
+		inline bool operator!=(const basic_iterator& o) const { return j!=o.j; }
+	};
+
+	typedef basic_iterator<frequency_vector, value_type> iterator;
+	typedef basic_iterator<const frequency_vector, const value_type> const_iterator;
+
+	inline iterator begin() { return iterator(this, 0); }
+	inline iterator end() { return iterator(this, slot.size()); }
+	inline const_iterator begin() const { return const_iterator(this, 0); }
+	inline const_iterator end() const { return const_iterator(this, slot.size()); }
+
+	/// The number of mappings
+	inline size_t size() const { return nmapped; }
+	inline bool empty() const { return nmapped==0; }
+
+	/// Remove all mappings (the dense range is kept)
+	void clear() {
+		for(size_t j=0; j<ndense; j++) slot[j].second = (Range)0;
+		slot.resize(ndense);
+		used.assign(ndense, 0);
+		hcap = 0; hshift = 64;
+		nmapped = nhashed = 0;
+	}
+
+	/**
+		Store the keys in \f$ [lo,hi] \f$ in a dense array, of one slot per key.
+
+		This is only available for integral domains. Existing mappings are kept.
+	  */
+	void set_dense_range(Domain lo, Domain hi) {
+		static_assert(std::is_integral<Domain>::value, "dense range needs an integral domain");
+		assert(lo <= hi);
+		std::vector<value_type> old(begin(), end());
+		ndense = (size_t)((long long)hi - (long long)lo) + 1;
+		dense_lo = lo;
+		slot.assign(ndense, value_type());
+		for(size_t j=0; j<ndense; j++) 
+			slot[j] = value_type(lo + (Domain)j, (Range)0);
+		used.assign(ndense, 0);
+		hcap = 0; hshift = 64;
+		nmapped = nhashed = 0;
+		for(auto& v : old)
+			get_counter(v.first) = v.second;
+	}
+
+	/// The number of keys in the dense range
+	inline size_t dense_size() const { return ndense; }
 
 	inline Range& get_counter(const Domain& key) {
-		auto loc = this->find(key);
-		if(loc==this->end()) {
-			return this->insert(std::make_pair(key, (Range)0)).first->second;
+		size_t j = dense_slot(key);
+		if(j < ndense) {
+			if(! used[j]) { used[j] = 1; nmapped++; }
+			return slot[j].second;
 		}
-		else {
-			return loc->second;
-		}		
+
+		if(2*(nhashed+1) > hcap)
+			rehash(hcap ? 2*hcap : 16);
+		j = probe(key);
+		if(! used[j]) {
+			used[j] = 1;
+			slot[j] = value_type(key, (Range)0);
+			nmapped++;
+			nhashed++;
+		}
+		return slot[j].second;
 	}
 
-	// overload the std::map [] operators so as to avoid surprises!
 	inline Range& operator[](const Domain& key) {
 		return get_counter(key);
 	}
 	inline Range operator[](const Domain& key) const {
-		auto loc = this->find(key);
-		if(loc==this->end())
-			return ((Range)0);
-		else
-			return loc.second;
+		size_t j = locate(key);
+		return (j==npos) ? ((Range)0) : slot[j].second;
+	}
+
+	/// Return an iterator to the mapping of a key, or \c end()
+	inline iterator find(const Domain& key) {
+		size_t j = locate(key);
+		return iterator(this, (j==npos) ? slot.size() : j);
+	}
+	inline const_iterator find(const Domain& key) const {
+		size_t j = locate(key);
+		return const_iterator(this, (j==npos) ? slot.size() : j);
 	}
 
+	/// The number of mappings for a key (0 or 1)
+	inline size_t count(const Domain& key) const { return locate(key)!=npos; }
+
 	/**
 		Pack a frequency vector by deleting 0 entries.
 
 	  	This method takes linear time.
 	  */
 	void pack() {
-		// do a "delayed erase"
-		iterator prev = end();
-		for(auto iter=begin(); iter!=end(); iter++) {
-			if(prev!=end()) {
-				erase(prev);
-			}
-			if(iter.second != ((Range)0)) {
-				prev = end();
-			} else {
-				prev = end();
-			}
+		std::vector<value_type> keep;
+		for(size_t j=ndense; j<slot.size(); j++)
+			if(used[j] && slot[j].second != ((Range)0)) keep.push_back(slot[j]);
+		nmapped = 0;
+		for(size_t j=0; j<ndense; j++) {
+			used[j] = (used[j] && slot[j].second != ((Range)0));
+			nmapped += used[j];
 		}
-		return *this;
+		slot.resize(ndense);
+		used.resize(ndense);
+		hcap = 0; hshift = 64;
+		nhashed = 0;
+		for(auto& v : keep)
+			get_counter(v.first) = v.second;
 	}
 
 	/** Convenience method that calls `pack()` and returns *this */
-	inline auto packed() { pack(); return *this; }
+	inline frequency_vector& packed() { pack(); return *this; }
+
+	/**
+		Return the mappings, sorted by key.
+	  */
+	std::vector<value_type> ordered() const {
+		std::vector<value_type> ret(begin(), end());
+		Compare less;
+		std::sort(ret.begin(), ret.end(), 
+			[&](const value_type& a, const value_type& b) { return less(a.first, b.first); });
+		return ret;
+	}
 
 	/**
 		Return true if there is mapping for a key
 
 		Note that a mapping may exist and be `((Range)0)` if the vector is unpacked.
 	  */
-	inline bool mapping_exists(const Domain& key) const { return find(key)!=end(); }
+	inline bool mapping_exists(const Domain& key) const { return locate(key)!=npos; }
 
 	/**
 		Declare this object as a function : `Domain` -> `Range`
@@ -639,61 +1088,60 @@ public:
 		Call f( x ) for x in keys
 	  */
 	template <typename Func>
-	void foreach_key(const Func& f) const { for(auto it : (*this)) f(it->first); }
+	void foreach_key(const Func& f) const { for(auto& it : (*this)) f(it.first); }
 	/**
 		Call f( self(x) ) for x in keys
 	  */
 	template <typename Func>
-	void foreach_value(const Func& f) { for(auto it : (*this)) f(it->value); }
+	void foreach_value(const Func& f) const { for(auto& it : (*this)) f(it.second); }
 
 	/**
 		Call f( x, self(x) ) for x in keys
 	  */
 	template <typename Func>
-	void foreach_point(const Func& f) { for(auto it : (*this)) f(it->first, it->second); }
-
-	/*
-		Note: we don't call these `assign` since this method will be offered by
-		std::map in C++17
-	*/
+	void foreach_point(const Func& f) const { for(auto& it : (*this)) f(it.first, it.second); }
 
 
 	template <typename Func>
-	auto pointwise_map(const Func& f) { 
-		for(auto it : (*this))  it->second = f(it->second); 
+	frequency_vector& pointwise_map(const Func& f) { 
+		for(auto& it : (*this))  it.second = f(it.second); 
 		return *this;
 	}
 	template <typename Func>
-	auto pointwise_map_point(const Func& f) { 
-		for(auto it : (*this))  it->second = f(it->first, it->second); 
+	frequency_vector& pointwise_map_point(const Func& f) { 
+		for(auto& it : (*this))  it.second = f(it.first, it.second); 
 		return *this;
 	}
 
 	template <typename Func, typename Range2>
-	auto pointwise_map(const Func& f, const frequency_vector<Domain,Range2,Compare>& other) {
+	frequency_vector& pointwise_map(const Func& f, 
+		const frequency_vector<Domain,Range2,Compare,Hash>& other) 
+	{
 		// first apply on my own domain
-		for(auto it : (*this)) {
-			it->second = f(it->second, other(it->first) ); 
+		for(auto& it : (*this)) {
+			it.second = f(it.second, other(it.first) ); 
 		}
 		// add the domain of the other vector
-		for(auto it : other) {
-			if(! mapping_exists(it->first)) 
-				get_counter(it->first) = f(((Range)0), it->second);
+		for(auto& it : other) {
+			if(! mapping_exists(it.first)) 
+				get_counter(it.first) = f(((Range)0), it.second);
 		}
 		return *this;
 	}
 
 
 	template <typename Func, typename Range2>
-	auto pointwise_map_point(const Func& f, const frequency_vector<Domain,Range2,Compare>& other) {
+	frequency_vector& pointwise_map_point(const Func& f, 
+		const frequency_vector<Domain,Range2,Compare,Hash>& other) 
+	{
 		// first apply on my own domain
-		for(auto it : (*this)) {
-			it->second = f(it->first, it->second, other(it->first) ); 
+		for(auto& it : (*this)) {
+			it.second = f(it.first, it.second, other(it.first) ); 
 		}
 		// add the domain of the other vector
-		for(auto it : other) {
-			if(! mapping_exists(it->first)) 
-				get_counter(it->first) = f(it->first, ((Range)0), it->second);
+		for(auto& it : other) {
+			if(! mapping_exists(it.first)) 
+				get_counter(it.first) = f(it.first, ((Range)0), it.second);
 		}
 		return *this;
 	}
@@ -702,32 +1150,28 @@ public:
 
 
 
-template <typename Domain, typename Range1, typename Range2, typename Compare>
+/**
+	Return the inner product of two frequency vectors.
+
+	The mappings of the smaller vector are looked up in the larger one.
+  */
+template <typename Domain, typename Range1, typename Range2, typename Compare, typename Hash>
 inline auto inner_product(
-	const frequency_vector<Domain, Range1, Compare>& v1,
-	const frequency_vector<Domain, Range2, Compare>& v2
+	const frequency_vector<Domain, Range1, Compare, Hash>& v1,
+	const frequency_vector<Domain, Range2, Compare, Hash>& v2
  )
 {
-	auto less = v1.key_comp();
-	auto i1 = v1.begin();
-	auto e1 = v1.end();
-	auto i2 = v2.begin();
-	auto e2 = v2.end();
 	typedef decltype( ((Range1)0) * ((Range2)0) ) result_type;
 	result_type res = 0;
 
-	while(true) {
-		if(i1==e1 || i2==e2) 
-			return res;
-		else if(less(i1->first, i2->first))
-			++i1;
-		else if(less(i2->first, i1->first))
-			++i2;
-		else {
-			res += i1->second * i2->second;
-			++i1; ++i2;
-		}
+	if(v1.size() <= v2.size()) {
+		for(auto& it : v1)
+			res += it.second * v2(it.first);
+	} else {
+		for(auto& it : v2)
+			res += v1(it.first) * it.second;
 	}
+	return res;
 }
 
 
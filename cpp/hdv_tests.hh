@@ -1,6 +1,9 @@
 
 #include <cxxtest/TestSuite.h>
 
+#include <random>
+#include <map>
+
 #include "hdv.hh"
 #include "binc.hh"
 
@@ -69,6 +72,47 @@ public:
 	}
 
 
+	void test_delta_reuse()
+	{
+		Vec x {1.0,2,3,4,5};
+		delta_vector d(Index{1,3});
+		d.xold = Vec{2.,4.};
+		d.xnew = Vec{5.,1.};
+
+		// assign reuses the storage of equal size
+		delta_vector e(2);
+		const double* buf = &e.xold[0];
+		e.assign(d);
+		TS_ASSERT_EQUALS(&e.xold[0], buf);
+		TS_ASSERT( (e.index==d.index).min() && (e.xnew==d.xnew).min() );
+
+		e += x;
+		TS_ASSERT_EQUALS(e.xold[0], 4.0);
+		TS_ASSERT_EQUALS(e.xnew[1], 5.0);
+
+		e.rebase(x);
+		TS_ASSERT( (e.xold == Vec{2.,4.}).min() );
+		TS_ASSERT( (e.xnew == Vec{5.,1.}).min() );
+
+		Vec y = x;
+		e.apply_delta(y);
+		TS_ASSERT( (y == Vec{1.,5.,3.,1.,5.}).min() );
+
+		// combining into an existing delta vector
+		delta_vector f(Index{0,3});
+		f.xold = Vec{1.,1.};
+		f.xnew = Vec{2.,2.};
+		delta_vector g = d+f;
+		delta_vector h;
+		combine_deltas(h, d, f, std::plus<double>());
+		TS_ASSERT_EQUALS(h.size(), 3);
+		TS_ASSERT( (h.index==g.index).min() );
+		TS_ASSERT( (h.xold==g.xold).min() && (h.xnew==g.xnew).min() );
+		TS_ASSERT( (h.index==Index{0,1,3}).min() );
+		TS_ASSERT_EQUALS(h.xnew[2], 3.0);
+	}
+
+
 	void test_dot_product() 
 	{
 		using binc::print;
@@ -122,6 +166,27 @@ public:
 		TS_ASSERT_EQUALS(v.size(), 1);
 		TS_ASSERT_EQUALS(median(v), 3.0);
 
+		TS_ASSERT_THROWS(median(Vec()), std::length_error);
+	}
+
+	void test_median_network()
+	{
+		// compare the sorting networks and the large case to sorting
+		for(size_t n=1; n<=40; n++) {
+			for(size_t rep=0; rep<20; rep++) {
+				Vec v = uniform_random_vector(n, -10, 10);
+				if(rep & 1) v = v.apply([](double x) { return std::floor(x); });  // with duplicates
+				Vec u = v;
+
+				std::vector<double> w(begin(v), end(v));
+				std::sort(w.begin(), w.end());
+				double m = (n&1) ? w[n/2] : (w[n/2]+w[n/2-1])*0.5;
+
+				TS_ASSERT_EQUALS(median(&v[0], n), m);
+				TS_ASSERT_EQUALS(median(v), m);
+				TS_ASSERT( (v == u).min() );
+			}
+		}
 	}
 
 
@@ -136,6 +201,117 @@ public:
 
 
 
+	void test_touched_vector()
+	{
+		touched_vector U(80);
+		Vec R(0.0, 80);
+
+		delta_vector dv(Index {3, 10, 70});
+		dv.xnew = Vec {1.0, 2.0, 3.0};
+		dv.apply_delta(U);
+		dv.apply_delta(R);
+		U.values()[10] += 1.0;  U.touch(10);
+		R[10] += 1.0;
+
+		TS_ASSERT(U.sparse());
+		TS_ASSERT_EQUALS(U.touched_size(), 3);
+		TS_ASSERT( ((const Vec&)U == R).min() );
+
+		touched_vector V(80);
+		V.assign_div(U, 4.0);
+		TS_ASSERT( ((const Vec&)V == R/4.0).min() );
+		TS_ASSERT_EQUALS(V.touched_size(), 3);
+
+		Vec S(1.0, 80);
+		U.add_to(S);
+		TS_ASSERT( (S == R+1.0).min() );
+
+		U.clear();
+		TS_ASSERT(U.is_zero());
+		TS_ASSERT_EQUALS(U.touched_size(), 0);
+		TS_ASSERT_EQUALS(norm_L2(U), 0.0);
+
+		// too many touched elements make the vector dense
+		for(size_t i=0; i<20; i++) U.touch(i);
+		TS_ASSERT(! U.sparse());
+		TS_ASSERT_EQUALS(U.touched_size(), 80);
+		U = R;
+		U.clear();
+		TS_ASSERT(U.sparse());
+		TS_ASSERT_EQUALS(norm_L2(U), 0.0);
+
+		// the touched set can be rolled back, also from dense
+		U.touch(3);
+		auto m = U.touch_state();
+		for(size_t i=20; i<40; i++) U.touch(i);
+		TS_ASSERT(! U.sparse());
+		U.untouch_since(m);
+		TS_ASSERT(U.sparse());
+		TS_ASSERT_EQUALS(U.touched_size(), 1);
+		U.touch(25);
+		TS_ASSERT_EQUALS(U.touched_size(), 2);
+	}
+
+	void test_frequency_vector()
+	{
+		std::mt19937 gen(4713);
+		std::uniform_int_distribution<int> K(-50, 1000);
+
+		frequency_vector<int> hashed, dense;
+		dense.set_dense_range(0, 99);
+		TS_ASSERT_EQUALS(dense.dense_size(), 100);
+		std::map<int,long> ref;
+
+		for(size_t i=0; i<5000; i++) {
+			int k = K(gen);
+			long u = (i%3==0) ? -1 : 1;
+			hashed[k] += u;
+			dense.get_counter(k) += u;
+			ref[k] += u;
+		}
+
+		TS_ASSERT_EQUALS(hashed.size(), ref.size());
+		TS_ASSERT_EQUALS(dense.size(), ref.size());
+		for(auto& kv : ref) {
+			TS_ASSERT_EQUALS(hashed(kv.first), kv.second);
+			TS_ASSERT_EQUALS(dense(kv.first), kv.second);
+		}
+		TS_ASSERT(! hashed.mapping_exists(2000));
+		TS_ASSERT_EQUALS(hashed(2000), 0);
+		TS_ASSERT(hashed.find(2000) == hashed.end());
+
+		// ordered iteration matches the map
+		auto ho = hashed.ordered();
+		auto d = dense.ordered();
+		auto same = [](auto& a, auto& b) { return a.first==b.first && a.second==b.second; };
+		TS_ASSERT(std::equal(ho.begin(), ho.end(), ref.begin(), ref.end(), same));
+		TS_ASSERT(std::equal(d.begin(), d.end(), ref.begin(), ref.end(), same));
+
+		// inner product
+		long ip = 0;
+		for(auto& kv : ref) ip += kv.second * kv.second;
+		TS_ASSERT_EQUALS(inner_product(hashed, dense), ip);
+
+		// packing removes the zero counters only
+		size_t nz = std::count_if(ref.begin(), ref.end(), 
+			[](auto& kv) { return kv.second!=0; });
+		hashed.pack();
+		dense.pack();
+		TS_ASSERT_EQUALS(hashed.size(), nz);
+		TS_ASSERT_EQUALS(dense.size(), nz);
+		for(auto& kv : ref)
+			TS_ASSERT_EQUALS(dense(kv.first), kv.second);
+
+		// making a range dense keeps the mappings
+		hashed.set_dense_range(-50, 1000);
+		TS_ASSERT_EQUALS(hashed.size(), nz);
+		TS_ASSERT_EQUALS(inner_product(hashed, dense), ip);
+
+		hashed.clear();
+		TS_ASSERT(hashed.empty());
+		TS_ASSERT(hashed.begin() == hashed.end());
+	}
+
 };
 
 
@@ -0,0 +1,76 @@
+#ifndef __PARALLEL_HH__
+#define __PARALLEL_HH__
+
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <exception>
+
+/**
+	\file Fork-join parallelism for the setup phases of a simulation.
+
+	The simulation itself is sequential, except for the speculative
+	execution of GM sites (see \c gm::gm_network). However, the setup phases
+	(building sketches from warmup data, filling lookup tables) work on
+	independent pieces of data, which are split into contiguous shards
+	and processed by one thread per shard.
+  */
+
+namespace par {
+
+
+/**
+	Return the number of threads to use for \c n items of work, so that
+	each thread gets at least \c grain items. The number of threads
+	is at most \c maxthreads or, if it is 0, the number of hardware threads.
+  */
+inline size_t num_threads(size_t n, size_t grain, size_t maxthreads = 0)
+{
+	size_t hw = maxthreads ? maxthreads
+		: std::max<size_t>(1, std::thread::hardware_concurrency());
+	return std::max<size_t>(1, std::min(hw, n/std::max<size_t>(1,grain)));
+}
+
+
+/**
+	Split \f$ [0,n) \f$ into \c nthreads contiguous shards of (almost) equal
+	length, and call \c f(t, from, to) for each shard \c t in parallel.
+
+	The first shard runs on the calling thread. If some calls throw,
+	the exception of the first such shard is rethrown, after all
+	threads have finished.
+  */
+template <typename Func>
+void for_shards(size_t n, size_t nthreads, Func&& f)
+{
+	nthreads = std::max<size_t>(1, std::min(nthreads, n));
+	if(nthreads==1) {
+		f(0, 0, n);
+		return;
+	}
+
+	std::vector<std::exception_ptr> errors(nthreads);
+	auto run = [&](size_t t) {
+		try {
+			f(t, (n*t)/nthreads, (n*(t+1))/nthreads);
+		} catch(...) {
+			errors[t] = std::current_exception();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	threads.reserve(nthreads-1);
+	for(size_t t=1; t<nthreads; t++)
+		threads.emplace_back(run, t);
+	run(0);
+	for(auto& th : threads)
+		th.join();
+
+	for(auto& e : errors)
+		if(e) std::rethrow_exception(e);
+}
+
+
+} // end namespace par
+
+#endif
@@ -54,6 +54,7 @@ void comm_results::fill(basic_network* nw)
 network_comm_results_t network_comm_results;
 network_host_traffic_t network_host_traffic;
 network_interfaces_t network_interfaces;
+network_level_traffic_t network_level_traffic;
 
 
 
@@ -97,4 +98,23 @@ void  network_interfaces_t::output_results(basic_network* nw)
 }
 
 
+void  network_level_traffic_t::output_results(basic_network* nw, const vector<host_set>& levels)
+{
+	netname = nw->name();
+	protocol = nw->rpc().name();
+	chan_frame all(nw);
+	for(size_t l=1; l<levels.size(); l++) {
+		chan_frame up = all.src_in(levels[l]).dst_in(levels[l-1]);
+		chan_frame down = all.src_in(levels[l-1]).dst_in(levels[l]);
+		level = l;
+		hosts = levels[l].size();
+		up_msgs = up.msgs();
+		up_bytes = up.bytes();
+		down_msgs = down.msgs();
+		down_bytes = down.bytes();
+		emit_row();
+	}
+}
+
+
 } // end namespace dds
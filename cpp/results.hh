@@ -95,6 +95,30 @@ struct network_interfaces_t : result_table
 };
 extern network_interfaces_t network_interfaces;
 
+/**
+	Traffic between the levels of a hierarchical network.
+
+	Each row corresponds to a level \f$l>0\f$ of the network (level 0 is
+	the root). The upstream traffic is sent by the hosts of level \f$l\f$
+	to the hosts of level \f$l-1\f$, and the downstream traffic the other
+	way round. Both include the responses of remote calls.
+  */
+struct network_level_traffic_t : result_table
+{
+	column_ref<string> run_id	{this, "run_id", 64, "%s", CTX.run_id };
+	column<string> netname		{this, "netname", 64, "%s"};
+	column<string> protocol   	{this, "protocol", 64, "%s" };
+	column<size_t> level		{this, "level", "%zu"};
+	column<size_t> hosts		{this, "hosts", "%zu"};
+	column<size_t> up_msgs		{this, "up_msgs", "%zu"};
+	column<size_t> up_bytes		{this, "up_bytes", "%zu"};
+	column<size_t> down_msgs	{this, "down_msgs", "%zu"};
+	column<size_t> down_bytes	{this, "down_bytes", "%zu"};
+	network_level_traffic_t() : result_table("network_level_traffic") {}
+	void output_results(basic_network* nw, const vector<host_set>& levels);
+};
+extern network_level_traffic_t network_level_traffic;
+
 } // end namespace dds
 
 #endif
@@ -27,16 +27,20 @@ double selfjoin_agms_safezone_upper_bound::operator()(const Vec& X)
 
 double selfjoin_agms_safezone_upper_bound::with_inc(incremental_state& incstate, const Vec& X) 
 {
-	incstate = dot_estvec(proj(X));
-	Vec z = sqrt_T - sqrt(incstate);
-	return Median(z);
+	incstate.est = dot_estvec(proj(X));
+	incstate.z.resize(proj.depth());
+	return inc(incstate, delta_vector());
 }
 
 
 double selfjoin_agms_safezone_upper_bound::inc(incremental_state& incstate, const delta_vector& DX) 
 {
-	Vec z = sqrt_T - sqrt(dot_estvec_inc(incstate, DX));
-	return Median(z);
+	const double* est = begin(dot_estvec_inc(incstate.est, DX));
+	double* z = begin(incstate.z);
+	const size_t D = incstate.z.size();
+	for(size_t i=0; i<D; i++)
+		z[i] = sqrt_T - sqrt(est[i]);
+	return Median(incstate.order, z);
 }
 
 
@@ -44,24 +48,28 @@ double selfjoin_agms_safezone_upper_bound::inc(incremental_state& incstate, cons
 double selfjoin_agms_safezone_lower_bound::operator()(const Vec& X) 
 {
 	if(sqrt_T==0.0) return INFINITY;
-	Vec z = dot_estvec(Ehat.proj(X),Ehat) - sqrt_T ;
+	Vec z = dot_estvec(Ehat.proj(X),Ehat.view()) - sqrt_T ;
 	return Median(z);
 }
 
 double selfjoin_agms_safezone_lower_bound::with_inc(incremental_state& incstate, const Vec& X)
 {
 	if(sqrt_T==0.0) return INFINITY;
-	incstate = dot_estvec(Ehat.proj(X),Ehat);
-	Vec z = incstate - sqrt_T;
-	return Median(z);
+	incstate.est = dot_estvec(Ehat.proj(X),Ehat.view());
+	incstate.z.resize(Ehat.depth());
+	return inc(incstate, delta_vector());
 }
 
 
 double selfjoin_agms_safezone_lower_bound::inc(incremental_state& incstate, const delta_vector& DX)
 {
 	if(sqrt_T==0.0) return INFINITY;
-	Vec z = dot_estvec_inc(incstate, DX, Ehat) - sqrt_T ;
-	return Median(z);
+	const double* est = begin(dot_estvec_inc(incstate.est, DX, Ehat));
+	double* z = begin(incstate.z);
+	const size_t D = incstate.z.size();
+	for(size_t i=0; i<D; i++)
+		z[i] = est[i] - sqrt_T;
+	return Median(incstate.order, z);
 }
 
 
@@ -118,9 +126,10 @@ twoway_join_agms_safezone::twoway_join_agms_safezone()
 
 twoway_join_agms_safezone::bound::bound() { }
 
-twoway_join_agms_safezone::bound::bound(const projection& _proj, double _T, bool eikonal) 
-: proj(_proj), T(_T), 
-  hat(_proj.size())
+twoway_join_agms_safezone::bound::bound(const projection& _proj, double _T, size_t _K, bool eikonal, double precision) 
+: proj(_proj), T(_T), K(_K), 
+  hat(_proj.size()),
+  zeta_2d(4.0*_T, precision)
 { 
 	zeta_2d.reserve(proj.depth());
 	Median.set_eikonal(eikonal);
@@ -128,28 +137,33 @@ twoway_join_agms_safezone::bound::bound(const projection& _proj, double _T, bool
 
 void twoway_join_agms_safezone::bound::setup(const Vec& norm_xi, const Vec& norm_psi) {
 	Vec zeta_E(proj.depth()); // vector to prepare the median SZ
-	Vec tmp(proj.width());
-
-	for(size_t i=0; i<proj.depth(); i++) {
-		// create the bilinear 2d safe zones 
-		zeta_2d.emplace_back(norm_xi[i], norm_psi[i], 4.0*T);
-
-		// compute the zeta_E vector for the median
-		zeta_E[i] = zeta_2d[i](norm_xi[i], norm_psi[i])*sqrt(0.5);
-
-		// Normalize the hat vector
-		slice I(i*proj.width(), proj.width(), 1);
-		if(norm_xi[i]>0.0) {
-			tmp = norm_xi[i];
-			hat[I] /= tmp;
-		} 
-		else {
-			tmp = 0.0;
-			hat[I] = tmp;
+
+	// create the bilinear 2d safe zones 
+	for(size_t i=0; i<proj.depth(); i++)
+		zeta_2d.push_back(norm_xi[i], norm_psi[i]);
+
+	// Normalize the hat vector, with the rows split among threads
+	const size_t nthreads = par::num_threads(proj.size(), 1<<15);
+	par::for_shards(proj.depth(), nthreads, [&](size_t, size_t a, size_t b) {
+		Vec tmp(proj.width());
+		for(size_t i=a; i<b; i++) {
+			slice I(i*proj.width(), proj.width(), 1);
+			if(norm_xi[i]>0.0) {
+				tmp = norm_xi[i];
+				hat[I] /= tmp;
+			} 
+			else {
+				tmp = 0.0;
+				hat[I] = tmp;
+			}
 		}
-	}
+	});
+
+	// compute the zeta_E vector for the median
+	zeta_2d(&norm_xi[0], &norm_psi[0], &zeta_E[0]);
+	zeta_E *= sqrt(0.5);
 
-	Median.prepare(zeta_E, (proj.depth()+1)/2);
+	Median.prepare(zeta_E, K);
 }
 
 
@@ -159,32 +173,38 @@ double twoway_join_agms_safezone::bound::zeta(incremental_state& inc, const Vec&
     inc.x2 = dot_estvec(proj(x), proj(hat));
     inc.y2 = dot_estvec(proj(y));
     //print(this, "from scratch: x2=",inc.x2,"y2=",inc.y2);
-    return zeta(inc.x2, inc.y2);
+    return zeta(inc);
 }
 
 double twoway_join_agms_safezone::bound::zeta(incremental_state& inc, const delta_vector& dx, const delta_vector& dy)
 {
 	// update inc
-	Vec& x2 = dot_estvec_inc(inc.x2, dx, proj(hat));
-	Vec& y2 = dot_estvec_inc(inc.y2, dy);
-    //print(this, "incremental: x2=",x2,"y2=",y2);
-	return zeta(x2, y2);
+	dot_estvec_inc(inc.x2, dx, proj(hat));
+	dot_estvec_inc(inc.y2, dy);
+    //print(this, "incremental: x2=",inc.x2,"y2=",inc.y2);
+	return zeta(inc);
 }
 
-double twoway_join_agms_safezone::bound::zeta(const Vec& x2, const Vec& y2)
+double twoway_join_agms_safezone::bound::zeta(incremental_state& inc)
 {
-    Vec zeta_X(proj.depth());
-
-    for(size_t i=0; i<proj.depth(); i++)
-    	zeta_X[i] = zeta_2d[i]( x2[i], sqrt(y2[i]) )*sqrt(0.5);
-    return Median(zeta_X);			
+	const Vec& x2 = inc.x2;
+	const Vec& y2 = inc.y2;
+	const size_t d = proj.depth();
+	double y[d], zeta_X[d];
+
+	for(size_t i=0; i<d; i++)
+		y[i] = sqrt(y2[i]);
+	zeta_2d(&x2[0], y, zeta_X);
+	for(size_t i=0; i<d; i++)
+		zeta_X[i] *= sqrt(0.5);
+	return Median(inc.order, zeta_X);
 }
 
 twoway_join_agms_safezone::twoway_join_agms_safezone(const Vec& E, const projection& proj, 
-							double Tlow, double Thigh, bool eikonal)
+							double Tlow, double Thigh, bool eikonal, double precision)
 	: 	D(proj.size()), 
-		lower(proj, Tlow, eikonal), 
-		upper(proj, -Thigh, eikonal)
+		lower(proj, Tlow, proj.lower_quorum(), eikonal, precision), 
+		upper(proj, -Thigh, proj.upper_quorum(), eikonal, precision)
 {
 	assert(E.size() == 2*proj.size());
 	assert(Tlow < Thigh);
@@ -193,18 +213,58 @@ twoway_join_agms_safezone::twoway_join_agms_safezone(const Vec& E, const project
 	slice s1(0, D, 1);
 	slice s2(D, D, 1);
 
-	lower.hat = E[s1] + E[s2];
-	upper.hat = E[s1] - E[s2];
+	xE = E[s1] + E[s2];
+	yE = E[s1] - E[s2];
+	lower.hat = xE;
+	upper.hat = yE;
 
 	// Initialize the upper and lower bound safe zone data
-	Vec norm_lower =  sqrt(dot_estvec(proj(lower.hat)));
-	Vec norm_upper = sqrt(dot_estvec(proj(upper.hat)));
+	Vec norm_lower =  sqrt(parallel_dot_estvec(proj(lower.hat)));
+	Vec norm_upper = sqrt(parallel_dot_estvec(proj(upper.hat)));
 
 	lower.setup(norm_lower, norm_upper);
 	upper.setup(norm_upper, norm_lower);
 }
 
 
+/*
+	Restore the elements of x,y recorded since a checkpoint, and clear
+	the records.
+  */
+static void revert_changes(twoway_join_agms_safezone::incremental_state& inc)
+{
+	auto& undo = inc.undo;
+	auto& x = inc.x.values();
+	auto& y = inc.y.values();
+	for(auto e = undo.dx.rbegin(); e != undo.dx.rend(); ++e)
+		x[e->first] = e->second;
+	for(auto e = undo.dy.rbegin(); e != undo.dy.rend(); ++e)
+		y[e->first] = e->second;
+	inc.x.untouch_since(undo.xmark);
+	inc.y.untouch_since(undo.ymark);
+	undo.dx.clear();
+	undo.dy.clear();
+}
+
+
+/*
+	Store into u the drift x - xE, touching its non-zero elements only.
+	Then, x is set to xE + u, the value seen by the incremental updates.
+  */
+static void set_drift(basic_touched_vector<drift_counter>& u, Vec& x, const Vec& xE)
+{
+	auto& uval = u.values();
+	for(size_t i=0; i<x.size(); i++) {
+		const drift_counter d = x[i] - xE[i];
+		if(d != 0) {
+			uval[i] = d;
+			u.touch(i);
+		}
+		x[i] = xE[i] + d;
+	}
+}
+
+
 double twoway_join_agms_safezone::with_inc(incremental_state& inc, const Vec& U)
 {
 	assert(U.size() == 2*D);
@@ -213,14 +273,30 @@ double twoway_join_agms_safezone::with_inc(incremental_state& inc, const Vec& U)
 	slice s1(0, D, 1);
 	slice s2(D, D, 1);
 
-    inc.x = U[s1] + U[s2];
-    inc.y = U[s1] - U[s2];
+    Vec x = U[s1] + U[s2];
+    Vec y = U[s1] - U[s2];
+    if(inc.undo.active && !inc.undo.full) {
+    	// all of x,y change; keep their values at the checkpoint aside
+    	revert_changes(inc);
+    	std::swap(inc.x, inc.undo.x0);
+    	std::swap(inc.y, inc.undo.y0);
+    	inc.undo.full = true;
+    }
+    if(inc.x.size() != D) {
+    	inc.x = basic_touched_vector<drift_counter>(D);
+    	inc.y = basic_touched_vector<drift_counter>(D);
+    } else {
+    	inc.x.clear();
+    	inc.y.clear();
+    }
+    set_drift(inc.x, x, xE);
+    set_drift(inc.y, y, yE);
 
     // Compute zeta of lower bound
-    double zeta_lower = lower.zeta(inc.lower, inc.x, inc.y);
+    double zeta_lower = lower.zeta(inc.lower, x, y);
 
     // Compute zeta of upper bound
-    double zeta_upper = upper.zeta(inc.upper, inc.y, inc.x);
+    double zeta_upper = upper.zeta(inc.upper, y, x);
 
     //binc::print("fromscratch zlower=",zeta_lower,"zupper",zeta_upper);
     return min(zeta_lower, zeta_upper);
@@ -235,22 +311,97 @@ double twoway_join_agms_safezone::operator()(const Vec& X)
 }
 
 
-double twoway_join_agms_safezone::inc(incremental_state& incstate, const delta_vector& DX)
+/*
+	Apply the polarized delta dx to the drift u from xE. The new drift is 
+	stored into u, and dx is rebased on xE + u, with the stored value as 
+	the new one. If log is not null, the old values of the changed elements 
+	are appended to it.
+  */
+static void apply_drift(basic_touched_vector<drift_counter>& u, delta_vector& dx, 
+	const Vec& xE, std::vector<std::pair<size_t, drift_counter>>* log)
 {
-	// Polarize the delta
-	delta_vector DX1 = DX[DX.index < D];
-	delta_vector DX2 = DX[DX.index >= D];
-	DX2.index -= D;
+	auto& uval = u.values();
+	for(size_t i=0; i<dx.size(); i++) {
+		const size_t k = dx.index[i];
+		if(log) log->emplace_back(k, uval[k]);
+		const drift_counter unew = uval[k] + (dx.xnew[i] - dx.xold[i]);
+		dx.xold[i] = xE[k] + uval[k];
+		dx.xnew[i] = xE[k] + unew;
+		uval[k] = unew;
+		u.touch(k);
+	}
+}
 
-	delta_vector dx = DX1+DX2;
-	delta_vector dy = DX1-DX2;
 
-	dx.rebase(incstate.x);
-	dy.rebase(incstate.y);
+/*
+	Compute into res the delta of x1 + sign*x2, from the delta DX of the 
+	concatenation of x1 and x2 (each of size D). The first n1 entries 
+	of DX are those of x1.
 
-	// update the polarization incstate
-	incstate.x[dx.index] = dx.xnew;
-	incstate.y[dy.index] = dy.xnew;
+	This is combine_deltas on the two halves of DX, without copying them
+	out. The storage of res is reused when the size of the result does not 
+	change; in particular, when each update changes only one sketch.
+  */
+static void polarize_delta(delta_vector& res, const delta_vector& DX, 
+	size_t n1, size_t D, double sign)
+{
+	const size_t n = DX.size();
+
+	// count the combined indices
+	size_t j=0;
+	size_t i1=0, i2=n1;
+	while(i1 < n1 && i2 < n) {
+		const size_t k2 = DX.index[i2]-D;
+		if(DX.index[i1] < k2) i1++;
+		else if(DX.index[i1] > k2) i2++;
+		else { i1++; i2++; }
+		j++;
+	}
+	j += (n1-i1) + (n-i2);
+	res.resize(j);
+
+	j=0; i1=0; i2=n1;
+	while(i1 < n1 || i2 < n) {
+		const size_t k1 = (i1<n1) ? DX.index[i1] : SIZE_MAX;
+		const size_t k2 = (i2<n) ? DX.index[i2]-D : SIZE_MAX;
+		if(k1 < k2) {
+			res.index[j] = k1;
+			res.xold[j] = DX.xold[i1];
+			res.xnew[j] = DX.xnew[i1];
+			i1++;
+		} else if(k1 > k2) {
+			res.index[j] = k2;
+			res.xold[j] = sign*DX.xold[i2];
+			res.xnew[j] = sign*DX.xnew[i2];
+			i2++;
+		} else {
+			res.index[j] = k1;
+			res.xold[j] = DX.xold[i1] + sign*DX.xold[i2];
+			res.xnew[j] = DX.xnew[i1] + sign*DX.xnew[i2];
+			i1++; i2++;
+		}
+		j++;
+	}
+	assert(j == res.size());
+}
+
+
+double twoway_join_agms_safezone::inc(incremental_state& incstate, const delta_vector& DX)
+{
+	// Polarize the delta. Since DX.index is sorted, the entries of 
+	// the first sketch come first.
+	const size_t n1 = std::lower_bound(begin(DX.index), end(DX.index), D) - begin(DX.index);
+
+	delta_vector& dx = incstate.dx;
+	delta_vector& dy = incstate.dy;
+	polarize_delta(dx, DX, n1, D, 1.0);
+	polarize_delta(dy, DX, n1, D, -1.0);
+
+	// update the polarized drift; the deltas take the stored values
+	auto& undo = incstate.undo;
+	const bool logged = undo.active && !undo.full;
+	apply_drift(incstate.x, dx, xE, logged ? &undo.dx : nullptr);
+	apply_drift(incstate.y, dy, yE, logged ? &undo.dy : nullptr);
 
     // Compute zeta of lower bound
     double zeta_lower = lower.zeta(incstate.lower, dx, dy);
@@ -262,4 +413,57 @@ double twoway_join_agms_safezone::inc(incremental_state& incstate, const delta_v
 }
 
 
+void incstate_checkpoint<twoway_join_agms_safezone::incremental_state>
+	::checkpoint(state& chk, state& inc)
+{
+	assert(!inc.undo.active);
+	chk.lower = inc.lower;
+	chk.upper = inc.upper;
+	inc.undo.xmark = inc.x.touch_state();
+	inc.undo.ymark = inc.y.touch_state();
+	inc.undo.active = true;
+}
+
+
+void incstate_checkpoint<twoway_join_agms_safezone::incremental_state>
+	::rollback(state& inc, state& chk)
+{
+	if(inc.undo.full) {
+		std::swap(inc.x, inc.undo.x0);
+		std::swap(inc.y, inc.undo.y0);
+	} else
+		revert_changes(inc);
+	inc.lower = chk.lower;
+	inc.upper = chk.upper;
+	commit(inc, chk);
+}
+
+
+void incstate_checkpoint<twoway_join_agms_safezone::incremental_state>
+	::commit(state& inc, state&)
+{
+	auto& undo = inc.undo;
+	undo.dx.clear();
+	undo.dy.clear();
+	undo.active = undo.full = false;
+}
+
+
+void incstate_reset<twoway_join_agms_safezone::incremental_state>
+	::reset(state& inc, const state& zero)
+{
+	assert(zero.x.is_zero() && zero.y.is_zero());
+	if(inc.x.size() != zero.x.size()) {
+		inc.x = basic_touched_vector<drift_counter>(zero.x.size());
+		inc.y = basic_touched_vector<drift_counter>(zero.y.size());
+	} else {
+		inc.x.clear();
+		inc.y.clear();
+	}
+	inc.lower = zero.lower;
+	inc.upper = zero.upper;
+	incstate_checkpoint<state>::commit(inc, inc);
+}
+
+
 
@@ -2,6 +2,7 @@
 #define __SAFEZONE_HH__
 
 #include "agms.hh"
+#include "gm_szone.hh"
 #include "sz_quorum.hh"
 #include "sz_bilinear.hh"
 
@@ -34,7 +35,8 @@ using namespace agms;
 	as the safe zone for each individual condition \f$ X_i^2 \leq T\f$.
 
 	The overall safe zone is defined as the median quorum over these
-	values.
+	values. For the Count-Min family, where the estimate is the minimum,
+	the quorum is 1 (see \c projection::upper_quorum).
 
   */
 struct selfjoin_agms_safezone_upper_bound 
@@ -43,7 +45,12 @@ struct selfjoin_agms_safezone_upper_bound
 	projection proj;
 	quorum_safezone Median;
 
-	typedef Vec incremental_state;
+	/// The incremental state: the self-join estimates, plus scratch space
+	struct incremental_state {
+		Vec est;	// the estimates of the rows
+		Vec z;		// the row zetas
+		quorum_safezone::incremental_state order; // the order of the row zetas
+	};
 
 	selfjoin_agms_safezone_upper_bound() {}
 
@@ -51,8 +58,8 @@ struct selfjoin_agms_safezone_upper_bound
 	selfjoin_agms_safezone_upper_bound(const sketch_view<Iter>& E, double T, bool eikonal) 
 	: 	sqrt_T(sqrt(T)), proj(E.proj), Median()
 	{
-		Vec dest = sqrt(dot_estvec(E));
-		Median.prepare(sqrt_T - dest , (E.depth()+1)/2 );
+		Vec dest = sqrt(parallel_dot_estvec(E));
+		Median.prepare(sqrt_T - dest , E.proj.upper_quorum() );
 		Median.set_eikonal(eikonal);
 	}
 
@@ -87,7 +94,8 @@ struct selfjoin_agms_safezone_upper_bound
 	as the safe zone for each individual condition \f$ X_i^2 \geq T\f$.
 
 	The overall safe zone is defined as the median quorum over these
-	values.
+	values. For the Count-Min family, where the estimate is the minimum,
+	the quorum is \f$ D \f$ (see \c projection::lower_quorum).
 
 	Note: if \f$ T\leq 0\f$, the function returns \f$+\infty \f$. 
 
@@ -99,7 +107,12 @@ struct selfjoin_agms_safezone_lower_bound
 
 	quorum_safezone Median;  //  the median
 
-	typedef Vec incremental_state;
+	/// The incremental state: the row projections on Ehat, plus scratch space
+	struct incremental_state {
+		Vec est;	// the projections of the rows
+		Vec z;		// the row zetas
+		quorum_safezone::incremental_state order; // the order of the row zetas
+	};
 
 	selfjoin_agms_safezone_lower_bound() {}
 
@@ -110,23 +123,27 @@ struct selfjoin_agms_safezone_lower_bound
 		//  If T <= 0.0, the function returns +inf
 		if(sqrt_T>0.0) {
 
-			Vec dest = sqrt(dot_estvec(E));
-			Median.prepare( dest - sqrt_T, (E.depth()+1)/2);
+			Vec dest = sqrt(parallel_dot_estvec(E));
+			Median.prepare( dest - sqrt_T, E.proj.lower_quorum());
 			Median.set_eikonal(eikonal);
 
 			//
-			// Normalize E: divide each row  E_i by ||E_i||
+			// Normalize E: divide each row  E_i by ||E_i||, 
+			// with the rows split among threads
 			//
 			size_t L = E.width();
-			for(size_t d=0; d<E.depth(); d++) {
-				if(dest[d]>0.0)  {
-					// Note: this is an aliased assignment, but should
-					// be ok, because it is pointwise aliased!
-					Vec tmp = Ehat[slice(d*L,L,1)];
-					Ehat[slice(d*L,L,1)] = tmp/dest[d];
+			size_t nthreads = par::num_threads(E.size(), 1<<15);
+			par::for_shards(E.depth(), nthreads, [&](size_t, size_t a, size_t b) {
+				for(size_t d=a; d<b; d++) {
+					if(dest[d]>0.0)  {
+						// Note: this is an aliased assignment, but should
+						// be ok, because it is pointwise aliased!
+						Vec tmp = Ehat[slice(d*L,L,1)];
+						Ehat[slice(d*L,L,1)] = tmp/dest[d];
+					}
+					// else, if dest[d]==0, then Ehat[slice(d)] == 0! leave it
 				}
-				// else, if dest[d]==0, then Ehat[slice(d)] == 0! leave it
-			}
+			});
 		}
 		// else, the function returns INFINITY
 	}
@@ -243,8 +260,9 @@ struct twoway_join_agms_safezone
 	struct bound {
 		projection proj;		/// The projection
 		double T;				/// The threshold
+		size_t K;				/// The quorum size
 		Vec hat;				/// \f$ \hat{\xi}\f$
-		vector<bilinear_2d_safe_zone> zeta_2d; /// d-array of 2-dimensional bilinear safe zones
+		bilinear_2d_safe_zone_array zeta_2d; /// d-array of 2-dimensional bilinear safe zones
 		quorum_safezone Median;	/// median quorum
 
 		/**
@@ -254,13 +272,14 @@ struct twoway_join_agms_safezone
 		  */
 		struct incremental_state {
 			Vec x2, y2;
+			quorum_safezone::incremental_state order; // the order of the row zetas
 		};
 
 		/// Used to implement uninitialized objects
 		bound();
 
-		/// Initialize properly
-		bound(const projection& _proj, double _T, bool eikonal);
+		/// Initialize properly, for a quorum of \c _K rows
+		bound(const projection& _proj, double _T, size_t _K, bool eikonal, double precision);
 
 		/// Called during initialization
 		void setup(const Vec& norm_xi, const Vec& norm_psi);
@@ -271,12 +290,13 @@ struct twoway_join_agms_safezone
 		/// Compute incrementally
 		double zeta(incremental_state& inc, const delta_vector& dx, const delta_vector& dy);
 
-		/// Computes the safezone of the median of the 2-d safe zone functions
-		double zeta(const Vec& x2, const Vec& y2);
+		/// Computes the safezone of the median of the 2-d safe zone functions on \c inc.x2, \c inc.y2
+		double zeta(incremental_state& inc);
 	};
 
 	size_t D;			//< The sketch size
 	bound lower, upper;	//< The bounds objects
+	Vec xE, yE;			//< The polarized reference vector
 
 	/**
 		Construct a safe zone function object.
@@ -286,9 +306,10 @@ struct twoway_join_agms_safezone
 		@param Tlow the lower bound
 		@param Thigh the upper bound
 		@param eikonal select an eikonal or non-eikonal (faster) function
+		@param precision the relative accuracy of the hyperbola distances
 	  */
 	twoway_join_agms_safezone(const Vec& E, const projection& proj, 
-								double Tlow, double Thigh, bool eikonal);
+								double Tlow, double Thigh, bool eikonal, double precision=1.E-13);
 
 	/// Move assignment
 	twoway_join_agms_safezone& operator=(twoway_join_agms_safezone&&)=default;
@@ -296,10 +317,23 @@ struct twoway_join_agms_safezone
 
 	struct incremental_state
 	{ 
-		/// these are used for incremental polarization
-		Vec x,y;
+		/// The polarization of the input, minus the polarized reference
+		/// vector \c xE,yE. It is zero at the start of a round, and it
+		/// is kept as drift (see \c drift_counter)
+		basic_touched_vector<drift_counter> x,y;
+		/// scratch deltas of the polarization, reused by \c inc
+		delta_vector dx, dy;
 		/// These are used for the bounds 
 		struct bound::incremental_state lower, upper;
+
+		/// While checkpointed, the old values of \c x,y (see \c incstate_checkpoint)
+		struct journal {
+			bool active = false;
+			bool full = false;		// x,y were recomputed, the old ones are x0,y0
+			std::vector<std::pair<size_t, drift_counter>> dx, dy;
+			basic_touched_vector<drift_counter>::touch_mark xmark, ymark;
+			basic_touched_vector<drift_counter> x0, y0;
+		} undo;
 	};
 
 
@@ -334,6 +368,38 @@ struct twoway_join_agms_safezone
 };
 
 
+/**
+	The incremental state of the two-way join safe zone holds the polarized
+	drift, of the size of the state vector. It is checkpointed by recording
+	the old values of the elements changed by \c inc, as the drift vectors
+	of a site are (see \c undo_log). The other members are small, and are 
+	copied.
+  */
+template <>
+struct incstate_checkpoint<twoway_join_agms_safezone::incremental_state>
+{
+	typedef twoway_join_agms_safezone::incremental_state state;
+	static void checkpoint(state& chk, state& inc);
+	static void rollback(state& inc, state& chk);
+	static void commit(state& inc, state& chk);
+};
+
+
+/**
+	At the zero drift, the polarized drift of the two-way join safe zone
+	is zero. Therefore, the incremental state is reset by clearing it,
+	which takes time proportional to the elements touched in the last
+	round, and copying the state of the bounds, which is of the size
+	of the sketch depth.
+  */
+template <>
+struct incstate_reset<twoway_join_agms_safezone::incremental_state>
+{
+	typedef twoway_join_agms_safezone::incremental_state state;
+	static void reset(state& inc, const state& zero);
+};
+
+
 
 } // end namespace gm
 
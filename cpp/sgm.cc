@@ -29,9 +29,10 @@ oneway node::reset(const safezone& newsz)
 	szone = newsz;
 
 	// reset the drift vector
-	U = 0.0;
+	U.clear();
 	update_count = 0;
-	zeta = szone(U);
+	zeta = szone.zero(U);
+	lazy.reset(zeta);
 
 	// reset round statistics
 	round_local_updates = 0;
@@ -41,9 +42,10 @@ oneway node::reset(const safezone& newsz)
 compressed_state_ref node::get_drift() 
 {
 	// getting the drift vector is done as getting the local statistic
+	sync_zeta();
 	size_t upd = update_count;
 	update_count = 0;
-	return compressed_state_ref { U, upd };
+	return compressed_state_ref { U, upd, Q->config.codec };
 }
 
 void node::set_drift(compressed_state_ref newU) 
@@ -51,6 +53,7 @@ void node::set_drift(compressed_state_ref newU)
 	U = newU.vec;
 	// we do not change the update count update_count = newU.updates;
 	zeta = szone(U);
+	lazy.reset(zeta);
 	assert(zeta>0);
 }
 
@@ -58,17 +61,69 @@ void node::set_drift(compressed_state_ref newU)
 void node::update_stream() 
 {
 	assert(CTX.stream_record().hid == site_id());
+	if(update_local(CTX.stream_record()))
+		notify_coordinator();
+}
+
 
-	delta_vector delta = Q->delta_update(U, CTX.stream_record());
-	if(delta.size()==0) return;
+bool node::update_local(const dds_record& rec)
+{
+	if(! Q->delta_update(delta, U.values(), rec)) return false;
+	undo.save(U, delta.index, delta.xold);
+	U.touch(delta.index);
 
 	update_count++;
 	round_local_updates++;
 
-	zeta = szone(delta, U);
+	zeta = lazy.update(zeta, delta, 1.0,
+		[](double z) { return z > 0; },
+		[&]() { return szone(U); },
+		[&]() { return szone(delta, U); });
+
+	return zeta <= 0;
+}
+
+
+void node::notify_coordinator()
+{
+	coord.local_violation(this);
+}
+
+
+void node::checkpoint()
+{
+	saved.zeta = zeta;
+	saved.update_count = update_count;
+	saved.round_local_updates = round_local_updates;
+	saved.lazy = lazy;
+	szone.save_state(saved.szone);
+	undo.start();
+}
+
+
+void node::commit()
+{
+	undo.commit();
+	szone.commit_state(saved.szone);
+	saved.szone = safezone();
+}
 
-	if(zeta <= 0)
-		coord.local_violation(this);
+
+void node::rollback()
+{
+	undo.rollback();
+	zeta = saved.zeta;
+	update_count = saved.update_count;
+	round_local_updates = saved.round_local_updates;
+	lazy = saved.lazy;
+	szone.restore_state(saved.szone);
+	saved.szone = safezone();
+}
+
+
+void node::sync_zeta()
+{
+	zeta = lazy.sync(zeta, [&]() { return szone(U); });
 }
 
 
@@ -88,10 +143,11 @@ void node::setup_connections()
 
 void coordinator::start_round()
 {
+	safe_zone->begin_round();
 
 	for(auto n : net()->sites) {
 		sz_sent ++;
-		proxy[n].reset(safezone(safe_zone));
+		proxy[n].reset(safezone(safe_zone, cfg().codec));
 	}
 
 	round_total_B = 0;
@@ -145,7 +201,7 @@ oneway coordinator::local_violation(sender<node_t> ctx)
 void coordinator::fetch_updates(node_t* node)
 {
 	compressed_state_ref cs = proxy[node].get_drift();
-	Ubal += cs.vec;
+	cs.add_to(Ubal);
 	Ubal_updates += cs.updates;	
 	total_updates += cs.updates;
 }
@@ -297,7 +353,7 @@ void coordinator::rebalance()
 
 	assert(query->compute_zeta(Ubal) > 0);
 
-	compressed_state_ref sbal { Ubal, Ubal_updates };
+	compressed_state_ref sbal { Ubal, Ubal_updates, cfg().codec };
 
 	for(auto n : B) {
 		proxy[n].set_drift(sbal);
@@ -317,10 +373,15 @@ void coordinator::rebalance()
 
 void coordinator::finish_round()
 {
-	// collect all data
+	// collect all data, and add it up in parallel
+	vector<compressed_state_ref> drifts;
+	drifts.reserve(Bcompl.size());
 	for(auto n : Bcompl) {
-		fetch_updates(n);
+		drifts.push_back(proxy[n].get_drift());
+		Ubal_updates += drifts.back().updates;
+		total_updates += drifts.back().updates;
 	}
+	add_states(Ubal, drifts);
 	Ubal /= (double)k;
 
 #if 0
@@ -370,8 +431,7 @@ void coordinator::warmup()
 {
 	Vec dE(Q->state_vector_size());
 
-	for(auto&& rec : CTX.warmup) 
-		Q->update(dE, rec);
+	Q->update_all(dE, CTX.warmup);
 
 	query->update_estimate(dE/(double)k);
 }
@@ -158,11 +158,22 @@ struct node : local_site
 
 	double zeta;			// current zeta 
 
-	Vec U;					// drift vector
+	touched_vector U;		// drift vector
+	delta_vector delta;			// the delta of the last stream update (reused)
+	lazy_zeta lazy;			// lazy safe zone evaluation
 	size_t update_count;	// number of updates in drift vector
 
 	size_t round_local_updates; // number of local stream updates since last reset
 
+	// Speculative execution (see gm_network)
+	undo_log undo;				// the changes to U
+	struct saved_state {
+		double zeta;
+		size_t update_count, round_local_updates;
+		lazy_zeta lazy;
+		safezone szone;
+	} saved;
+
 	coord_proxy_t coord;
 
 	node(network_t* net, source_id hid, continuous_query* _Q)
@@ -171,12 +182,27 @@ struct node : local_site
 		coord( this )
 	{ 
 		coord <<= net->hub;
+		lazy.set_mode(Q->config.lazy_zeta);
 	}
 
 	void setup_connections() override;
 
 	void update_stream();
 
+	// process a record locally, return true if the coordinator must be notified
+	bool update_local(const dds_record& rec);
+
+	// notify the coordinator, after update_local() returned true
+	void notify_coordinator();
+
+	// speculative execution
+	void checkpoint();
+	void commit();
+	void rollback();
+
+	// bring zeta up to date, if evaluations were skipped
+	void sync_zeta();
+
 	//
 	// Remote methods
 	//
@@ -14,9 +14,15 @@ using namespace gm;
 /////////////////////////////////////////////////////////
 
 
-#define USE_BISECTION 0
-
-#if USE_BISECTION==1
+/*
+	Select the root finder used by the scalar hyperbola_nearest_neighbor.
+	0: safeguarded Newton (the same kernel as the batched version)
+	1: bisection
+	2: TOMS 748 (boost)
+ */
+#define HYPERBOLA_SOLVER 0
+
+#if HYPERBOLA_SOLVER==1
 static double __bisection(double p, double q, double T, double epsilon)
 {
 	/*  Precondition: T>0  and  p,q != 0.0 
@@ -50,7 +56,7 @@ static double __bisection(double p, double q, double T, double epsilon)
 #undef g
 }
 
-#else
+#elif HYPERBOLA_SOLVER==2
 
 static double __toms_748(double p, double q, double T, double epsilon)
 {
@@ -59,7 +65,6 @@ static double __toms_748(double p, double q, double T, double epsilon)
         This is much faster than bisection.
 	*/
 	using boost::math::tools::toms748_solve;
-	using boost::math::tools::newton_raphson_iterate;
 	using boost::math::tools::eps_tolerance;
 
 	auto g = [p,q,T](double x) { return 2.-p/x - q/sqrt(sq(x)+T); };
@@ -88,6 +93,96 @@ static double __toms_748(double p, double q, double T, double epsilon)
 }
 #endif
 
+
+/*
+	Direct solutions for the special cases T==0 and p==0.
+ */
+static inline double __hyperbola_T0(double p, double q)
+{
+	if(p<0.0) 
+		return (q<=p) ? 0.0 : 0.5*(p-q);
+	else
+		return (q<=-p) ? 0.0 : 0.5*(p+q);
+}
+
+static inline double __hyperbola_p0(double q, double T)
+{
+	return (q > 2.*sqrt(T)) ? sqrt(sq(q/2)-T) : 0.;
+}
+
+
+/*
+	Safeguarded Newton iteration on all n points in lockstep.
+
+	Precondition: T>0.
+
+	By symmetry, we solve for \( t=|x| \), i.e., we find the root of 
+	\[ g(t) = 2 - a/t - q/\sqrt{t^2+T} \] 
+	with \( a = |p| \), on the bracket
+	\[ \frac{a}{2.1+|q|/\sqrt{T}} \leq t \leq 0.51(a+\max(0,q)). \]
+	Each step updates the bracket with the sign of \(g\) and takes the Newton
+	step if it falls strictly inside the bracket, else it bisects. The loop body
+	has no data-dependent branches (the selections compile to blends), so
+	that it vectorizes over the points. The iteration stops when the last
+	step of every point is below \( \epsilon t \), or after 50 rounds.
+
+	Points with p==0 are solved on a dummy lane and patched at the end.
+	The points are processed in chunks of NEWTON_LANES, so that the 
+	scratch arrays have a fixed size.
+ */
+static constexpr size_t NEWTON_LANES = 64;
+
+static void __newton_chunk(const double* p, const double* q, double T, double* xi, size_t n, double epsilon)
+{
+	assert(n <= NEWTON_LANES);
+	const double sqrtT = sqrt(T);
+	double a[NEWTON_LANES], b[NEWTON_LANES], lo[NEWTON_LANES], hi[NEWTON_LANES], t[NEWTON_LANES];
+
+	for(size_t i=0; i<n; i++) {
+		const bool dummy = (p[i]==0.0);
+		a[i] = dummy ? 1.0 : fabs(p[i]);
+		b[i] = dummy ? 0.0 : q[i];
+		lo[i] = a[i]/(2.1+fabs(b[i])/sqrtT);
+		hi[i] = 0.51*(a[i]+std::max(0.0, b[i]));
+		t[i] = 0.5*(lo[i]+hi[i]);
+	}
+
+	for(size_t loops=0; loops<50; loops++) {
+		size_t active = 0;
+		for(size_t i=0; i<n; i++) {
+			const double ti = t[i];
+			const double y = sqrt(ti*ti+T);
+			const double g = 2. - a[i]/ti - b[i]/y;
+			const double dg = a[i]/(ti*ti) + b[i]*ti/(y*y*y);
+
+			lo[i] = (g<0.0) ? ti : lo[i];
+			hi[i] = (g>0.0) ? ti : hi[i];
+
+			double tn = ti - g/dg;
+			tn = (tn>lo[i] && tn<hi[i]) ? tn : 0.5*(lo[i]+hi[i]);
+			active += (fabs(tn-ti) >= epsilon*tn);
+			t[i] = tn;
+		}
+		if(active==0) break;
+	}
+
+	for(size_t i=0; i<n; i++) {
+		if(p[i]==0.0)
+			xi[i] = __hyperbola_p0(q[i], T);
+		else if(q[i]==0.0)
+			xi[i] = p[i]/2.;
+		else
+			xi[i] = copysign(t[i], p[i]);
+	}
+}
+
+static void __newton(const double* p, const double* q, double T, double* xi, size_t n, double epsilon)
+{
+	for(size_t i=0; i<n; i+=NEWTON_LANES)
+		__newton_chunk(p+i, q+i, T, xi+i, std::min(NEWTON_LANES, n-i), epsilon);
+}
+
+
 double gm::hyperbola_nearest_neighbor(double p, double q, double T, double epsilon)
 {
 	/*
@@ -116,37 +211,44 @@ double gm::hyperbola_nearest_neighbor(double p, double q, double T, double epsil
 		\( (\sqrt{(q/2)^2 - T}, q/2)\), and for \( q\leq 2\sqrt{T} \), the answer is \( (0, \sqrt{T}) \).
 	*/
 
-	using std::max;
-
 	if(T<0)
 		throw std::invalid_argument("call to hyperbola_nearest_neighbor with T<0");
 
-	if(T==0.0) {
-		// Direct solution
-		if(p<0.0) 
-			return (q<=p) ? 0.0 : 0.5*(p-q);
-		else
-			return (q<=-p) ? 0.0 : 0.5*(p+q);
-	}
+	if(T==0.0) 
+		return __hyperbola_T0(p, q);
 
-	if(p==0.0) {
-		if(q > 2.*sqrt(T))
-			return sqrt(sq(q/2)-T);
-		else
-			return 0.;
-	}
+	if(p==0.0) 
+		return __hyperbola_p0(q, T);
 	if(q==0.0)
 		return p/2.;
 
-#if USE_BISECTION==1
+#if HYPERBOLA_SOLVER==1
 	return __bisection(p, q, T, epsilon);
-#else
+#elif HYPERBOLA_SOLVER==2
 	return __toms_748(p, q, T, epsilon);
+#else
+	double xi;
+	__newton(&p, &q, T, &xi, 1, epsilon);
+	return xi;
 #endif
 
 }
 
 
+void gm::hyperbola_nearest_neighbor(const double* p, const double* q, double T, 
+	double* xi, size_t n, double epsilon)
+{
+	if(T<0)
+		throw std::invalid_argument("call to hyperbola_nearest_neighbor with T<0");
+
+	if(T==0.0) {
+		for(size_t i=0; i<n; i++)
+			xi[i] = __hyperbola_T0(p[i], q[i]);
+	} else
+		__newton(p, q, T, xi, n, epsilon);
+}
+
+
 /////////////////////////////////////////////////////////
 //
 //  bilinear 2d safe zone
@@ -156,8 +258,8 @@ double gm::hyperbola_nearest_neighbor(double p, double q, double T, double epsil
 bilinear_2d_safe_zone::bilinear_2d_safe_zone() 
 {}
 
-bilinear_2d_safe_zone::bilinear_2d_safe_zone(double xi, double psi, double _T)
-	: 	T(_T), 
+bilinear_2d_safe_zone::bilinear_2d_safe_zone(double xi, double psi, double _T, double _epsilon)
+	: 	epsilon(_epsilon), T(_T), 
 		xihat(sgn(xi)), //xihat(xi>=0.0 ? 1: -1), 
 		u(0.0), v(0.0)
 {
@@ -199,6 +301,70 @@ double bilinear_2d_safe_zone::operator()(double x, double y) const
 }
 
 
+/////////////////////////////////////////////////////////
+//
+//  array of bilinear 2d safe zones
+//
+/////////////////////////////////////////////////////////
+
+bilinear_2d_safe_zone_array::bilinear_2d_safe_zone_array()
+{}
+
+bilinear_2d_safe_zone_array::bilinear_2d_safe_zone_array(double _T, double _epsilon)
+	: epsilon(_epsilon), T(_T)
+{}
+
+void bilinear_2d_safe_zone_array::reserve(size_t n)
+{
+	xihat.reserve(n);
+	u.reserve(n);
+	v.reserve(n);
+	c.reserve(n);
+}
+
+void bilinear_2d_safe_zone_array::push_back(double xi, double psi)
+{
+	bilinear_2d_safe_zone sz(xi, psi, T, epsilon);
+	xihat.push_back(sz.xihat);
+	u.push_back(sz.u);
+	v.push_back(sz.v);
+	c.push_back(sz.T);
+}
+
+void bilinear_2d_safe_zone_array::operator()(const double* x, const double* y, double* zeta) const
+{
+	const size_t n = size();
+
+	if(T>0) {
+		// the signed distance function of the set $\{ x >= \sqrt{y^2+T} \}$, for all n,
+		// in chunks of fixed size
+		constexpr size_t chunk = 64;
+		double x_xihat[chunk];
+		for(size_t j=0; j<n; j+=chunk) {
+			const size_t m = std::min(chunk, n-j);
+			const double* yj = y+j;
+			double* zj = zeta+j;
+			for(size_t i=0; i<m; i++)
+				x_xihat[i] = x[j+i]*xihat[j+i];
+
+			hyperbola_nearest_neighbor(yj, x_xihat, T, zj, m, epsilon);
+
+			for(size_t i=0; i<m; i++) {
+				const double vi = zj[i];
+				const double ui = sqrt(sq(vi)+T);
+				const double delta = x_xihat[i] - sqrt(sq(yj[i])+T);
+				const double sgn_delta = (delta>0.0) - (delta<0.0);
+				zj[i] = sgn_delta*sqrt(sq(x_xihat[i] - ui) + sq(yj[i] - vi));
+			}
+		}
+	} 
+	else {
+		for(size_t i=0; i<n; i++)
+			zeta[i] = u[i]*x[i] - v[i]*fabs(y[i]) - c[i];
+	}
+}
+
+
 /////////////////////////////////////////////////////////
 //
 //  inner product safe zone
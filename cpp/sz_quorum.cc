@@ -1,6 +1,9 @@
 
 #include <vector>
 #include <cassert>
+#include <cmath>
+#include <numeric>
+#include <algorithm>
 
 #include "binc.hh"
 #include "sz_quorum.hh"
@@ -18,9 +21,9 @@ quorum_safezone::quorum_safezone()
 { }
 
 quorum_safezone::quorum_safezone(const Vec& zE, size_t _k, bool _eik) 
+	: eikonal(_eik)
 {
 	prepare(zE, _k);
-	set_eikonal(_eik);
 }
 
 
@@ -45,6 +48,20 @@ void quorum_safezone::prepare(const Vec& zE, size_t _k)
 	if(L.size()<k) {
 		throw std::length_error(binc::sprint("The reference vector is non-admissible:",zE));
 	}
+
+	// the eikonal function needs the cache; prepare it here, so that
+	// evaluation is read-only
+	z_cached.resize(0);
+	if(eikonal) prepare_z_cache();
+}
+
+
+void quorum_safezone::set_eikonal(bool _eik)
+{
+	eikonal = _eik;
+	// if already prepared, make sure the cache exists
+	if(eikonal && L.size()>0 && z_cached.size()==0)
+		prepare_z_cache();
 }
 
 
@@ -87,13 +104,22 @@ void quorum_safezone::prepare_z_cache()
 		// For larger l, just cache $\zeta(E_i)^2$ (saving us some multiplications)
 		z_cached = zetaE*zetaE;
 	}	
+
+	// count the clauses, saturating at max_exact_clauses+1
+	size_t l = L.size();
+	size_t m = l-k+1;
+	num_clauses = 1;
+	for(size_t i=1; i<=l-m; i++) {
+		num_clauses = (num_clauses*(m+i))/i;
+		if(num_clauses > max_exact_clauses) { num_clauses = max_exact_clauses+1; break; }
+	}
 }
 
 
 // This recursion is used to compute zinf, when the cached array is just $\zeta(E_i)^2$.
 // The recursion performs 2C additions, C divisions, C square roots and C comparisons,
 // where C = (l choose m)
-static double find_min(size_t m, size_t l, size_t b, const Vec& zEzX, const Vec& zE2, double SzEzX, double SzE2)
+static double find_min(size_t m, size_t l, size_t b, const double* zEzX, const double* zE2, double SzEzX, double SzE2)
 {
 	if(m==0) return SzEzX/sqrt(SzE2);
 
@@ -108,11 +134,91 @@ static double find_min(size_t m, size_t l, size_t b, const Vec& zEzX, const Vec&
 	return zinf;
 }
 
+// The minimum of (a0+s*da)/sqrt(b0+s*db) for s in [0,1], where b0, b0+db > 0.
+// The derivative vanishes at s = (a0*db - 2*da*b0)/(da*db).
+static inline double edge_min(double a0, double b0, double a1, double b1)
+{
+	double zmin = std::min(a0/sqrt(b0), a1/sqrt(b1));
+	const double da = a1-a0, db = b1-b0;
+	if(da*db != 0.0) {
+		double s = (a0*db - 2.0*da*b0)/(da*db);
+		if(0.0 < s && s < 1.0)
+			zmin = std::min(zmin, (a0+s*da)/sqrt(b0+s*db));
+	}
+	return zmin;
+}
+
+// Used when there are too many clauses to enumerate. 
+//
+// Let a_i = zeta_i(E)*zeta_i(X) and b_i = zeta_i(E)^2. Each clause I is
+// a point P(I) = (sum_I a_i, sum_I b_i) of the plane, and we seek the minimum 
+// of A/sqrt(B) over these points. In the region A<=0 the superlevel sets of
+// A/sqrt(B) are convex, therefore, if the minimum over the vertices of the convex
+// hull of the points is <= 0, it is the exact minimum. Else, all points have A>0 
+// and the minimum over the hull boundary (its edges) is a lower bound. 
+//
+// The vertex of the hull which is extreme in direction (cos t, sin t) is the
+// clause of the m smallest a_i cos t + b_i sin t. The order of these values 
+// only changes at the O(l^2) angles where two of them are equal, so we
+// visit every vertex by sampling one angle between each pair of consecutive critical 
+// angles. The cost is O(l^3) per call.
+static double find_min_hull(size_t m, size_t l, const double* a, const double* b)
+{
+	// the critical angles in [0, 2pi)
+	const double twopi = 2.0*M_PI;
+	double theta[l*(l-1)+1];
+	size_t na = 0;
+	for(size_t i=0; i<l; i++)
+		for(size_t j=i+1; j<l; j++) {
+			const double da = a[i]-a[j], db = b[i]-b[j];
+			if(da==0.0 && db==0.0) continue;
+			double t = atan2(-da, db);
+			if(t<0.0) t += twopi;
+			theta[na++] = t;
+			theta[na++] = (t<M_PI) ? t+M_PI : t-M_PI;
+		}
+	if(na==0) theta[na++] = 0.0;
+	std::sort(theta, theta+na);
+
+	size_t idx[l];
+	double v[l];
+	std::iota(idx, idx+l, 0);
+
+	double zvert = INFINITY;		// minimum over vertices
+	double zedge = INFINITY;		// minimum over edges
+	double A0=0.0, B0=0.0, Ap=0.0, Bp=0.0;	// first and previous vertex
+	bool first = true;
+
+	for(size_t q=0; q<na; q++) {
+		const double t = (q+1<na) ? 0.5*(theta[q]+theta[q+1]) 
+			: 0.5*(theta[q]+theta[0]+twopi);
+		const double c = cos(t), s = sin(t);
+		for(size_t i=0; i<l; i++) v[i] = a[i]*c + b[i]*s;
+		std::nth_element(idx, idx+(m-1), idx+l, [&](size_t i, size_t j) { return v[i]<v[j]; });
+
+		double A = 0.0, B = 0.0;
+		for(size_t j=0; j<m; j++) { A += a[idx[j]]; B += b[idx[j]]; }
+
+		zvert = std::min(zvert, A/sqrt(B));
+		if(first) {
+			A0 = A; B0 = B;
+			first = false;
+		} else if(A!=Ap || B!=Bp) 
+			zedge = std::min(zedge, edge_min(Ap, Bp, A, B));
+		Ap = A; Bp = B;
+	}
+	// close the polygon
+	zedge = std::min(zedge, edge_min(Ap, Bp, A0, B0));
+
+	return (zvert <= 0.0) ? zvert : std::min(zvert, zedge);
+}
+
+
 // This recursion is used to compute zinf, when the cached array is all clause denominators.
 // The recursion performs C additions, C divisions C comparisons,
 // where C = (l choose m). 
 // In particular, no sqrt() are performed!
-static double find_min_cached(size_t m, size_t l, size_t b, const Vec& zEzX, double SzEzX, double*& D)
+static double find_min_cached(size_t m, size_t l, size_t b, const double* zEzX, double SzEzX, double*& D)
 {
 	if(m==0) { 
 		return SzEzX/(*D++);
@@ -129,18 +235,21 @@ static double find_min_cached(size_t m, size_t l, size_t b, const Vec& zEzX, dou
 	return zinf;
 }
 
-double quorum_safezone::zeta_eikonal(const Vec& zX) 
+double quorum_safezone::zeta_eikonal(const double* zX) 
 {
+	const size_t l = L.size();
+	const size_t m = l-k+1;
+
 	// precompute  zeta_i(E)*zeta_i(X) for all i\in L
-	Vec zEzX = zetaE;
-	zEzX *= zX[L];
+	double zEzX[l];
+	for(size_t j=0; j<l; j++)
+		zEzX[j] = zetaE[j]*zX[L[j]];
 
+	// The cache is prepared along with an eikonal function; this is
+	// reached only when a non-eikonal function is evaluated eikonally.
 	if(z_cached.size()==0)
 		prepare_z_cache();
 
-	const size_t l = L.size();
-	const size_t m = l-k+1;
-
 	//
 	// Select the appropriate algorithm for the precomputed values
 	// in z_cached.
@@ -152,9 +261,12 @@ double quorum_safezone::zeta_eikonal(const Vec& zX)
 		double* D = begin(z_cached);  // Assuming begin(z_cached) is a double* !!!
 		zinf = find_min_cached(m, l, 0, zEzX, 0.0, D);
 		assert(D==end(z_cached));
-	} else {
+	} else if(num_clauses <= max_exact_clauses) {
 		// precomputed zeta_i(E)^2
-		zinf = find_min(m, l, 0, zEzX, z_cached, 0.0, 0.0);
+		zinf = find_min(m, l, 0, zEzX, begin(z_cached), 0.0, 0.0);
+	} else {
+		// too many clauses, use the convex hull of the clauses
+		zinf = find_min_hull(m, l, zEzX, begin(z_cached));
 	}
 
 	return zinf;
@@ -162,11 +274,46 @@ double quorum_safezone::zeta_eikonal(const Vec& zX)
 
 
 
-double quorum_safezone::zeta_non_eikonal(const Vec& zX) 
+double quorum_safezone::zeta_non_eikonal(const double* zX) 
 {
-	Vec zEzX = zetaE;
-	zEzX *= zX[L];
-	std::nth_element(begin(zEzX), begin(zEzX)+(L.size()-k), end(zEzX));
-	return std::accumulate(begin(zEzX), begin(zEzX)+(L.size()-k+1), 0.0);
+	const size_t l = L.size();
+	double zEzX[l];
+	for(size_t j=0; j<l; j++)
+		zEzX[j] = zetaE[j]*zX[L[j]];
+	std::nth_element(zEzX, zEzX+(l-k), zEzX+l);
+	return std::accumulate(zEzX, zEzX+(l-k+1), 0.0);
+}
+
+
+double quorum_safezone::zeta_non_eikonal(incremental_state& inc, const double* zX) const
+{
+	const size_t l = L.size();
+	double zEzX[l];
+	for(size_t j=0; j<l; j++)
+		zEzX[j] = zetaE[j]*zX[L[j]];
+
+	std::vector<size_t>& P = inc.order;
+	if(P.size()!=l) {
+		// first call, sort from scratch
+		P.resize(l);
+		std::iota(P.begin(), P.end(), 0);
+		std::sort(P.begin(), P.end(), [&](size_t a, size_t b) { return zEzX[a]<zEzX[b]; });
+	} else {
+		// repair the previous order by insertion sort
+		for(size_t i=1; i<l; i++) {
+			const size_t p = P[i];
+			const double z = zEzX[p];
+			size_t j = i;
+			for(; j>0 && zEzX[P[j-1]] > z; j--)
+				P[j] = P[j-1];
+			P[j] = p;
+		}
+	}
+
+	// sum the l-k+1 smallest
+	double sum = 0.0;
+	for(size_t i=0; i<l-k+1; i++)
+		sum += zEzX[P[i]];
+	return sum;
 }
 
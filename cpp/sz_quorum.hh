@@ -27,6 +27,12 @@ using namespace hdv;
 	in the original estimate vector, or, equivalently, the number
 	of positive elements of vector \f$zE\f$ passed at construction). 
 
+	When the number of clauses exceeds \c max_exact_clauses, the
+	eikonal function is instead computed from the convex hull of the
+	clauses, in time \f$O(l^3)\f$. The result is exact when it is
+	non-positive. Otherwise it is a positive lower bound on the exact
+	value, which is still a valid (slightly conservative) safe zone.
+
 	Because it is so expensive for large \f$n\f$, a fast safe zone
 	is also available. Its advantage is that it is quite efficient: 
 	each call takes \f$O(l)\f$ time.
@@ -47,20 +53,65 @@ struct quorum_safezone
 
 
 	void prepare(const Vec& zE, size_t _k);
-	void set_eikonal(bool _eik) { eikonal = _eik; }
+	void set_eikonal(bool _eik);
 
 
-	double zeta_eikonal(const Vec& zX);
-	double zeta_non_eikonal(const Vec& zX);
+	/**
+		Evaluate on the input zetas \c zX[0:n]. These versions
+		do not allocate, and they do not modify the object, so that
+		they can be called concurrently.
+	  */
+	double zeta_eikonal(const double* zX);
+	double zeta_non_eikonal(const double* zX);
 
-	inline double operator()(const Vec& zX) {
+	inline double operator()(const double* zX) {
 		return (eikonal) ? zeta_eikonal(zX) : zeta_non_eikonal(zX);
 	}
 
+	inline double zeta_eikonal(const Vec& zX) { return zeta_eikonal(&zX[0]); }
+	inline double zeta_non_eikonal(const Vec& zX) { return zeta_non_eikonal(&zX[0]); }
+
+	inline double operator()(const Vec& zX) {
+		return (*this)(&zX[0]);
+	}
+
+	/**
+		Incremental state for the non-eikonal function.
+
+		This is the order of the legal inputs by \f$ \zeta_i(E)\zeta_i(X) \f$
+		at the previous evaluation. Between successive evaluations of 
+		an incremental computation, the inputs change slightly, so the
+		order is repaired by insertion sort, in time linear in \f$l\f$ 
+		plus the number of inputs that changed places.
+	  */
+	struct incremental_state {
+		std::vector<size_t> order;
+	};
+
+	/**
+		Evaluate the non-eikonal function on the input zetas \c zX[0:n], 
+		maintaining the order of the inputs in \c inc. The eikonal 
+		function ignores \c inc.
+	  */
+	double zeta_non_eikonal(incremental_state& inc, const double* zX) const;
+
+	inline double operator()(incremental_state& inc, const double* zX) {
+		return (eikonal) ? zeta_eikonal(zX) : zeta_non_eikonal(inc, zX);
+	}
+
+	inline double operator()(incremental_state& inc, const Vec& zX) {
+		return (*this)(inc, &zX[0]);
+	}
+
 
 private:
 	Vec z_cached; // Caching coefficients for faster execution
 	static constexpr size_t cached_bound = 19; // bound under which to cache
+	size_t num_clauses = 0;	// clause count, saturated at max_exact_clauses+1
+public:
+	/// Above this many clauses, the eikonal function uses the convex hull algorithm
+	static constexpr size_t max_exact_clauses = 200000;
+private:
 	void prepare_z_cache();
 };
 
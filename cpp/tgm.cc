@@ -0,0 +1,461 @@
+#include <algorithm>
+
+#include "tgm.hh"
+
+using namespace dds;
+using namespace gm;
+using namespace gm::tgm;
+
+
+/*
+	Split a non-negative slack among the children, in proportion to their
+	number of sites, and call set(i, share) for the i-th child. The shares
+	add up to the slack.
+ */
+template <typename Func>
+static void share_slack(int slack, const vector<size_t>& leaves, Func set)
+{
+	assert(slack >= 0);
+	size_t total = 0;
+	for(auto l : leaves) total += l;
+
+	size_t cum = 0;
+	for(size_t i=0; i<leaves.size(); i++) {
+		const size_t lo = (slack*cum)/total;
+		cum += leaves[i];
+		const size_t hi = (slack*cum)/total;
+		set(i, (int)(hi-lo));
+	}
+}
+
+
+/*********************************************
+	node
+*********************************************/
+
+void node::notify_coordinator()
+{
+	parent.threshold_crossed(this, pending_dbw);
+}
+
+
+void node::setup_connections()
+{
+	parent <<= static_cast<aggregator*>(net()->parent(this));
+}
+
+
+node::node(network_t* net, source_id hid, continuous_query* _Q)
+	: 	frgm::node_base(net, hid, _Q),
+		parent( this )
+{ }
+
+
+/*********************************************
+	aggregator
+*********************************************/
+
+oneway aggregator::reset(const safezone& newsz)
+{
+	// the sites reset their bitweights, as in a new subround
+	bits = 0;
+	budget = leaves;
+	child_bits.assign(aggrs.size(), 0);
+
+	for(auto a : aggrs)
+		aggr_proxies[a].reset(newsz);
+	for(auto n : sites)
+		site_proxies[n].reset(newsz);
+}
+
+
+oneway aggregator::start_subround(float theta)
+{
+	bits = 0;
+	budget = leaves;
+	child_bits.assign(aggrs.size(), 0);
+
+	for(auto a : aggrs)
+		aggr_proxies[a].start_subround(theta);
+	for(auto n : sites)
+		site_proxies[n].reset_bitweight(theta);
+}
+
+
+float aggregator::get_zeta()
+{
+	double zeta = 0.0;
+	for(auto a : aggrs)
+		zeta += aggr_proxies[a].get_zeta();
+	for(auto n : sites)
+		zeta += site_proxies[n].get_zeta();
+	return zeta;
+}
+
+
+int aggregator::get_bits()
+{
+	// the bits of the sites are always known
+	if(! aggrs.empty()) {
+		bits = 0;
+		for(size_t i=0; i<aggrs.size(); i++) {
+			child_bits[i] = aggr_proxies[aggrs[i]].get_bits();
+			bits += child_bits[i];
+		}
+	}
+	return bits;
+}
+
+
+oneway aggregator::set_budget(int _budget)
+{
+	budget = _budget;
+	share_budget();
+}
+
+
+void aggregator::share_budget()
+{
+	if(aggrs.empty()) return;
+	share_slack(budget-bits, child_leaves, [&](size_t i, int share) {
+		aggr_proxies[aggrs[i]].set_budget(child_bits[i] + share);
+	});
+}
+
+
+oneway aggregator::threshold_crossed(sender<node> ctx, int delta_bits)
+{
+	bits += delta_bits;
+	if(bits > budget)
+		escalate();
+}
+
+
+oneway aggregator::child_exceeded(sender<aggregator> ctx, int)
+{
+	get_bits();
+	if(bits > budget)
+		escalate();
+	else
+		share_budget();
+}
+
+
+void aggregator::escalate()
+{
+	if(up)
+		aggr_proxies[up].child_exceeded(this, bits);
+	else
+		coord[net()->hub].child_exceeded(this, bits);
+}
+
+
+double aggregator::reset_lambda(float _lambda)
+{
+	double psi = 0.0;
+	for(auto a : aggrs)
+		psi += aggr_proxies[a].reset_lambda(_lambda);
+	for(auto n : sites)
+		psi += site_proxies[n].reset_lambda(_lambda);
+	return psi;
+}
+
+
+compressed_state_obj aggregator::flush_drift()
+{
+	vector<compressed_state_obj> drifts;
+	drifts.reserve(aggrs.size()+sites.size());
+	for(auto a : aggrs)
+		drifts.push_back(aggr_proxies[a].flush_drift());
+	for(auto n : sites)
+		drifts.push_back(site_proxies[n].flush_drift());
+
+	Vec drift(0.0, Q->state_vector_size());
+	size_t updates = 0;
+	for(auto& cs : drifts)
+		updates += cs.updates;
+	add_states(drift, drifts);
+	return compressed_state_obj { drift, updates, Q->config.codec };
+}
+
+
+void aggregator::setup_connections()
+{
+	network_t* nw = net();
+
+	process* p = nw->parent(this);
+	if(p == nw->hub) {
+		up = nullptr;
+		coord.add(nw->hub);
+	} else {
+		up = static_cast<aggregator*>(p);
+		aggr_proxies.add(up);
+	}
+
+	aggrs = nw->child_aggregators(this);
+	sites = nw->child_sites(this);
+	for(auto a : aggrs) {
+		aggr_proxies.add(a);
+		child_leaves.push_back(nw->leaves(a));
+	}
+	for(auto n : sites)
+		site_proxies.add(n);
+
+	leaves = nw->leaves(this);
+	child_bits.assign(aggrs.size(), 0);
+	bits = 0;
+	budget = leaves;
+}
+
+
+aggregator::aggregator(network_t* nw, continuous_query* _Q)
+	: 	process(nw), Q(_Q), up(nullptr), coord(this),
+		aggr_proxies(this), site_proxies(this),
+		leaves(0), bits(0), budget(0)
+{
+	set_name(nw->name()+":aggr");
+}
+
+
+/*********************************************
+	coordinator
+*********************************************/
+
+void coordinator::start_round()
+{
+	// discard the cached safe zone data of the previous round
+	safe_zone->begin_round();
+
+	// reset rebalancing
+	psi_Ebal = 0.0;
+	DeltaEbal = 0.0;
+	lambda = 1.0; mu = 0.0;
+
+	// update statistics
+	num_rounds++;
+	num_subrounds++;
+
+	bit_level = 1;
+	child_bits.assign(children.size(), 0);
+
+	// ship safe zone to nodes
+	for(size_t i=0; i<children.size(); i++) {
+		sz_sent += child_leaves[i];
+		proxy[children[i]].reset(safezone(safe_zone, cfg().codec));
+	}
+}
+
+
+void coordinator::start_subround(double total_zeta)
+{
+	num_subrounds++;
+	child_bits.assign(children.size(), 0);
+
+	// compute subround quantum
+	double theta = (total_zeta + psi_Ebal)/(2.0*k);
+
+	for(auto a : children)
+		proxy[a].start_subround(theta);
+}
+
+
+oneway coordinator::child_exceeded(sender<aggregator> ctx, int)
+{
+	num_polls++;
+	int total_bits = 0;
+	for(size_t i=0; i<children.size(); i++) {
+		child_bits[i] = proxy[children[i]].get_bits();
+		total_bits += child_bits[i];
+	}
+
+	if(total_bits > (int)k) {
+		finish_subround();
+		return;
+	}
+
+	share_slack(k-total_bits, child_leaves, [&](size_t i, int share) {
+		proxy[children[i]].set_budget(child_bits[i] + share);
+	});
+}
+
+
+void coordinator::finish_subround()
+{
+	// continue the aprroximation of zeta
+	double total_zeta = 0.0;
+	for(auto a : children)
+		total_zeta += proxy[a].get_zeta();
+
+	bit_level++;
+
+	if( (total_zeta + psi_Ebal) < k * query->zeta_E * epsilon_psi )
+		finish_subrounds(total_zeta);
+	else
+		start_subround(total_zeta);
+}
+
+
+size_t coordinator::collect_drift_vectors()
+{
+	size_t upd = 0;
+	vector<compressed_state_obj> drifts;
+	drifts.reserve(children.size());
+	for(auto a : children) {
+		drifts.push_back(proxy[a].flush_drift());
+		upd += drifts.back().updates;
+	}
+	add_states(DeltaEbal, drifts);
+	total_updates += upd;
+	return upd;
+}
+
+
+double coordinator::collect_psi(double lambda)
+{
+	double psi = 0.0;
+	for(auto a : children)
+		psi += proxy[a].reset_lambda(lambda);
+	return psi;
+}
+
+
+bool coordinator::rebalance_bimodal(double& psi)
+{
+	lambda = mu = 0.5;
+
+	psi = collect_psi(lambda);
+	psi_Ebal = k*mu* query->compute_zeta( DeltaEbal / (mu*k) );
+
+	// rebalancing criterion
+	return ( (psi_Ebal + psi) >= k * query->zeta_E * 0.1 );
+}
+
+
+bool coordinator::rebalanced(double& psi)
+{
+	switch(cfg().rebalance_algorithm) {
+		case rebalancing::bimodal:
+			return rebalance_bimodal(psi);
+		case rebalancing::none:
+			return false;
+		default:
+			throw runtime_error("Unknown rebalance algorithm for TGM: "
+				+rebalancing_repr[cfg().rebalance_algorithm]);
+	}
+}
+
+
+void coordinator::finish_subrounds(double psi)
+{
+	size_t nupdates = collect_drift_vectors();
+
+	// cut off if very few updates
+	if(nupdates <= 40*k) {
+		restart_round();
+		return;
+	}
+
+	if(rebalanced(psi)) {
+		start_subround(psi);
+		return;
+	}
+
+	restart_round();
+}
+
+
+void coordinator::restart_round()
+{
+	finish_round();
+	start_round();
+}
+
+
+void coordinator::finish_round()
+{
+	query->update_estimate(DeltaEbal / (double)k);
+}
+
+
+void coordinator::finish_rounds()
+{
+	finish_round();
+}
+
+
+void coordinator::warmup()
+{
+	Vec dE(Q->state_vector_size());
+
+	Q->update_all(dE, CTX.warmup);
+
+	query->update_estimate(dE/(double)k);
+}
+
+
+void coordinator::setup_connections()
+{
+	for(auto a : net()->child_aggregators(this)) {
+		proxy.add(a);
+		children.push_back(a);
+		child_leaves.push_back(net()->leaves(a));
+	}
+	child_bits.assign(children.size(), 0);
+}
+
+
+coordinator::coordinator(network_t* nw, continuous_query* _Q)
+: 	process(nw), proxy(this),
+	Q(_Q),
+	query(Q->create_query_state()),
+	k(nw->hids.size()),
+	bit_level(0),
+	DeltaEbal(0.0, Q->state_vector_size()),
+	psi_Ebal(0.0),
+	lambda(1.0), mu(0.0),
+	epsilon_psi(0.01),
+
+	Qest_series(nw->name()+".qest", "%.10g", [&]() { return query->Qest;} ),
+	num_rounds(0),
+	num_subrounds(0),
+	num_polls(0),
+	sz_sent(0),
+	total_rbl_size(0),
+	total_updates(0)
+{
+	set_name(nw->name()+":coord");
+	safe_zone = query->safezone();
+
+	if(cfg().epsilon_psi.has_value()) epsilon_psi = cfg().epsilon_psi.value();
+}
+
+
+coordinator::~coordinator()
+{
+	delete safe_zone;
+	delete query;
+}
+
+
+/*********************************************
+
+	network
+
+*********************************************/
+
+
+tgm::network::network(const string& _name, continuous_query* _Q)
+	: 	gm_network_t(_name, _Q, _Q->config.tree_fanout)
+{
+	this->set_protocol_name("TGM");
+}
+
+
+void tgm::network::output_results()
+{
+	gm_network_t::output_results();
+	network_level_traffic.output_results(this, this->level_hosts());
+}
+
+
+gm::p_component_type< gm::tgm::network > gm::tgm::tgm_comptype("TGM");
@@ -0,0 +1,293 @@
+#ifndef __TGM_HH__
+#define __TGM_HH__
+
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "gm_proto.hh"
+#include "frgm.hh"
+
+/**
+	\file Hierarchical geometric monitoring.
+
+	The sites are the leaves of a tree of aggregators, whose root is the
+	coordinator (see \c tree_network). The sites run the FRGM site
+	protocol, but they report their threshold crossings to their parent
+	aggregator, instead of the coordinator.
+
+	Each aggregator has a bit budget for its subtree, initially equal to
+	the number of sites in it. When the bits of the subtree exceed the
+	budget, the aggregator polls its children for their exact bit counts
+	and, if the total still exceeds the budget, it escalates to its parent.
+	Otherwise, it splits the slack among its children, in proportion to
+	their number of sites. The budgets of the children of each node add
+	up to its budget, and the budget of the coordinator is \f$k\f$. Thus,
+	the subrounds end exactly when the total bits exceed \f$k\f$, as in
+	FRGM, but most threshold crossings are absorbed within the tree.
+
+	All other calls of the coordinator (new safe zones, zeta and drift
+	collection, rebalancing) are forwarded down the tree, and the answers
+	are combined by the aggregators on the way up.
+  */
+
+namespace gm { namespace tgm {
+
+using std::vector;
+using namespace dds;
+
+
+struct coordinator;
+struct aggregator;
+struct node;
+struct aggr_proxy;
+struct node_proxy;
+
+struct network
+	: 	gm_network<network, coordinator, node,
+			tree_network<network, coordinator, aggregator, node> >
+{
+	typedef gm_network<network_t, coordinator_t, node_t,
+			tree_network<network_t, coordinator_t, aggregator, node_t> > gm_network_t;
+
+	network(const string& name, continuous_query* _Q);
+
+	void output_results() override;
+};
+
+
+/**
+	The TGM coordinator
+  */
+struct coordinator : process
+{
+	typedef coordinator coordinator_t;
+	typedef node node_t;
+	typedef network network_t;
+
+	proxy_map<aggr_proxy, aggregator> proxy;
+
+	//
+	// protocol stuff
+	//
+
+	continuous_query* Q; 		// continuous query
+	query_state* query;			// current query state
+	safezone_func *safe_zone;	// the safe zone proper
+
+	size_t k;					// number of sites
+
+	// the children, with their number of sites and their last known bits
+	vector<aggregator*> children;
+	vector<size_t> child_leaves;
+	vector<int> child_bits;
+
+	int bit_level;		// the current bit-level (# of subround?)
+
+	Vec DeltaEbal;		// The sum of the drifts collected in this round
+	double psi_Ebal;	// Balance weight, as in FRGM
+	double lambda, mu;	// The rebalancing factors, as in FRGM
+	double epsilon_psi = 0.01;
+
+	// reports the series of query estimate
+	computed<double> Qest_series;
+
+	// statistics
+	size_t num_rounds;      // number of rounds
+	size_t num_subrounds;   // number of subrounds
+	size_t num_polls;		// number of bit polls of the children
+	size_t sz_sent;         // safe zones sent
+	size_t total_rbl_size; 	// total size of rebalance sets
+	size_t total_updates;	// number of stream updates received
+
+	coordinator(network_t* nw, continuous_query* _Q);
+	~coordinator();
+
+	inline network_t* net() const { return static_cast<network_t*>(host::net()); }
+	inline const protocol_config& cfg() const { return Q->config; }
+
+	void setup_connections() override;
+
+	// load the warmup dataset
+	void warmup();
+
+	// remote call when the bits of a subtree exceed its budget
+	oneway child_exceeded(sender<aggregator> ctx, int bits);
+
+	void start_round();   // initialize a new round
+	void restart_round(); // finish current round and start new one
+	void finish_round();  // finish current round
+	void finish_rounds();  // finish last round
+
+	void start_subround(double total_zeta);   // initialize a new subround
+	void finish_subround();                   // finish the subround
+	void finish_subrounds(double psi);  	  // try to rebalance (optional)
+
+	// collect the drift vectors into DeltaEbal, return the number of updates
+	size_t collect_drift_vectors();
+
+	// calls the appropriate rebalancing algorithm, returns true on success
+	bool rebalanced(double& psi);
+	bool rebalance_bimodal(double& psi);
+
+	// sends new lambda to all sites, returns new psi
+	double collect_psi(double lambda);
+};
+
+
+struct coord_proxy : remote_proxy< coordinator >
+{
+	typedef coordinator coordinator_t;
+	REMOTE_METHOD(coordinator_t, child_exceeded);
+	coord_proxy(process* c) : remote_proxy< coordinator_t >(c) { }
+};
+
+
+/**
+	The TGM aggregator.
+
+	The children of an aggregator are either all sites or all
+	aggregators.
+  */
+struct aggregator : process
+{
+	typedef network network_t;
+
+	continuous_query* Q;
+
+	aggregator* up;						// the parent, or null for the coordinator
+	proxy_map<coord_proxy, coordinator> coord;
+	proxy_map<aggr_proxy, aggregator> aggr_proxies;
+	proxy_map<node_proxy, node> site_proxies;
+
+	// the children, with their number of sites and their last known bits
+	vector<aggregator*> aggrs;
+	vector<node*> sites;
+	vector<size_t> child_leaves;
+	vector<int> child_bits;
+
+	size_t leaves;			// the number of sites in the subtree
+	int bits;				// the bits of the subtree, up to date after a poll
+	int budget;				// the bits allowed to the subtree
+
+	aggregator(network_t* nw, continuous_query* _Q);
+
+	inline network_t* net() const { return static_cast<network_t*>(host::net()); }
+
+	void setup_connections() override;
+
+	// report to the parent that the budget was exceeded
+	void escalate();
+
+	// split the slack of the budget among the aggregator children
+	void share_budget();
+
+	//-----------------------------------
+	// Remote methods
+	//-----------------------------------
+
+	// Called at the start of a round
+	oneway reset(const safezone& newsz);
+
+	// Called at the start of a new subround (not the first)
+	oneway start_subround(float theta);
+
+	// Sum of the zetas of the subtree
+	float get_zeta();
+
+	// Poll the exact bits of the subtree
+	int get_bits();
+
+	// Set the budget of the subtree
+	oneway set_budget(int _budget);
+
+	// Called by a site child, when its bitweight increases
+	oneway threshold_crossed(sender<node> ctx, int delta_bitw);
+
+	// Called by an aggregator child, when it exceeds its budget
+	oneway child_exceeded(sender<aggregator> ctx, int bits);
+
+	// Sum of the new zetas of the subtree
+	double reset_lambda(float _lambda);
+
+	// The sum of the drift vectors of the subtree
+	compressed_state_obj flush_drift();
+};
+
+
+struct aggr_proxy : remote_proxy< aggregator >
+{
+	typedef aggregator aggregator_t;
+
+	REMOTE_METHOD(aggregator_t, reset);
+	REMOTE_METHOD(aggregator_t, start_subround);
+	REMOTE_METHOD(aggregator_t, get_zeta);
+	REMOTE_METHOD(aggregator_t, get_bits);
+	REMOTE_METHOD(aggregator_t, set_budget);
+	REMOTE_METHOD(aggregator_t, threshold_crossed);
+	REMOTE_METHOD(aggregator_t, child_exceeded);
+	REMOTE_METHOD(aggregator_t, reset_lambda);
+	REMOTE_METHOD(aggregator_t, flush_drift);
+
+	aggr_proxy(process* p) : remote_proxy< aggregator_t >(p) {}
+};
+
+
+/**
+	The TGM node. This is the FRGM node, whose coordinator is its parent
+	aggregator.
+  */
+struct node : frgm::node_base
+{
+	typedef coordinator coordinator_t;
+	typedef node node_t;
+	typedef node_proxy node_proxy_t;
+	typedef network network_t;
+
+	aggr_proxy parent;
+
+	node(network_t* net, source_id hid, continuous_query* _Q);
+
+	inline network_t* net() const { return static_cast<network_t*>(host::net()); }
+
+	void setup_connections() override;
+
+	// notify the parent, after update_local() returned true
+	void notify_coordinator() override;
+};
+
+
+struct node_proxy : remote_proxy< node >
+{
+	typedef node node_t;
+
+	REMOTE_METHOD(node_t, reset);
+	REMOTE_METHOD(node_t, reset_bitweight);
+	REMOTE_METHOD(node_t, reset_lambda);
+	REMOTE_METHOD(node_t, get_zeta);
+	REMOTE_METHOD(node_t, flush_drift);
+
+	node_proxy(process* p) : remote_proxy< node_t >(p) {}
+};
+
+} // end namespace gm::tgm
+
+}  // end namespace gm
+
+
+namespace dds{
+
+template <>
+inline size_t byte_size< gm::tgm::node *>
+	(gm::tgm::node * const &) { return 4; }
+
+template <>
+inline size_t byte_size< gm::tgm::aggregator *>
+	(gm::tgm::aggregator * const &) { return 4; }
+
+}
+
+
+
+#endif
@@ -14,6 +14,7 @@
 
 #include "data_source.hh"
 #include "safezone.hh"
+#include "cfgfile.hh"
 #include "binc.hh"
 
 #include <cxxtest/TestSuite.h>
@@ -32,6 +33,31 @@ class TimingTestSuite : public CxxTest::TestSuite
 public:
 
 
+	void test_hash_policies()
+	{
+		const size_t N = 1000000;
+		vector<size_t> keys(N);
+		for(size_t i=0; i<N; i++) keys[i] = (i*2654435761ull) & 0xffffffull;
+
+		for(auto pol : { hash_policy::poly31, hash_policy::tabulation, 
+				hash_policy::multiply_shift, hash_policy::mix64 }) {
+			hash_family* hf = hash_family::get_cached(7, pol);
+			size_t h[7];
+			bool s[7];
+			size_t acc = 0;
+
+			boost::timer::auto_cpu_timer t;
+			print("Timing hash policy", hash_policy_repr[pol], ":");
+			for(size_t i=0; i<N; i++) {
+				hf->hash_all(keys[i], h);
+				hf->fourwise_all(keys[i], s);
+				acc += h[i%7] + s[i%7];
+			}
+			TS_ASSERT_LESS_THAN(0, acc);
+		}
+	}
+
+
 	void test_twoway_join_agms_safezone()
 	{
 		projection proj(7,500);
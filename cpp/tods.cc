@@ -74,11 +74,25 @@ tods::network::network(const string& _name, const projection& _proj, double _the
 
 void tods::network::process_warmup()
 {
-	// ok, first spread the goods to the node states
+	// ok, first spread the goods to the node states, grouping 
+	// the records of each node state into a batch
+	map<node_stream_state*, pair<vector<size_t>, vector<double>> > batch;
 	for(auto&& rec : CTX.warmup) {
 		if(streams.find(rec.sid) == streams.end()) continue;
-		sites[rec.hid]->stream_state[rec.sid]->update(rec.key, rec.upd);
+		auto& b = batch[sites[rec.hid]->stream_state[rec.sid]];
+		b.first.push_back(rec.key);
+		b.second.push_back(rec.upd);
 	}
+	// the node states are independent; update them in parallel
+	vector<decltype(batch)::value_type*> jobs;
+	for(auto&& b : batch)
+		jobs.push_back(&b);
+	par::for_shards(jobs.size(), par::num_threads(CTX.warmup.size(), 1<<16),
+		[&](size_t, size_t from, size_t to) {
+			for(size_t j=from; j<to; j++)
+				jobs[j]->first->update_batch(jobs[j]->second.first.data(), 
+					jobs[j]->second.second.data(), jobs[j]->second.first.size());
+		});
 
 	for(stream_id sid : streams) {
 		// flush all node states, adding up to the coord state
@@ -210,7 +224,7 @@ void node_stream_state::update(key_type key, double freq)
 	//
 	//  In the following, X = E + dE  
 	//
-	delta_vector DX = dE.delta;
+	DX.assign(dE.delta);
 	DX += E;
 	dot_inc(norm_X_2, DX);
 
@@ -218,6 +232,31 @@ void node_stream_state::update(key_type key, double freq)
 	delta_updates++;
 }
 
+void node_stream_state::update_batch(const size_t* keys, const double* freqs, size_t n)
+{
+	// The batch is processed in chunks, so that the deltas kept
+	// are at most one chunk
+	for(size_t b=0; b<n; b+=batch_chunk) {
+		const size_t m = std::min(batch_chunk, n-b);
+
+		// 1. Update the current state
+		dE.update_batch(batch_deltas, keys+b, freqs+b, m);
+
+		// 2. Update the norms incrementally, as in update()
+		for(size_t i=0; i<m; i++) {
+			const delta_vector& ddE = batch_deltas[i];
+			dot_inc(norm_dE_2, ddE);
+
+			DX.assign(ddE);
+			DX += E;
+			dot_inc(norm_X_2, DX);
+		}
+	}
+
+	// 3. Record the updates
+	delta_updates += n;
+}
+
 /// check local condition
 bool node_stream_state::local_condition() const
 {
@@ -47,6 +47,9 @@ struct node_stream_state
 	double norm_dE_2;		// dynamically maintained ||dE||**2
 	double theta_2_over_k;	// equal to theta**2/k, used in local condition
 
+	vector<delta_vector> batch_deltas;	// reused by update_batch, at most a chunk
+	delta_vector DX;					// scratch for the delta of E+dE
+
 	node_stream_state(projection proj, double theta, size_t k);
 
 	node_stream_state(const node_stream_state&)=delete;
@@ -55,6 +58,9 @@ struct node_stream_state
 	/// add an update to the state
 	void update(key_type key, double freq);
 
+	/// add a batch of updates to the state
+	void update_batch(const size_t* keys, const double* freqs, size_t n);
+
 	/// check local condition
 	bool local_condition() const;
 